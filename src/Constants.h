@@ -5,6 +5,8 @@
 #ifndef GPU_NBODY_CONSTANTS_H
 #define GPU_NBODY_CONSTANTS_H
 
+/// These are all defaults now, every one of them can be changed at runtime (see config.h / gpu_nbody --help)
+
 #define WIDTH	2048 // Image render width
 #define HEIGHT	2048 // Image render height
     // I do eventually want this to run in real time, but this'll still be useful for that
@@ -12,12 +14,38 @@
 #define SPACE_UNIT 1.5e11 // fundemental unit of distance -- about one AU
 #define MASS_UNIT  4e22 // fundemental unit of mass -- in this case, in kg, a little under the weight of a mole of moles, or about half the mass of the moon
 #define NUM_BODIES (10000) // Number of bodies -- goal is 1e9, or a billion bodies
+#define DELTA_T 0.05 // simulated time per frame
+#define CHECKPOINT_EVERY 0 // save a checkpoint the run can be resumed from every this many frames (see snapshot.h). 0 = never
+#define TRAJECTORY_EVERY 0 // add the bodies to the compressed trajectory every this many frames (see trajectory.h). 0 = never
+#define TRAJECTORY_BLOCK 16 // most frames in one trajectory block. reading a frame decodes its block up to it
+#define TRAJECTORY_POSITION_BITS 32 // fixed point bits positions are stored with, across the root quad (up to 32)
+#define TRAJECTORY_VELOCITY_BITS 16 // and velocities, across the fastest body's speed (up to 16)
+#define TRAJECTORY_OVERWRITE 0 // let a new run replace a trajectory file that's already there (a resumed one carries it on either way)
 #define BODY_MIN_MASS (1024*1) // Minimum value for the mass of a body in Kg
 #define BODY_MAX_MASS (1024*64) // Maximum value for the mass of a body in Kg
 #define BODY_FIXED_MASS MASS_UNIT // Just a fixed mass value, for a simpler first version
 #define RANDOM_BODY_MASS 0 // Whether or not to randomize body mass -- initialized to "no"
+#define SEED 0 // what generated bodies are made from, the same seed always gives the same bodies. 0 = a new one every run (it gets printed)
 #define THETA 1     // the barnes-hut approximation factor
-#define EPSILON 1   // a "smoothing variable". not really sure what it does.
+#define EPSILON 1   // softening length: gravity between two bodies closer than about this gets smoothed out, so a close pass can't fling them off at near infinite speed
+#define MORTON_BUILD 1 // build the tree in parallel from sorted Morton keys instead of inserting bodies one at a time
+#define LEAF_CAPACITY 16 // how many bodies a leaf can hold before build_morton splits it. 1 = one body per leaf
+#define REFIT_TREE 1 // keep last step's tree and only move the bodies that changed leaves (needs MORTON_BUILD)
+#define REFIT_MAX_MOVED 0.25 // rebuild from scratch instead once more than this fraction of bodies changed leaves
+#define REFIT_MAX_OVERFLOW 2 // or once a leaf fills up past this many times LEAF_CAPACITY
+#define REFIT_LOOSENESS 1.5 // a body only changes leaves once it's outside its leaf's quad scaled up by this much
+#define QUADRUPOLE 0 // correct far-away nodes for how their mass is spread out, not just where its center is (see nbody_bench)
+#define FORCE_SOLVER 0 // 0 = Barnes-Hut tree walk, 1 = fast multipole method (fmm.h, needs MORTON_BUILD), 2 = direct summation (direct.h)
+#define DIRECT_CROSSOVER -1 // below this many bodies every solver hands off to direct summation. -1 = time both on this machine at startup
+#define DIRECT_TILE 512 // sources per tile in direct summation, 512 of them (x, y and mass) take up 12 KB of L1
+#define FMM_THETA 0.5 // how far apart two nodes have to be, for their size, before the FMM lets them interact whole
+#define STEP_LEVELS 6 // block timesteps: bodies can take steps as short as delta_t / 2^STEP_LEVELS (up to 62). 0 = everyone takes delta_t
+#define STEP_ETA 0.025 // how short a step a body gets for how hard it's pulled, step = sqrt(2 * STEP_ETA * EPSILON / |accel|)
+#define GROUP_SIZE 32 // bodies that share one tree walk in the grouped force loop. 0 = every body walks on its own
+#define PIN_THREADS 0 // keep each OpenMP thread on one CPU (see pin_threads), OMP_PROC_BIND does the same when it's set
+#define TUNE_ERROR 0 // pick theta and leaf_capacity as the fastest that keep the force error under this fraction, e.g. 0.01 (see ForceTuner). 0 = use them as given
+#define TUNE_EVERY 100 // and pick again every this many frames, as the bodies move around
+#define TUNE_SAMPLES 256 // bodies the force error gets measured on (each costs a direct sum over every body)
 #define PI 3.1415926535
 #define G 0.01 // gravity scaled for our space and mass constants
 
@@ -36,11 +64,21 @@
 #define PARTICLE_BRIGHTNESS 0.55//0.03 for 256/512k, 0.4 for 16k
 #define PARTICLE_SHARPNESS 1.0 // Probably leave this alone
 #define DOT_SIZE 16 // 15  // Range of pixels to render
+#define DOT_SUBPIXELS 16 // where in its pixel a dot can start, each way, for the precomputed dots (see DotStamps)
+#define RENDER_TILE 128 // side of the squares the image gets cut into for drawing in parallel (see Rasterizer)
+#define RENDER_LOD 0 // tree nodes smaller than this many pixels across get drawn as one dot (see LevelOfDetail). 0 = every body
 
 #define INNER_RADIUS 0.3
 #define OUTER_RADIUS 1.5 // size of the disk
 #define SYSTEM_SIZE 1.5 // max distance from disk allowed
 #define RENDER_SCALE 3.5 // zoom level -- shrink to zoom in
+#define RENDER_QUEUE 2 // frames the renderer can fall behind the simulation (see RenderPipeline). 0 = draw each one before the next step
+#define RENDER_THREADS 2 // OpenMP threads the drawing thread draws with, alongside the step's (with RENDER_QUEUE > 0)
+#define ENCODE_THREADS 2 // threads encoding and writing frame files at once (see FrameWriter)
+
+#ifndef TELEMETRY
+#define TELEMETRY 1 // build the telemetry stream in (see telemetry.h). cmake -DTELEMETRY=OFF makes this 0 and compiles it out
+#endif
 
 
 #endif //GPU_NBODY_CONSTANTS_H
@@ -0,0 +1,1432 @@
+//
+// bench_main.cpp
+// Standalone benchmarks for the simulation kernels, separate from the gpu_nbody executable
+// so image writing doesn't get mixed into the numbers
+//
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+#include <random>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "Constants.h"
+#include "quadtree.h"
+#include "utils.h"
+#include "kernels.h"
+#include "fmm.h"
+#include "direct.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "render.h"
+#include "frames.h"
+
+// seconds since some arbitrary point, for timing
+static double now() {
+    using clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(clock::now().time_since_epoch()).count();
+}
+
+/*  Benchmark of generating a disk of bodies, the old serial mt19937 loop against Philox (see gen_body),
+ *  at 1 thread and every thread. the Philox bodies have to come out bit for bit the same either way,
+ *  and the same again after streaming them to a snapshot file and reading it back
+ */
+static void bench_generate(std::size_t n) {
+    printf("\n== generating %zu disk bodies (%d threads) ==\n", n, omp_get_max_threads());
+    Config config;
+    config.num_bodies = n;
+    config.seed = 12345;
+
+    // the way gen_bodies_disk used to do it, one shared generator, one body after another
+    double start = now();
+    std::mt19937 old_gen(12345);
+    std::uniform_real_distribution<> unit(0, 1);
+    Bodies old_bodies;
+    old_bodies.resize(n);
+    for (std::size_t i = 1; i < n; i++) {
+        old_bodies.mass[i] = 0.001 * (0.8 + 0.4 * unit(old_gen));
+        double angle = 2 * 3.14159265 * unit(old_gen);
+        double radius = config.inner_radius + (config.outer_radius - config.inner_radius) * unit(old_gen);
+        old_bodies.x[i] = radius * cos(angle);
+        old_bodies.y[i] = radius * sin(angle) + 0.08 * (2 * unit(old_gen) - 1);
+        double speed = sqrt(G * 100 / radius) / 2 * (0.9 + 0.2 * unit(old_gen));
+        old_bodies.vx[i] = -speed * sin(angle);
+        old_bodies.vy[i] = speed * cos(angle);
+    }
+    printf("%24s %10.1f ms\n", "mt19937, serial", (now() - start) * 1e3);
+
+    const int threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    start = now();
+    Bodies one = gen_bodies_for(config);
+    printf("%24s %10.1f ms\n", "Philox, 1 thread", (now() - start) * 1e3);
+    omp_set_num_threads(threads);
+    start = now();
+    Bodies all = gen_bodies_for(config);
+    printf("%24s %10.1f ms\n", "Philox, every thread", (now() - start) * 1e3);
+
+    const char* path = "nbody_bench_ics.snap";
+    config.write_ics = path;
+    start = now();
+    bool streamed = stream_bodies(path, config);
+    printf("%24s %10.1f ms\n", "Philox, streamed to disk", (now() - start) * 1e3);
+    // mapped, not read: the pages only come in from disk (or the page cache) as the columns get touched
+    Snapshot read;
+    start = now();
+    streamed = streamed && read_snapshot(path, read);
+    printf("%24s %10.1f ms\n", "read_snapshot (mmap)", (now() - start) * 1e3);
+    std::remove(path);
+
+    auto same = [&](const Bodies& a, const Bodies& b) {
+        for (const Column Bodies::* column : {&Bodies::x, &Bodies::y, &Bodies::vx, &Bodies::vy, &Bodies::mass}) {
+            if (std::memcmp((a.*column).data(), (b.*column).data(), n * sizeof(double)) != 0) { return false; }
+        }
+        return true;
+    };
+    printf("1 thread vs every thread: %s, streamed vs in memory: %s\n",
+           same(one, all) ? "identical" : "MISMATCH", streamed && same(read.bodies, all) ? "identical" : "MISMATCH");
+}
+
+/*  Benchmark of one integration step over every body, the old array of Body structs against Bodies
+ *  the struct version drags each body's whole 64 bytes through the cache to use 48 of them, and
+ *  can't be vectorized across bodies. the arrays version only touches the 4 arrays it changes
+ */
+static void bench_integrate(std::size_t n) {
+    printf("\n== integration step, %zu bodies (%d threads) ==\n", n, omp_get_max_threads());
+    printf("%10s %12s %12s\n", "layout", "ms/step", "GB/s");
+
+    std::vector<Body> structs = gen_bodies_disk(n);
+    Bodies arrays(structs);
+    const double delta_t = 0.05;
+
+    double best = 1e30;
+    for (int rep = 0; rep < 5; rep++) {
+        double start = now();
+        #pragma omp parallel for
+        for (std::size_t i = 0; i < n; i++) {
+            structs[i].update(delta_t);
+        }
+        best = std::min(best, now() - start);
+    }
+    // every byte of every Body comes in and goes back out
+    printf("%10s %12.2f %12.2f\n", "Body", best * 1e3, 2.0 * n * sizeof(Body) / best / 1e9);
+
+    best = 1e30;
+    for (int rep = 0; rep < 5; rep++) {
+        double start = now();
+        arrays.update(delta_t);
+        best = std::min(best, now() - start);
+    }
+    // 6 arrays read, 4 written back
+    printf("%10s %12.2f %12.2f\n", "Bodies", best * 1e3, 10.0 * n * sizeof(double) / best / 1e9);
+
+    // same math in the same order, so it had better be the same answer
+    std::size_t mismatched = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        if (structs[i].pos != arrays.pos(i)) { mismatched++; }
+    }
+    if (mismatched) { printf("MISMATCH: %zu bodies ended up somewhere else\n", mismatched); }
+}
+
+/*  Benchmark of the insert() tree build against build_morton()
+ *  For each n: best of a few builds with each method, then a check that the two trees
+ *  give the same accelerations on a sample of bodies
+ */
+static void bench_build(std::size_t max_n) {
+    printf("\n== tree build: insert vs morton (%d threads) ==\n", omp_get_max_threads());
+    printf("%10s %12s %12s %12s %10s %10s %12s\n",
+           "bodies", "insert (ms)", "morton (ms)", "speedup", "nodes(i)", "nodes(m)", "max rel err");
+
+    for (std::size_t n = 10000; n <= max_n; n *= 10) {
+        Bodies bodies(gen_bodies_disk(n));
+        Quad root;
+        root.new_containing(bodies);
+
+        Quadtree inserted;
+        Quadtree sorted;
+        sorted.leaf_capacity = 1; // one body per leaf, same as insert()
+        double best_insert = 1e30;
+        double best_morton = 1e30;
+        for (int rep = 0; rep < 3; rep++) {
+            double start = now();
+            inserted.reset(root);
+            for (std::size_t i = 0; i < n; i++) {
+                inserted.insert(bodies.pos(i), bodies.mass[i]);
+            }
+            best_insert = std::min(best_insert, now() - start);
+
+            start = now();
+            sorted.build_morton(bodies, root);
+            best_morton = std::min(best_morton, now() - start);
+        }
+        inserted.propogate();
+        sorted.propogate();
+
+        // both trees should agree up to rounding (and bodies sitting right on a quad boundary)
+        double max_err = 0;
+        std::size_t stride = std::max<std::size_t>(n / 1000, 1);
+        for (std::size_t i = 0; i < n; i += stride) {
+            vec2 a = inserted.accel(bodies.pos(i));
+            vec2 b = sorted.accel(bodies.pos(i));
+            vec2 diff(a.x - b.x, a.y - b.y);
+            if (a.mag() > 0) { max_err = std::max(max_err, diff.mag() / a.mag()); }
+        }
+
+        printf("%10zu %12.2f %12.2f %11.1fx %10zu %10zu %12.2e\n",
+               n, best_insert * 1e3, best_morton * 1e3, best_insert / best_morton,
+               inserted.nodes.size(), sorted.nodes.size(), max_err);
+    }
+}
+
+/*  Benchmark of bucketed leaves at different leaf capacities
+ *  Reports node count, depth, build and force times, and how far the forces move from the
+ *  one-body-per-leaf tree (the near buckets get summed exactly, so this is mostly K = 1's own error)
+ */
+static void bench_leaf(std::size_t n) {
+    printf("\n== bucket leaves, %zu bodies in a disk ==\n", n);
+    printf("%6s %10s %6s %12s %14s %12s\n",
+           "K", "nodes", "depth", "build (ms)", "force (ns/body)", "rel diff");
+
+    Bodies bodies(gen_bodies_disk(n));
+    Quad root;
+    root.new_containing(bodies);
+
+    std::vector<vec2> reference(n);
+    for (std::size_t k = 1; k <= 64; k *= 2) {
+        Quadtree ygg;
+        ygg.leaf_capacity = k;
+
+        double start = now();
+        ygg.build_morton(bodies, root);
+        ygg.propogate();
+        double build = now() - start;
+
+        std::vector<vec2> accels(n);
+        start = now();
+        #pragma omp parallel for
+        for (std::size_t i = 0; i < n; i++) {
+            accels[i] = ygg.accel(bodies.pos(i));
+        }
+        double force = now() - start;
+
+        if (k == 1) { reference = accels; }
+        double diff = 0;
+        double total = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            diff += vec2(accels[i].x - reference[i].x, accels[i].y - reference[i].y).mag();
+            total += reference[i].mag();
+        }
+
+        printf("%6zu %10zu %6zu %12.2f %14.1f %12.2e\n",
+               k, ygg.nodes.size(), ygg.depth(), build * 1e3, force * 1e9 / n, diff / total);
+    }
+}
+
+/*  Benchmark of the force walk on its own
+ *  ns/interaction is the number to watch for the node layout: the walk is bound by how fast it can pull
+ *  nodes in, and the arithmetic per interaction barely changes
+ */
+static void bench_force(std::size_t n) {
+    printf("\n== force walk, %zu bodies in a disk (%d threads) ==\n", n, omp_get_max_threads());
+    printf("%6s %10s %12s %14s %14s %14s\n",
+           "K", "nodes", "hot MB", "interactions", "ns/body", "ns/interaction");
+
+    Bodies bodies(gen_bodies_disk(n));
+    Quad root;
+    root.new_containing(bodies);
+
+    for (std::size_t k : {static_cast<std::size_t>(1), static_cast<std::size_t>(LEAF_CAPACITY)}) {
+        Quadtree ygg;
+        ygg.leaf_capacity = k;
+        ygg.build_morton(bodies, root);
+        ygg.propogate();
+
+        std::size_t interactions = 0;
+        double best = 1e30;
+        for (int rep = 0; rep < 3; rep++) {
+            std::size_t counted = 0;
+            double start = now();
+            #pragma omp parallel for reduction(+:counted)
+            for (std::size_t i = 0; i < n; i++) {
+                bodies.set_accel(i, ygg.accel(bodies.pos(i), &counted));
+            }
+            best = std::min(best, now() - start);
+            interactions = counted;
+        }
+
+        printf("%6zu %10zu %12.1f %14.1f %14.1f %14.2f\n",
+               k, ygg.nodes.size(), ygg.trav.size() * sizeof(TravNode) / 1e6,
+               double(interactions) / n, best * 1e9 / n,
+               best * 1e9 * omp_get_max_threads() / interactions);
+    }
+}
+
+/*  Direct summation on a sample of about 200 bodies, the accuracy harness every solver gets checked with
+ *  error() is the relative error summed over the sample, so near-zero forces don't blow it up
+ */
+struct Reference {
+    std::vector<std::size_t> sample;
+    std::vector<vec2> exact;
+
+    explicit Reference(const Bodies& bodies) {
+        for (std::size_t i = 0; i < bodies.size(); i += std::max<std::size_t>(bodies.size() / 200, 1)) {
+            sample.push_back(i);
+        }
+        exact.resize(sample.size());
+        #pragma omp parallel for
+        for (std::size_t s = 0; s < sample.size(); s++) {
+            exact[s] = direct_accel(bodies, bodies.pos(sample[s]));
+        }
+    }
+
+    // accels has one entry per body, in body order
+    double error(const std::vector<vec2>& accels) const {
+        double diff = 0;
+        double total = 0;
+        for (std::size_t s = 0; s < sample.size(); s++) {
+            const vec2& a = accels[sample[s]];
+            diff += vec2(a.x - exact[s].x, a.y - exact[s].y).mag();
+            total += exact[s].mag();
+        }
+        return diff / total;
+    }
+};
+
+// Every body's accel, copied out in body order
+static std::vector<vec2> accels_of(const Bodies& bodies) {
+    std::vector<vec2> accels(bodies.size());
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        accels[i] = vec2(bodies.ax[i], bodies.ay[i]);
+    }
+    return accels;
+}
+
+/*  Benchmark of direct summation, tiled + SIMD against one plain loop per body, and against the tree
+ *  the tiled forces are checked against the plain ones, they should only differ by rounding
+ */
+static void bench_direct(std::size_t max_n) {
+    printf("\n== direct summation (%d threads, tiles of %d) ==\n", omp_get_max_threads(), DIRECT_TILE);
+    printf("%10s %12s %12s %12s %12s %12s\n", "N", "plain (ms)", "tiled (ms)", "Gint/s", "tree (ms)", "tiled err");
+
+    Direct direct;
+    for (std::size_t n = 1024; n <= max_n; n *= 4) {
+        Bodies bodies(gen_bodies_disk(n));
+
+        double start = now();
+        std::vector<vec2> plain(n);
+        #pragma omp parallel for
+        for (std::size_t i = 0; i < n; i++) {
+            plain[i] = direct_accel(bodies, bodies.pos(i));
+        }
+        double plain_time = now() - start;
+
+        double tiled_time = 1e30;
+        for (int rep = 0; rep < 3; rep++) {
+            start = now();
+            direct.accel(bodies);
+            tiled_time = std::min(tiled_time, now() - start);
+        }
+        double diff = 0;
+        double total = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            diff += vec2(bodies.ax[i] - plain[i].x, bodies.ay[i] - plain[i].y).mag();
+            total += plain[i].mag();
+        }
+
+        // what attract() does instead above the crossover
+        start = now();
+        Quad root;
+        root.new_containing(bodies);
+        Quadtree ygg;
+        ygg.build_morton(bodies, root);
+        ygg.propogate();
+        ygg.accel_grouped(bodies, GROUP_SIZE);
+        double tree_time = now() - start;
+
+        printf("%10zu %12.2f %12.2f %12.2f %12.2f %12.1e\n", n, plain_time * 1e3, tiled_time * 1e3,
+               double(n) * n / tiled_time / 1e9, tree_time * 1e3, diff / total);
+    }
+    printf("crossover on this machine: direct below %zu bodies\n", direct_crossover(Config()));
+}
+
+/*  Benchmark of the grouped walk against the per-body walk
+ *  Accuracy is checked two ways: how far the grouped forces are from the per-body ones over all bodies,
+ *  and the error of both against direct summation on a sample
+ */
+static void bench_group(std::size_t n) {
+    printf("\n== grouped walk, %zu bodies in a disk, K = %d ==\n", n, LEAF_CAPACITY);
+    printf("%8s %12s %14s %14s %14s\n", "group", "force (ms)", "vs per-body", "err (walk)", "err (group)");
+
+    Bodies bodies(gen_bodies_disk(n));
+    Quad root;
+    root.new_containing(bodies);
+    Quadtree ygg;
+    ygg.build_morton(bodies, root);
+    ygg.propogate();
+
+    // per-body walk first, it's the baseline
+    std::vector<vec2> walked(n);
+    double start = now();
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        walked[i] = ygg.accel(bodies.pos(i));
+    }
+    double walk_time = now() - start;
+
+    const Reference reference(bodies);
+    const double walk_error = reference.error(walked);
+    printf("%8s %12.2f %14s %14.2e %14s\n", "none", walk_time * 1e3, "-", walk_error, "-");
+
+    for (std::size_t group = 16; group <= 512; group *= 2) {
+        start = now();
+        ygg.accel_grouped(bodies, group);
+        double group_time = now() - start;
+
+        std::vector<vec2> grouped(n);
+        double diff = 0;
+        double total = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            grouped[i] = vec2(bodies.ax[i], bodies.ay[i]);
+            diff += vec2(grouped[i].x - walked[i].x, grouped[i].y - walked[i].y).mag();
+            total += walked[i].mag();
+        }
+        printf("%8zu %12.2f %14.2e %14.2e %14.2e\n",
+               group, group_time * 1e3, diff / total, walk_error, reference.error(grouped));
+    }
+}
+
+/*  The per-body walk split between threads three ways: a static loop over the bodies, a dynamic one, and
+ *  cost zones (walk_bodies, the second time round so it has the first one's costs). The times are on
+ *  however many threads there are. The imbalance doesn't need the cores: from each body's interactions,
+ *  how much more the busiest of T threads gets than the average, with equal counts in body order, equal
+ *  counts in Morton order, and cost zones (before any stealing)
+ */
+static void bench_balance(std::size_t n) {
+    printf("\n== force walk load balance, %zu bodies in a disk, %d threads ==\n", n, omp_get_max_threads());
+    Bodies bodies(gen_bodies_disk(n));
+    Quad root;
+    root.new_containing(bodies);
+    Quadtree ygg;
+    ygg.build_morton(bodies, root);
+    ygg.propogate();
+
+    double start = now();
+    #pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < n; i++) {
+        bodies.set_accel(i, ygg.accel(bodies.pos(i)));
+    }
+    const double static_time = now() - start;
+    start = now();
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (std::size_t i = 0; i < n; i++) {
+        bodies.set_accel(i, ygg.accel(bodies.pos(i)));
+    }
+    const double dynamic_time = now() - start;
+    ygg.walk_bodies(bodies, nullptr); // no costs yet, so this one's zones are equal counts
+    start = now();
+    ygg.walk_bodies(bodies, nullptr);
+    const double zoned_time = now() - start;
+    printf("%12s %12s\n", "schedule", "force (ms)");
+    printf("%12s %12.2f\n", "static", static_time * 1e3);
+    printf("%12s %12.2f\n", "dynamic", dynamic_time * 1e3);
+    printf("%12s %12.2f   (%zu chunks stolen)\n", "cost zones", zoned_time * 1e3, ygg.zones.stolen.load());
+
+    std::vector<float> by_body(ygg.cost.begin(), ygg.cost.end());
+    std::vector<float> by_morton(n);
+    for (std::size_t k = 0; k < n; k++) { by_morton[k] = ygg.cost[ygg.leaf_body[k]]; }
+    double total = 0;
+    for (float c : by_body) { total += c; }
+    // the busiest of threads equal runs of the list, over the average
+    auto equal_counts = [&](const std::vector<float>& cost, int threads) {
+        double most = 0;
+        for (int t = 0; t < threads; t++) {
+            double sum = 0;
+            for (std::size_t k = n * t / threads; k < n * (t + 1) / threads; k++) { sum += cost[k]; }
+            most = std::max(most, sum);
+        }
+        return most / (total / threads);
+    };
+    printf("%8s %14s %14s %14s   (busiest thread / average)\n", "threads", "body order", "morton order", "cost zones");
+    for (int threads : {4, 16, 64, 256}) {
+        // one chunk the size of everything takes each zone whole, in order
+        CostZones zones;
+        zones.split(by_morton.data(), n, threads);
+        double most = 0;
+        for (CostZones::Taker take = zones.taker(n); take.next(); ) {
+            double sum = 0;
+            for (std::size_t k = take.begin; k < take.end; k++) { sum += by_morton[k]; }
+            most = std::max(most, sum);
+        }
+        printf("%8d %14.3f %14.3f %14.3f\n", threads, equal_counts(by_body, threads), equal_counts(by_morton, threads),
+               most / (total / threads));
+    }
+}
+
+/*  Error vs cost of monopoles only against monopoles plus the quadrupole correction, over a range of theta
+ *  error is against direct summation on a sample, the same measure bench_group uses. cost is interactions
+ *  per body and time for the per-body walk, and time for the grouped walk (GROUP_SIZE)
+ */
+static void bench_multipole(std::size_t n) {
+    printf("\n== monopole vs quadrupole, %zu bodies in a disk, K = %d ==\n", n, LEAF_CAPACITY);
+    printf("%6s %6s %14s %12s %12s %12s %12s\n",
+           "theta", "order", "interactions", "walk (ms)", "err (walk)", "group (ms)", "err (group)");
+
+    Bodies bodies(gen_bodies_disk(n));
+    Quad root;
+    root.new_containing(bodies);
+
+    const Reference reference(bodies);
+
+    for (double theta : {0.3, 0.5, 0.7, 1.0, 1.4}) {
+        for (bool quadrupole : {false, true}) {
+            Quadtree ygg;
+            ygg.theta = theta;
+            ygg.quadrupole = quadrupole;
+            ygg.build_morton(bodies, root);
+            ygg.propogate();
+
+            std::vector<vec2> walked(n);
+            std::size_t interactions = 0;
+            double start = now();
+            #pragma omp parallel for reduction(+:interactions)
+            for (std::size_t i = 0; i < n; i++) {
+                walked[i] = ygg.accel(bodies.pos(i), &interactions);
+            }
+            double walk_time = now() - start;
+
+            start = now();
+            ygg.accel_grouped(bodies, GROUP_SIZE);
+            double group_time = now() - start;
+            std::vector<vec2> grouped = accels_of(bodies);
+
+            printf("%6.1f %6s %14.1f %12.2f %12.2e %12.2f %12.2e\n",
+                   theta, quadrupole ? "quad" : "mono", double(interactions) / n,
+                   walk_time * 1e3, reference.error(walked), group_time * 1e3, reference.error(grouped));
+        }
+    }
+}
+
+/*  The force solvers side by side on the same tree: Barnes-Hut per body, Barnes-Hut grouped, and the FMM
+ *  at a few opening angles. Times are propagate (the FMM needs the quadrupoles) plus the force pass, and
+ *  the error is against the same direct-summation sample for all of them, so the table says which one
+ *  to pick for a given body count, layout and accuracy
+ */
+static void bench_solvers(const char* layout, const std::vector<Body>& initial) {
+    const std::size_t n = initial.size();
+    printf("\n== force solvers, %zu bodies (%s), K = %d ==\n", n, layout, LEAF_CAPACITY);
+    printf("%12s %8s %16s %12s %12s\n", "solver", "theta", "propagate (ms)", "force (ms)", "error");
+
+    Bodies bodies(initial);
+    const Reference reference(bodies);
+    Quad root;
+    root.new_containing(bodies);
+    Quadtree ygg;
+    ygg.build_morton(bodies, root);
+
+    auto propagate = [&](bool quadrupole) {
+        ygg.quadrupole = quadrupole;
+        double start = now();
+        ygg.propogate();
+        return now() - start;
+    };
+
+    double prop = propagate(QUADRUPOLE);
+    double start = now();
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        bodies.set_accel(i, ygg.accel(bodies.pos(i)));
+    }
+    printf("%12s %8.2f %16.2f %12.2f %12.2e\n", "walk", ygg.theta, prop * 1e3, (now() - start) * 1e3,
+           reference.error(accels_of(bodies)));
+
+    start = now();
+    ygg.accel_grouped(bodies, GROUP_SIZE);
+    printf("%12s %8.2f %16.2f %12.2f %12.2e\n", "grouped", ygg.theta, prop * 1e3, (now() - start) * 1e3,
+           reference.error(accels_of(bodies)));
+
+    prop = propagate(true);
+    Fmm fmm;
+    for (double theta : {0.3, 0.5, 0.7}) {
+        fmm.theta = theta;
+        double best = 1e30;
+        for (int rep = 0; rep < 2; rep++) {
+            start = now();
+            fmm.accel(ygg, bodies);
+            best = std::min(best, now() - start);
+        }
+        printf("%12s %8.2f %16.2f %12.2f %12.2e\n", "fmm", theta, prop * 1e3, best * 1e3,
+               reference.error(accels_of(bodies)));
+    }
+}
+
+/*  Microbenchmark of the list kernels on their own, with the data sitting in cache
+ *  Every kernel the CPU supports gets run on the same list, and checked against the scalar one
+ *  the quadrupole kernels get a list a few short of a multiple of 8, so the leftover handling gets checked too
+ */
+static void bench_kernel() {
+    const std::size_t list_size = 1024;
+    const std::size_t positions = 4096;
+    printf("\n== list kernels, %zu-long list (picked at runtime: %s) ==\n", list_size, force_kernel().name);
+    printf("%8s %6s %22s %14s %18s %14s\n", "kernel", "width", "interactions/s/core", "max rel diff",
+           "quad terms/s/core", "quad rel diff");
+
+    std::vector<Body> bodies = gen_bodies_disk(list_size + positions);
+    std::vector<double> x(list_size);
+    std::vector<double> y(list_size);
+    std::vector<double> m(list_size);
+    for (std::size_t j = 0; j < list_size; j++) {
+        x[j] = bodies[j].pos.x;
+        y[j] = bodies[j].pos.y;
+        m[j] = bodies[j].mass;
+    }
+    // made up moments, about what a node of a few dozen bodies would have
+    const std::size_t quad_size = list_size - 3;
+    std::vector<double> qxx(list_size);
+    std::vector<double> qxy(list_size);
+    std::vector<double> qyy(list_size);
+    for (std::size_t j = 0; j < list_size; j++) {
+        qxx[j] = 0.03 * m[j] * (1 + x[j] * x[j]);
+        qxy[j] = 0.01 * m[j] * x[j] * y[j];
+        qyy[j] = 0.03 * m[j] * (1 + y[j] * y[j]);
+    }
+
+    std::vector<vec2> reference(positions);
+    std::vector<vec2> quad_reference(positions);
+    for (const ForceKernel& k : force_kernels()) {
+        std::vector<vec2> result(positions);
+        double best = 1e30;
+        for (int rep = 0; rep < 5; rep++) {
+            double start = now();
+            for (std::size_t i = 0; i < positions; i++) {
+                const vec2& p = bodies[list_size + i].pos;
+                result[i] = vec2(0, 0);
+                k.run(x.data(), y.data(), m.data(), list_size, p.x, p.y, G, EPSILON*EPSILON,
+                      &result[i].x, &result[i].y);
+            }
+            best = std::min(best, now() - start);
+        }
+
+        std::vector<vec2> quad_result(positions);
+        double quad_best = 1e30;
+        for (int rep = 0; rep < 5; rep++) {
+            double start = now();
+            for (std::size_t i = 0; i < positions; i++) {
+                const vec2& p = bodies[list_size + i].pos;
+                quad_result[i] = vec2(0, 0);
+                k.quad(x.data(), y.data(), qxx.data(), qxy.data(), qyy.data(), quad_size, p.x, p.y, G,
+                       EPSILON*EPSILON, &quad_result[i].x, &quad_result[i].y);
+            }
+            quad_best = std::min(quad_best, now() - start);
+        }
+
+        if (k.width == 1) {
+            reference = result;
+            quad_reference = quad_result;
+        }
+        double max_diff = 0;
+        double quad_diff = 0;
+        for (std::size_t i = 0; i < positions; i++) {
+            vec2 diff(result[i].x - reference[i].x, result[i].y - reference[i].y);
+            max_diff = std::max(max_diff, diff.mag() / reference[i].mag());
+            vec2 qdiff(quad_result[i].x - quad_reference[i].x, quad_result[i].y - quad_reference[i].y);
+            quad_diff = std::max(quad_diff, qdiff.mag() / quad_reference[i].mag());
+        }
+        printf("%8s %6d %22.3e %14.2e %18.3e %14.2e\n", k.name, k.width, double(list_size * positions) / best,
+               max_diff, double(quad_size * positions) / quad_best, quad_diff);
+    }
+}
+
+/*  Benchmark of refitting last step's tree against building a new one every step
+ *  Runs the disk forward like the simulation does, timing both on the same positions each step
+ */
+static void bench_refit(std::size_t n, int steps, double delta_t) {
+    printf("\n== refit vs rebuild, %zu bodies in a disk, %d steps of %g ==\n", n, steps, delta_t);
+
+    Bodies bodies(gen_bodies_disk(n));
+    Quad root;
+    root.new_containing(bodies);
+    Quadtree kept;
+    kept.build_morton(bodies, root);
+    kept.propogate();
+    kept.accel_grouped(bodies, GROUP_SIZE);
+
+    int rebuilds = 0;
+    std::size_t wait = 0;
+    std::size_t backoff = 1;
+    double refit_time = 0;
+    double build_time = 0;
+    double diff = 0;
+    double total = 0;
+    for (int step = 0; step < steps; step++) {
+        bodies.update(delta_t);
+
+        // what the simulation does: refit, rebuild only if that gives up, and back off after it does
+        double start = now();
+        bool refitted = false;
+        if (wait > 0) {
+            wait--;
+        } else if (kept.refit(bodies)) {
+            refitted = true;
+            backoff = 1;
+        } else {
+            wait = backoff;
+            backoff = std::min<std::size_t>(backoff * 2, 64);
+        }
+        if (!refitted) {
+            rebuilds++;
+            root.new_containing(bodies);
+            kept.build_morton(bodies, root);
+        }
+        kept.propogate();
+        refit_time += now() - start;
+
+        // what it used to do
+        Quadtree fresh;
+        start = now();
+        Quad fresh_root;
+        fresh_root.new_containing(bodies);
+        fresh.build_morton(bodies, fresh_root);
+        fresh.propogate();
+        build_time += now() - start;
+
+        // both trees are valid, they just split space a bit differently
+        for (std::size_t i = 0; i < n; i += std::max<std::size_t>(n / 1000, 1)) {
+            vec2 a = kept.accel(bodies.pos(i));
+            vec2 b = fresh.accel(bodies.pos(i));
+            diff += vec2(a.x - b.x, a.y - b.y).mag();
+            total += b.mag();
+        }
+
+        kept.accel_grouped(bodies, GROUP_SIZE);
+    }
+
+    printf("rebuild every step: %8.2f ms/step\n", build_time * 1e3 / steps);
+    printf("refit:              %8.2f ms/step (%d full rebuilds)\n", refit_time * 1e3 / steps, rebuilds);
+    printf("force diff refit vs fresh tree: %.2e\n", diff / total);
+}
+
+/*  Not a benchmark, a check: a refit that moves every body out from under a branch has to leave a
+ *  tree with no NaN in it (an empty branch gets the middle of its quad, not 0/0, which would spread up
+ *  to the root). One-body leaves, so the smallest branch is just a few bodies, and each of them goes to
+ *  the middle of some other one-body leaf
+ */
+static void check_refit_empty() {
+    printf("\n== refit that empties a branch, 400 bodies in a disk ==\n");
+    Config config;
+    config.seed = 12345;
+    Bodies bodies(gen_bodies_disk(400, config));
+    Quad root;
+    root.new_containing(bodies);
+    Quadtree ygg;
+    ygg.leaf_capacity = 1;
+    ygg.build_morton(bodies, root);
+    ygg.propogate();
+
+    std::size_t smallest = 0;
+    for (std::size_t b = 0; b < ygg.nodes.size(); b++) {
+        if (ygg.nodes[b].children != 0 && ygg.nodes[b].count > 0 && ygg.nodes[b].count < ygg.nodes[smallest].count) {
+            smallest = b;
+        }
+    }
+    const std::size_t begin = ygg.nodes[smallest].first;
+    const std::size_t end = begin + ygg.nodes[smallest].count;
+    std::vector<std::size_t> targets;
+    for (std::size_t l = 0; l < ygg.nodes.size(); l++) {
+        const Node& leaf = ygg.nodes[l];
+        if (leaf.children == 0 && leaf.count == 1 && (leaf.first < begin || leaf.first >= end)) { targets.push_back(l); }
+    }
+    for (std::size_t k = begin; k < end; k++) {
+        const Node& target = ygg.nodes[targets[(k - begin) * targets.size() / (end - begin)]];
+        bodies.x[ygg.leaf_body[k]] = target.quad.center.x;
+        bodies.y[ygg.leaf_body[k]] = target.quad.center.y;
+    }
+
+    const bool refitted = ygg.refit(bodies);
+    ygg.propogate();
+    std::size_t nan = 0;
+    for (const Node& node : ygg.nodes) {
+        if (!std::isfinite(node.centm.x) || !std::isfinite(node.centm.y)) { nan++; }
+    }
+    const bool ok = refitted && ygg.nodes[smallest].count == 0 && nan == 0;
+    printf("refit %s, branch of %zu bodies left with %zu, %zu nodes with a NaN center of mass: %s\n",
+           refitted ? "kept the tree" : "gave up", end - begin, ygg.nodes[smallest].count, nan, ok ? "ok" : "FAILED");
+
+    // the FMM on that refitted tree, against direct summation, and against the FMM on a tree built fresh
+    const Reference reference(bodies);
+    Fmm fmm;
+    ygg.quadrupole = true;
+    ygg.propogate();
+    fmm.accel(ygg, bodies);
+    std::vector<vec2> refit_accels = accels_of(bodies);
+    std::size_t nan_accels = 0;
+    for (const vec2& a : refit_accels) {
+        if (!std::isfinite(a.x) || !std::isfinite(a.y)) { nan_accels++; }
+    }
+    Quadtree fresh;
+    fresh.leaf_capacity = 1;
+    fresh.quadrupole = true;
+    fresh.build_morton(bodies, root);
+    fresh.propogate();
+    fmm.accel(fresh, bodies);
+    const double refit_error = reference.error(refit_accels);
+    const double fresh_error = reference.error(accels_of(bodies));
+    const bool fmm_ok = nan_accels == 0 && refit_error < 2 * fresh_error + 1e-6;
+    printf("fmm on it: %zu/%zu NaN accelerations, error %.2e (%.2e on a fresh tree): %s\n",
+           nan_accels, refit_accels.size(), refit_error, fresh_error, fmm_ok ? "ok" : "FAILED");
+}
+
+/*  Benchmark of block timesteps against putting every body on the shortest step any of them needed
+ *  the leapfrog is the same either way, so the difference in where the bodies end up is the error the
+ *  long steps cost, and the difference in force evaluations is what they save
+ */
+static void bench_block_steps(std::size_t n, double delta_t, int steps) {
+    printf("\n== block timesteps, %zu bodies in a disk, %d steps of %g ==\n", n, steps, delta_t);
+    const std::vector<Body> initial = gen_bodies_disk(n);
+
+    Simulation block(delta_t, 0, initial, build_quadtree(Bodies(initial)));
+    double start = now();
+    for (int s = 0; s < steps; s++) { block.step(); }
+    double block_time = now() - start;
+
+    int deepest = 0;
+    std::vector<std::size_t> per_level(block.step_levels + 1, 0);
+    for (uint8_t level : block.step_level) {
+        per_level[level]++;
+        deepest = std::max<int>(deepest, level);
+    }
+    printf("bodies per level at the end:");
+    for (int level = 0; level <= block.step_levels; level++) { printf(" %zu", per_level[level]); }
+    printf("\n");
+
+    // the same run with nobody allowed anything longer than the shortest step
+    const int split = 1 << deepest;
+    Simulation fixed(delta_t / split, 0, initial, build_quadtree(Bodies(initial)));
+    fixed.step_levels = 0;
+    start = now();
+    for (int s = 0; s < steps * split; s++) { fixed.step(); }
+    double fixed_time = now() - start;
+
+    double diff = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        diff += vec2(block.bodies.x[i] - fixed.bodies.x[i], block.bodies.y[i] - fixed.bodies.y[i]).mag();
+    }
+
+    printf("%22s %12s %14s %10s\n", "", "ms total", "force evals", "substeps");
+    printf("%22s %12.1f %14zu %10zu\n", "block steps", block_time * 1e3, block.force_evals, block.substeps);
+    printf("%13s dt/%-6d %12.1f %14zu %10zu\n", "everyone at", split, fixed_time * 1e3,
+           fixed.force_evals, fixed.substeps);
+    printf("mean position difference: %.2e\n", diff / n);
+}
+
+/*  Benchmark of the trajectory writer: how long record() holds the step loop up, how small the file
+ *  comes out against raw doubles (x, y, vx, vy, 32 bytes a body), how far off the bodies read back are,
+ *  and how long the reader takes to jump to a frame in the middle of a block
+ */
+static void bench_trajectory(std::size_t n, int frames) {
+    printf("\n== trajectory, %zu bodies in a disk, %d frames ==\n", n, frames);
+    Config config;
+    config.num_bodies = n;
+    config.seed = 12345;
+    Simulation sim(config);
+    const char* path = "nbody_bench.traj";
+    TrajectoryHeader header;
+    header.delta_t = sim.delta_t;
+    sim.trajectory.open(path, header, sim.bodies.mass);
+
+    const int check = frames / 2 + 1; // not the first frame of a block, so reading it has to decode a few
+    Bodies expected;
+    double stepping = 0;
+    double recording = 0;
+    for (int f = 0; f < frames; f++) {
+        double start = now();
+        sim.step();
+        double stepped = now();
+        sim.trajectory.record(sim.bodies, sim.frame);
+        stepping += stepped - start;
+        recording += now() - stepped;
+        if (static_cast<int>(sim.frame) == check) { expected = sim.bodies; }
+    }
+    double start = now();
+    sim.trajectory.close();
+    double closing = now() - start;
+
+    TrajectoryReader reader;
+    Bodies read;
+    bool ok = reader.open(path);
+    start = now();
+    ok = ok && reader.read(check, read);
+    double seeking = now() - start;
+    std::FILE* file = std::fopen(path, "rb");
+    std::fseek(file, 0, SEEK_END);
+    const double bytes = static_cast<double>(std::ftell(file)) - static_cast<double>(n * sizeof(double));
+    std::fclose(file);
+    std::remove(path);
+
+    double position_error = 0;
+    double velocity_error = 0;
+    for (std::size_t i = 0; ok && i < n; i++) {
+        position_error = std::max(position_error, std::max(std::abs(read.x[i] - expected.x[i]),
+                                                           std::abs(read.y[i] - expected.y[i])));
+        velocity_error = std::max(velocity_error, std::max(std::abs(read.vx[i] - expected.vx[i]),
+                                                           std::abs(read.vy[i] - expected.vy[i])));
+    }
+    printf("ms per frame: step %.2f, record %.2f (finishing the file at the end %.2f)\n",
+           stepping * 1e3 / frames, recording * 1e3 / frames, closing * 1e3);
+    printf("bytes per body per frame: %.2f (raw doubles 32), %zu frames in the index\n",
+           bytes / (static_cast<double>(n) * frames), reader.index.size());
+    printf("frame %d read back in %.2f ms, %s, worst position error %.2e, velocity %.2e\n",
+           check, seeking * 1e3, ok ? "ok" : "FAILED", position_error, velocity_error);
+}
+
+/*  Benchmark of drawing the dots, working out every pixel of every dot (colorDot, two exp() and a pow()
+ *  a pixel) against adding on the precomputed stamps (stampDot), both on one thread, same bodies.
+ *  The stamps put each dot up to half a subpixel off, so the images differ a little: the worst
+ *  difference is given in the 0-255 steps the image gets written with
+ *  Then the tiled Rasterizer, at 1 thread and at a few. It adds every pixel's dots up in the same
+ *  order stampDot does, so its image has to come out exactly the same, whatever the thread count
+ */
+static void bench_render(std::size_t n) {
+    Config config;
+    printf("\n== drawing %zu bodies in a disk at %dx%d, dot size %d ==\n", n, config.width, config.height, config.dot_size);
+    Bodies bodies(gen_bodies_disk(n));
+    std::vector<double> speed(n);
+    for (std::size_t i = 0; i < n; i++) { speed[i] = vec2(bodies.vx[i], bodies.vy[i]).mag(); }
+    const std::size_t values = static_cast<std::size_t>(config.width) * config.height * 3;
+    std::vector<double> exact(values, 0.0);
+    std::vector<double> stamped(values, 0.0);
+    auto on_image = [&](std::size_t i) {
+        double x = toPixelSpace(bodies.x[i], config.width, config);
+        double y = toPixelSpace(bodies.y[i], config.height, config);
+        return x > config.dot_size && x < config.width - config.dot_size &&
+               y > config.dot_size && y < config.height - config.dot_size;
+    };
+
+    double start = now();
+    for (std::size_t i = 0; i < n; i++) {
+        if (on_image(i)) { colorDot(bodies.x[i], bodies.y[i], speed[i], exact.data(), config); }
+    }
+    double exact_time = now() - start;
+
+    start = now();
+    DotStamps stamps(config);
+    double build_time = now() - start;
+    start = now();
+    for (std::size_t i = 0; i < n; i++) {
+        if (on_image(i)) { stampDot(bodies.x[i], bodies.y[i], speed[i], stamped.data(), config, stamps); }
+    }
+    double stamp_time = now() - start;
+
+    double worst = 0;
+    int worst_byte = 0;
+    for (std::size_t i = 0; i < values; i++) {
+        worst = std::max(worst, std::abs(exact[i] - stamped[i]));
+        worst_byte = std::max(worst_byte, std::abs(int(255.0 * clamp(exact[i])) - int(255.0 * clamp(stamped[i]))));
+    }
+    printf("%22s %12s %16s\n", "", "ms", "bodies/s");
+    printf("%22s %12.1f %16.3g\n", "colorDot", exact_time * 1e3, n / exact_time);
+    printf("%22s %12.1f %16.3g   (stamps built in %.1f ms, %zu KB)\n", "stampDot", stamp_time * 1e3,
+           n / stamp_time, build_time * 1e3, stamps.values.size() * sizeof(double) / 1024);
+
+    const int max_threads = omp_get_max_threads();
+    std::vector<double> tiled(values);
+    for (int threads : {1, std::max(max_threads, 4)}) {
+        omp_set_num_threads(threads);
+        Rasterizer raster(config);
+        std::fill(tiled.begin(), tiled.end(), 0.0);
+        raster.draw(bodies.x.data(), bodies.y.data(), speed.data(), n, tiled.data(), config); // warm up the buffers
+        std::fill(tiled.begin(), tiled.end(), 0.0);
+        start = now();
+        raster.draw(bodies.x.data(), bodies.y.data(), speed.data(), n, tiled.data(), config);
+        double tiled_time = now() - start;
+        bool same = std::memcmp(tiled.data(), stamped.data(), values * sizeof(double)) == 0;
+        char name[32];
+        snprintf(name, sizeof(name), "Rasterizer, %d thr", threads);
+        printf("%22s %12.1f %16.3g   (%s stampDot's image)\n", name, tiled_time * 1e3, n / tiled_time,
+               same ? "exactly" : "NOT");
+    }
+    omp_set_num_threads(max_threads);
+    printf("worst difference colorDot to stamps: %.2e, %d of 255 in the written image\n", worst, worst_byte);
+}
+
+/*  Benchmark of level of detail drawing: every body through the Rasterizer, against LevelOfDetail's
+ *  dots (picking them out of the tree, then drawing those) at a few render_lod sizes. The image
+ *  changes a bit, a node's bodies all land on its center of mass: given as the worst and the average
+ *  difference in the 0-255 steps the image gets written with
+ */
+static void bench_lod(std::size_t n) {
+    Config config;
+    printf("\n== level of detail, %zu bodies in a disk at %dx%d ==\n", n, config.width, config.height);
+    Bodies bodies(gen_bodies_disk(n));
+    Quadtree tree;
+    Quad root;
+    root.new_containing(bodies);
+    tree.build_morton(bodies, root);
+    tree.propogate();
+
+    const std::size_t values = static_cast<std::size_t>(config.width) * config.height * 3;
+    std::vector<double> every(values, 0.0);
+    std::vector<double> speed(n);
+    for (std::size_t i = 0; i < n; i++) { speed[i] = vec2(bodies.vx[i], bodies.vy[i]).mag(); }
+    Rasterizer raster(config);
+    raster.draw(bodies.x.data(), bodies.y.data(), speed.data(), n, every.data(), config); // warm up
+    std::fill(every.begin(), every.end(), 0.0);
+    double start = now();
+    raster.draw(bodies.x.data(), bodies.y.data(), speed.data(), n, every.data(), config);
+    double every_time = now() - start;
+
+    printf("%10s %12s %12s %12s %12s %10s %10s\n", "render_lod", "dots", "pick (ms)", "draw (ms)", "total (ms)",
+           "worst", "average");
+    printf("%10s %12zu %12s %12.1f %12.1f %10s %10s\n", "0", n, "-", every_time * 1e3, every_time * 1e3, "-", "-");
+    std::vector<double> lod_image(values);
+    std::vector<double> x, y, dot_speed, weight;
+    for (double lod_pixels : {0.5, 1.0, 2.0, 4.0}) {
+        config.render_lod = lod_pixels;
+        LevelOfDetail lod;
+        std::fill(lod_image.begin(), lod_image.end(), 0.0);
+        start = now();
+        lod.pick(bodies, tree, config, x, y, dot_speed, weight);
+        double pick_time = now() - start;
+        start = now();
+        raster.draw(x.data(), y.data(), dot_speed.data(), x.size(), lod_image.data(), config, weight.data());
+        double draw_time = now() - start;
+
+        int worst = 0;
+        double total = 0;
+        for (std::size_t i = 0; i < values; i++) {
+            int diff = std::abs(int(255.0 * clamp(every[i])) - int(255.0 * clamp(lod_image[i])));
+            worst = std::max(worst, diff);
+            total += diff;
+        }
+        printf("%10.1f %12zu %12.1f %12.1f %12.1f %10d %10.3f\n", lod_pixels, x.size(), pick_time * 1e3,
+               draw_time * 1e3, (pick_time + draw_time) * 1e3, worst, total / values);
+    }
+}
+
+/*  Not a benchmark, a check: decode_qoi on files that are cut short or lie in their header has to say
+ *  no, not read past the end. A small noisy image (so every kind of chunk is in it) cut off at every
+ *  length, the same with the end marker put back on, and headers claiming more pixels than there's room for
+ */
+static void check_qoi_damaged() {
+    printf("\n== reading damaged QOI files ==\n");
+    const int side = 24;
+    std::vector<uint8_t> image(static_cast<std::size_t>(side) * side * 3);
+    uint32_t state = 12345;
+    for (std::size_t i = 0; i < image.size(); i++) {
+        state = state * 1664525u + 1013904223u;
+        // long flat stretches (runs), small steps (diffs) and the odd jump (whole pixels)
+        image[i] = (i / 3 % 17 < 6) ? 40 : static_cast<uint8_t>((i / 3 % 5 == 0) ? state >> 24 : 40 + (state >> 30));
+    }
+    std::vector<uint8_t> encoded, decoded;
+    encode_qoi(image.data(), side, side, encoded);
+    int width = 0, height = 0;
+    bool ok = decode_qoi(encoded.data(), encoded.size(), width, height, decoded) && decoded == image;
+
+    static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    int accepted = 0;
+    for (std::size_t size = 0; size + 8 < encoded.size(); size++) {
+        // copies, so reading a byte past them is reading past the allocation
+        std::vector<uint8_t> cut(encoded.begin(), encoded.begin() + size);
+        accepted += decode_qoi(cut.data(), cut.size(), width, height, decoded);
+        cut.insert(cut.end(), end, end + 8);
+        accepted += decode_qoi(cut.data(), cut.size(), width, height, decoded);
+    }
+    for (uint32_t claimed : {uint32_t(side + 1), uint32_t(1) << 20, uint32_t(0xFFFFFFFF), uint32_t(0)}) {
+        std::vector<uint8_t> lying = encoded;
+        for (int b = 0; b < 4; b++) { lying[4 + b] = lying[8 + b] = static_cast<uint8_t>(claimed >> (24 - 8 * b)); }
+        accepted += decode_qoi(lying.data(), lying.size(), width, height, decoded);
+    }
+    ok = ok && accepted == 0;
+    printf("%zu bytes cut off at every length, and 4 lying headers: %d read as fine, %s\n", encoded.size(), accepted,
+           ok ? "ok" : "FAILED");
+}
+
+/*  Benchmark of getting a drawn frame out: the 8 bit image from the old one-thread clamp loop against
+ *  tonemap(), then a frame as a PPM (the raw pixels) against QOI, in time to encode and in bytes, with
+ *  the QOI read back to check it's lossless. Then frames through FrameWriter, all the way to disk
+ */
+static void bench_frames(std::size_t n, int frames) {
+    Config config;
+    config.frame_dir = "bench_frames";
+    printf("\n== writing frames of %zu bodies in a disk at %dx%d ==\n", n, config.width, config.height);
+    Bodies bodies(gen_bodies_disk(n));
+    const std::size_t values = static_cast<std::size_t>(config.width) * config.height * 3;
+    std::vector<double> hdImage(values, 0.0);
+    Rasterizer raster(config);
+    renderBodies(bodies, hdImage.data(), config, raster);
+
+    std::vector<char> old_image(values);
+    double start = now();
+    for (std::size_t i = 0; i < values; i++) { old_image[i] = int(255.0 * clamp(hdImage[i])); }
+    double old_time = now() - start;
+    std::vector<uint8_t> image(values);
+    start = now();
+    tonemap(hdImage.data(), image.data(), values);
+    double tonemap_time = now() - start;
+    bool same = std::memcmp(old_image.data(), image.data(), values) == 0;
+    printf("clamp loop %.1f ms, tonemap %.1f ms (%d threads), %s\n", old_time * 1e3, tonemap_time * 1e3,
+           omp_get_max_threads(), same ? "same bytes" : "DIFFERENT");
+
+    std::vector<uint8_t> encoded, decoded;
+    start = now();
+    encode_qoi(image.data(), config.width, config.height, encoded);
+    double encode_time = now() - start;
+    int width = 0, height = 0;
+    start = now();
+    bool ok = decode_qoi(encoded.data(), encoded.size(), width, height, decoded) &&
+              width == config.width && height == config.height && decoded == image;
+    double decode_time = now() - start;
+    printf("%6s %12s %12s\n", "", "MB", "encode (ms)");
+    printf("%6s %12.2f %12s\n", "ppm", values / 1e6, "-");
+    printf("%6s %12.2f %12.1f   (%.1fx smaller, read back in %.1f ms, %s)\n", "qoi", encoded.size() / 1e6,
+           encode_time * 1e3, static_cast<double>(values) / encoded.size(), decode_time * 1e3,
+           ok ? "lossless" : "FAILED");
+
+    // the same frame over and over, which is the same work as new ones
+    printf("%6s %8s %12s %12s\n", "sink", "threads", "ms/frame", "MB/frame");
+    for (const char* sink : {"ppm", "qoi"}) {
+        for (std::size_t threads : {static_cast<std::size_t>(1), static_cast<std::size_t>(ENCODE_THREADS)}) {
+            config.frame_sink = sink;
+            config.encode_threads = threads;
+            auto writer = make_frame_sink(config);
+            start = now();
+            for (int f = 1; f <= frames; f++) {
+                image.resize(values);
+                tonemap(hdImage.data(), image.data(), values);
+                writer->write(image, f);
+            }
+            writer->flush();
+            double total = now() - start;
+            printf("%6s %8zu %12.1f %12.2f\n", sink, threads, total * 1e3 / frames, writer->bytes / 1e6 / frames);
+        }
+    }
+    std::filesystem::remove_all(config.frame_dir);
+}
+
+/*  Benchmark of stepping and rendering together: every frame drawn and written before the next step
+ *  (render_queue 0, how main() used to go) against handing frames to RenderPipeline's thread. With
+ *  the thread, a frame costs about the longer of the step and the drawing instead of the two added up,
+ *  as long as there are cores to spare for it
+ */
+static void bench_render_pipeline(std::size_t n, int frames) {
+    Config config;
+    config.num_bodies = n;
+    config.seed = 12345;
+    config.frame_dir = "bench_frames";
+    printf("\n== step + render, %zu bodies in a disk, %d frames of %dx%d (%d threads) ==\n",
+           n, frames, config.width, config.height, omp_get_max_threads());
+    printf("%12s %12s %14s %14s\n", "render_queue", "ms/frame", "drawing (ms)", "waiting (ms)");
+    for (std::size_t queue : {static_cast<std::size_t>(0), static_cast<std::size_t>(2)}) {
+        config.render_queue = queue;
+        Simulation sim(config);
+        RenderPipeline renderer(config);
+        double start = now();
+        for (int f = 0; f < frames; f++) {
+            sim.step();
+            renderer.submit(sim.bodies, static_cast<int>(sim.frame));
+        }
+        renderer.finish();
+        double total = now() - start;
+        printf("%12zu %12.1f %14.1f %14.1f\n", queue, total * 1e3 / frames,
+               renderer.drawing * 1e3 / frames, renderer.waiting * 1e3 / frames);
+    }
+    std::filesystem::remove_all(config.frame_dir);
+}
+
+/*  Benchmark of propogate(), the old way (one thread walking parents[] backwards) against the
+ *  task parallel one, at 1 thread and at every thread
+ */
+static void bench_propagate(std::size_t max_n) {
+    printf("\n== propagate: serial vs subtree tasks (%d threads) ==\n", omp_get_max_threads());
+    printf("%10s %6s %10s %12s %12s %12s\n",
+           "bodies", "K", "parents", "serial (ms)", "1 thr (ms)", "all (ms)");
+
+    const int threads = omp_get_max_threads();
+    for (std::size_t n = 100000; n <= max_n; n *= 10) {
+        Bodies bodies(gen_bodies_disk(n));
+        Quad root;
+        root.new_containing(bodies);
+
+        for (std::size_t k : {static_cast<std::size_t>(1), static_cast<std::size_t>(LEAF_CAPACITY)}) {
+            Quadtree ygg;
+            ygg.leaf_capacity = k;
+            ygg.build_morton(bodies, root);
+
+            // the old loop, as a baseline and to check the new one against
+            double serial = 1e30;
+            for (int rep = 0; rep < 3; rep++) {
+                double start = now();
+                for (auto it = ygg.parents.rbegin(); it != ygg.parents.rend(); ++it) {
+                    Node& node = ygg.nodes[*it];
+                    std::size_t i = node.children;
+                    node.mass = ygg.nodes[i].mass + ygg.nodes[i + 1].mass + ygg.nodes[i + 2].mass + ygg.nodes[i + 3].mass;
+                    node.centm = (ygg.nodes[i].centm * ygg.nodes[i].mass + ygg.nodes[i + 1].centm * ygg.nodes[i + 1].mass
+                                  + ygg.nodes[i + 2].centm * ygg.nodes[i + 2].mass
+                                  + ygg.nodes[i + 3].centm * ygg.nodes[i + 3].mass) / node.mass;
+                }
+                serial = std::min(serial, now() - start);
+            }
+            TreeArray<Node> expected = ygg.nodes;
+
+            // propogate() ends with a pack(), which the old loop didn't do, so take that back off
+            double timed[2] = {1e30, 1e30};
+            int counts[2] = {1, threads};
+            for (int t = 0; t < 2; t++) {
+                omp_set_num_threads(counts[t]);
+                double pack_time = 1e30;
+                for (int rep = 0; rep < 3; rep++) {
+                    double start = now();
+                    ygg.pack();
+                    pack_time = std::min(pack_time, now() - start);
+                }
+                for (int rep = 0; rep < 3; rep++) {
+                    double start = now();
+                    ygg.propogate();
+                    timed[t] = std::min(timed[t], now() - start - pack_time);
+                }
+            }
+            omp_set_num_threads(threads);
+
+            std::size_t mismatched = 0;
+            for (std::size_t i = 0; i < ygg.nodes.size(); i++) {
+                if (ygg.nodes[i].mass != expected[i].mass || ygg.nodes[i].centm.x != expected[i].centm.x
+                    || ygg.nodes[i].centm.y != expected[i].centm.y) {
+                    mismatched++;
+                }
+            }
+            printf("%10zu %6zu %10zu %12.2f %12.2f %12.2f%s\n",
+                   n, k, ygg.parents.size(), serial * 1e3, timed[0] * 1e3, timed[1] * 1e3,
+                   mismatched ? "  MISMATCH" : "");
+        }
+    }
+}
+
+/*  The suite: the same few kernels measured the same way every time, so two commits' numbers can be
+ *  lined up against each other. Every body count from 1e3 up to max_n in powers of ten, every thread
+ *  count from 1 up in powers of two, and for the force walk a couple of thetas. The bodies always come
+ *  from the same seed (12345, unless --seed). Each number is the best of up to 5 runs (fewer once
+ *  they've taken half a second)
+ *      nbody_bench --suite [--max_n 1e6] [--json out.json] [--compare old.json] [--threshold 0.1] [--key value ...]
+ *  any other --key value is a setting like gpu_nbody takes (--group_size 32, --seed 1, ...)
+ *  --compare lines the results up with an earlier --json by kernel, n, threads and theta, and exits
+ *  with 1 if anything got slower by more than threshold (a fraction)
+ */
+struct SuiteResult {
+    std::string kernel;
+    std::size_t n = 0;
+    int threads = 1;
+    double theta = 0;   // 0 for kernels that don't have one
+    double seconds = 0; // best time
+};
+
+// best time of run() (setup() before each, not timed)
+template <typename Setup, typename Run>
+static double best_of(Setup&& setup, Run&& run) {
+    double best = 1e30;
+    double spent = 0;
+    for (int rep = 0; rep < 5 && (rep == 0 || spent < 0.5); rep++) {
+        setup();
+        double start = now();
+        run();
+        double took = now() - start;
+        best = std::min(best, took);
+        spent += took;
+    }
+    return best;
+}
+
+static void suite_kernels(std::size_t n, int threads, const Config& config, std::vector<SuiteResult>& results) {
+    Bodies bodies(gen_bodies_disk(static_cast<double>(n), config));
+    Quad root;
+    root.new_containing(bodies);
+    auto add = [&](const char* kernel, double theta, double seconds) {
+        results.push_back({kernel, n, threads, theta, seconds});
+        printf("%14s %10zu %8d %6.2f %12.3f %14.3g\n", kernel, n, threads, theta, seconds * 1e3, n / seconds);
+    };
+
+    Quadtree ygg;
+    add("insert", 0, best_of([&]() { ygg.reset(root); }, [&]() {
+        for (std::size_t i = 0; i < n; i++) { ygg.insert(bodies.pos(i), bodies.mass[i]); }
+    }));
+    add("build_morton", 0, best_of([]() {}, [&]() { ygg.build_morton(bodies, root); }));
+    add("propogate", 0, best_of([]() {}, [&]() { ygg.propogate(); }));
+
+    // the walks are the slow part, past a million bodies a sample of them says the same thing
+    const std::size_t walkers = std::min<std::size_t>(n, 1000000);
+    for (double theta : {0.5, 1.0}) {
+        ygg.theta = theta;
+        ygg.propogate();
+        double walk = best_of([]() {}, [&]() {
+            #pragma omp parallel for schedule(dynamic, 1024)
+            for (std::size_t i = 0; i < walkers; i++) {
+                bodies.set_accel(i, ygg.accel(bodies.pos(i)));
+            }
+        });
+        add("accel", theta, walk * n / walkers);
+        add("accel_grouped", theta, best_of([]() {}, [&]() { ygg.accel_grouped(bodies, config.group_size); }));
+    }
+
+    Simulation sim(config.delta_t, 0, bodies.to_vector(), Quadtree(), config);
+    add("iterate", 0, best_of([]() {}, [&]() { sim.iterate(config.delta_t); }));
+
+    std::vector<double> hdImage(static_cast<std::size_t>(config.width) * config.height * 3);
+    Rasterizer raster(config);
+    add("renderBodies", 0, best_of([&]() { std::fill(hdImage.begin(), hdImage.end(), 0.0); },
+                                   [&]() { renderBodies(bodies, hdImage.data(), config, raster); }));
+    // one thread whatever it's given, and slow, so only the once at small n
+    if (threads == 1 && n <= 100000) {
+        add("colorDot", 0, best_of([&]() { std::fill(hdImage.begin(), hdImage.end(), 0.0); }, [&]() {
+            for (std::size_t i = 0; i < n; i++) {
+                double x = toPixelSpace(bodies.x[i], config.width, config);
+                double y = toPixelSpace(bodies.y[i], config.height, config);
+                if (x > config.dot_size && x < config.width - config.dot_size &&
+                    y > config.dot_size && y < config.height - config.dot_size) {
+                    colorDot(bodies.x[i], bodies.y[i], vec2(bodies.vx[i], bodies.vy[i]).mag(), hdImage.data(), config);
+                }
+            }
+        }));
+    }
+}
+
+// "key": value out of one line of the suite's JSON (which is all it has to read)
+static std::string json_field(const std::string& line, const char* key) {
+    const std::string tag = std::string("\"") + key + "\":";
+    std::size_t at = line.find(tag);
+    if (at == std::string::npos) { return ""; }
+    at += tag.size();
+    if (line[at] == '"') { return line.substr(at + 1, line.find('"', at + 1) - at - 1); }
+    return line.substr(at, line.find_first_of(",}", at) - at);
+}
+
+static int run_suite(std::size_t max_n, const std::string& json, const std::string& compare, double threshold,
+                     const Config& config) {
+    const int max_threads = omp_get_max_threads();
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) { thread_counts.push_back(t); }
+    thread_counts.push_back(max_threads);
+
+    printf("\n== suite, n up to %zu, up to %d threads ==\n", max_n, max_threads);
+    printf("%14s %10s %8s %6s %12s %14s\n", "kernel", "n", "threads", "theta", "ms", "bodies/s");
+    std::vector<SuiteResult> results;
+    for (std::size_t n = 1000; n <= max_n; n *= 10) {
+        for (int threads : thread_counts) {
+            omp_set_num_threads(threads);
+            suite_kernels(n, threads, config, results);
+        }
+    }
+    omp_set_num_threads(max_threads);
+
+    if (!json.empty()) {
+        FILE* out = fopen(json.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "Error: couldn't write %s\n", json.c_str());
+            return 1;
+        }
+        // one result a line, so the files diff nicely too
+        fprintf(out, "{\"suite\":\"nbody_bench\",\"max_threads\":%d,\"seed\":%zu,\"group_size\":%zu,\"results\":[\n",
+                max_threads, config.seed, config.group_size);
+        for (std::size_t r = 0; r < results.size(); r++) {
+            const SuiteResult& result = results[r];
+            fprintf(out, "{\"kernel\":\"%s\",\"n\":%zu,\"threads\":%d,\"theta\":%g,\"ms\":%.6f,\"bodies_per_s\":%.6g}%s\n",
+                    result.kernel.c_str(), result.n, result.threads, result.theta, result.seconds * 1e3,
+                    result.n / result.seconds, r + 1 < results.size() ? "," : "");
+        }
+        fprintf(out, "]}\n");
+        fclose(out);
+        printf("results written to %s\n", json.c_str());
+    }
+
+    if (compare.empty()) { return 0; }
+    std::ifstream old_file(compare);
+    if (!old_file) {
+        fprintf(stderr, "Error: couldn't read %s\n", compare.c_str());
+        return 1;
+    }
+    std::vector<SuiteResult> old;
+    for (std::string line; std::getline(old_file, line); ) {
+        if (json_field(line, "kernel").empty()) { continue; }
+        old.push_back({json_field(line, "kernel"), std::strtoull(json_field(line, "n").c_str(), nullptr, 10),
+                       std::atoi(json_field(line, "threads").c_str()), std::atof(json_field(line, "theta").c_str()),
+                       std::atof(json_field(line, "ms").c_str()) / 1e3});
+    }
+    printf("\n== against %s (slower by more than %.0f%% is flagged) ==\n", compare.c_str(), threshold * 100);
+    printf("%14s %10s %8s %6s %12s %12s %8s\n", "kernel", "n", "threads", "theta", "old ms", "new ms", "new/old");
+    int slower = 0;
+    for (const SuiteResult& result : results) {
+        auto match = std::find_if(old.begin(), old.end(), [&](const SuiteResult& o) {
+            return o.kernel == result.kernel && o.n == result.n && o.threads == result.threads &&
+                   std::abs(o.theta - result.theta) < 1e-9;
+        });
+        if (match == old.end()) { continue; }
+        const double ratio = result.seconds / match->seconds;
+        const bool flagged = ratio > 1 + threshold;
+        slower += flagged;
+        printf("%14s %10zu %8d %6.2f %12.3f %12.3f %8.2f%s\n", result.kernel.c_str(), result.n, result.threads,
+               result.theta, match->seconds * 1e3, result.seconds * 1e3, ratio, flagged ? "  SLOWER" : "");
+    }
+    printf("%d slower\n", slower);
+    return slower > 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    // nbody_bench --suite ...: just the suite (see run_suite)
+    if (argc > 1 && std::strcmp(argv[1], "--suite") == 0) {
+        std::size_t suite_n = 1000000;
+        std::string json, compare;
+        double threshold = 0.1;
+        Config config;
+        config.seed = 12345;
+        for (int a = 2; a < argc; a += 2) {
+            if (a + 1 == argc) { fprintf(stderr, "Error: %s needs a value\n", argv[a]); return 1; }
+            if (std::strcmp(argv[a], "--max_n") == 0) { suite_n = static_cast<std::size_t>(atof(argv[a + 1])); }
+            else if (std::strcmp(argv[a], "--json") == 0) { json = argv[a + 1]; }
+            else if (std::strcmp(argv[a], "--compare") == 0) { compare = argv[a + 1]; }
+            else if (std::strcmp(argv[a], "--threshold") == 0) { threshold = atof(argv[a + 1]); }
+            else if (std::strncmp(argv[a], "--", 2) == 0) {
+                if (!config.set(argv[a] + 2, argv[a + 1])) { return 1; } // said why already
+            }
+            else { fprintf(stderr, "Error: unknown option %s\n", argv[a]); return 1; }
+        }
+        return run_suite(suite_n, json, compare, threshold, config);
+    }
+
+    // largest body count to sweep up to, 1e4 -> max_n in powers of ten
+    std::size_t max_n = 10000000;
+    if (argc > 1) {
+        max_n = static_cast<std::size_t>(atof(argv[1]));
+    }
+
+    bench_kernel();
+    bench_generate(max_n);
+    bench_integrate(max_n);
+    bench_direct(std::min<std::size_t>(max_n, 16384));
+    bench_build(max_n);
+    bench_propagate(max_n);
+    bench_leaf(std::min<std::size_t>(max_n, 1000000));
+    bench_force(std::min<std::size_t>(max_n, 1000000));
+    bench_group(std::min<std::size_t>(max_n, 1000000));
+    bench_balance(std::min<std::size_t>(max_n, 1000000));
+    bench_multipole(std::min<std::size_t>(max_n, 1000000));
+    for (std::size_t n = 100000; n <= std::min<std::size_t>(max_n, 1000000); n *= 10) {
+        bench_solvers("disk", gen_bodies_disk(n));
+        bench_solvers("uniform", gen_bodies(n));
+    }
+    bench_refit(std::min<std::size_t>(max_n, 1000000), 20, 0.05);
+    bench_refit(std::min<std::size_t>(max_n, 1000000), 20, 0.01);
+    check_refit_empty();
+    bench_block_steps(std::min<std::size_t>(max_n, 100000), 0.05, 20);
+    bench_block_steps(std::min<std::size_t>(max_n, 100000), 0.5, 4);
+    bench_trajectory(std::min<std::size_t>(max_n, 1000000), 40);
+    bench_render(std::min<std::size_t>(max_n, 1000000));
+    bench_lod(max_n);
+    bench_frames(std::min<std::size_t>(max_n, 100000), 10);
+    check_qoi_damaged();
+    bench_render_pipeline(std::min<std::size_t>(max_n, 100000), 10);
+    return 0;
+}
@@ -0,0 +1,258 @@
+//
+// config.cpp
+// Reading Config from files and flags, see config.h
+//
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+
+#include "config.h"
+
+// ## IMPLEMENTATION FILE ##
+
+/*  Calls fn(name, member) for every setting, so setting, checking and printing them all goes off one list
+ *  adding a setting is adding a member to Config and a line here
+ */
+template <typename C, typename F>
+static void each_setting(C& c, F&& fn) {
+    fn("frames", c.frames);
+    fn("delta_t", c.delta_t);
+    fn("checkpoint_every", c.checkpoint_every);
+    fn("checkpoint_file", c.checkpoint_file);
+    fn("resume", c.resume);
+    fn("trajectory_every", c.trajectory_every);
+    fn("trajectory_file", c.trajectory_file);
+    fn("trajectory_block", c.trajectory_block);
+    fn("trajectory_position_bits", c.trajectory_position_bits);
+    fn("trajectory_velocity_bits", c.trajectory_velocity_bits);
+    fn("trajectory_overwrite", c.trajectory_overwrite);
+    fn("telemetry", c.telemetry);
+    fn("num_bodies", c.num_bodies);
+    fn("layout", c.layout);
+    fn("seed", c.seed);
+    fn("ic_file", c.ic_file);
+    fn("write_ics", c.write_ics);
+    fn("random_body_mass", c.random_body_mass);
+    fn("body_min_mass", c.body_min_mass);
+    fn("body_max_mass", c.body_max_mass);
+    fn("body_fixed_mass", c.body_fixed_mass);
+    fn("inner_radius", c.inner_radius);
+    fn("outer_radius", c.outer_radius);
+    fn("theta", c.theta);
+    fn("epsilon", c.epsilon);
+    fn("force_solver", c.force_solver);
+    fn("morton_build", c.morton_build);
+    fn("leaf_capacity", c.leaf_capacity);
+    fn("group_size", c.group_size);
+    fn("pin_threads", c.pin_threads);
+    fn("tune_error", c.tune_error);
+    fn("tune_every", c.tune_every);
+    fn("tune_samples", c.tune_samples);
+    fn("quadrupole", c.quadrupole);
+    fn("fmm_theta", c.fmm_theta);
+    fn("direct_crossover", c.direct_crossover);
+    fn("direct_tile", c.direct_tile);
+    fn("refit_tree", c.refit_tree);
+    fn("refit_max_moved", c.refit_max_moved);
+    fn("refit_max_overflow", c.refit_max_overflow);
+    fn("refit_looseness", c.refit_looseness);
+    fn("step_levels", c.step_levels);
+    fn("step_eta", c.step_eta);
+    fn("width", c.width);
+    fn("height", c.height);
+    fn("dot_size", c.dot_size);
+    fn("particle_brightness", c.particle_brightness);
+    fn("particle_sharpness", c.particle_sharpness);
+    fn("system_size", c.system_size);
+    fn("render_scale", c.render_scale);
+    fn("render_queue", c.render_queue);
+    fn("render_threads", c.render_threads);
+    fn("render_tile", c.render_tile);
+    fn("render_lod", c.render_lod);
+    fn("frame_sink", c.frame_sink);
+    fn("frame_dir", c.frame_dir);
+    fn("frame_stream", c.frame_stream);
+    fn("encode_threads", c.encode_threads);
+}
+
+// Turning the text of a value into a setting's type. false if it isn't one (or has junk after it)
+static bool parse(const std::string& text, double& out) {
+    char* end = nullptr;
+    out = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+}
+
+static bool parse(const std::string& text, long& out) {
+    // through a double, so 1e6 works for counts too
+    // (and nothing past what a long holds, casting one of those is undefined)
+    double value;
+    if (!parse(text, value) || !(value >= -9.2e18 && value <= 9.2e18)) { return false; }
+    if (value != static_cast<double>(static_cast<long>(value))) { return false; }
+    out = static_cast<long>(value);
+    return true;
+}
+
+static bool parse(const std::string& text, int& out) {
+    long value;
+    if (!parse(text, value) || value < INT_MIN || value > INT_MAX) { return false; }
+    out = static_cast<int>(value);
+    return true;
+}
+
+/*  Settings that only mean anything between some limits: sizes that get allocated or stepped through by
+ *  and thread counts can't be 0 or less, force_solver is one of the Solvers, and step_levels is a shift
+ */
+static bool in_range(const std::string& key, double value) {
+    if (key == "width" || key == "height" || key == "dot_size" || key == "render_tile" || key == "render_threads" ||
+        key == "direct_tile") {
+        return value > 0;
+    }
+    if (key == "force_solver") { return value >= 0 && value <= 2; }
+    if (key == "step_levels") { return value >= 0 && value <= 62; } // 2^step_levels ticks a frame, in a uint64_t
+    return true;
+}
+
+static bool parse(const std::string& text, std::size_t& out) {
+    // plain digits exactly (seeds can be bigger than a double holds), anything else through a double
+    if (!text.empty() && text.find_first_not_of("0123456789") == std::string::npos) {
+        char* end = nullptr;
+        out = std::strtoull(text.c_str(), &end, 10);
+        return *end == '\0';
+    }
+    long value;
+    if (!parse(text, value) || value < 0) { return false; }
+    out = static_cast<std::size_t>(value);
+    return true;
+}
+
+static bool parse(const std::string& text, bool& out) {
+    if (text == "1" || text == "true" || text == "on" || text == "yes") { out = true; return true; }
+    if (text == "0" || text == "false" || text == "off" || text == "no") { out = false; return true; }
+    return false;
+}
+
+static bool parse(const std::string& text, std::string& out) {
+    out = text;
+    return true;
+}
+
+static void show(FILE* out, const char* name, double value) {
+    // as few digits as read back to the same double
+    char text[32];
+    snprintf(text, sizeof(text), "%.15g", value);
+    if (std::strtod(text, nullptr) != value) { snprintf(text, sizeof(text), "%.17g", value); }
+    fprintf(out, "%s = %s\n", name, text);
+}
+static void show(FILE* out, const char* name, long value) { fprintf(out, "%s = %ld\n", name, value); }
+static void show(FILE* out, const char* name, int value) { fprintf(out, "%s = %d\n", name, value); }
+static void show(FILE* out, const char* name, std::size_t value) { fprintf(out, "%s = %zu\n", name, value); }
+static void show(FILE* out, const char* name, bool value) { fprintf(out, "%s = %d\n", name, value ? 1 : 0); }
+static void show(FILE* out, const char* name, const std::string& value) { fprintf(out, "%s = %s\n", name, value.c_str()); }
+
+// Trims spaces and tabs off both ends
+static std::string trim(const std::string& text) {
+    const char* space = " \t\r\n";
+    std::size_t begin = text.find_first_not_of(space);
+    if (begin == std::string::npos) { return ""; }
+    return text.substr(begin, text.find_last_not_of(space) - begin + 1);
+}
+
+/*  Method to change one setting
+ *      inputs:         the setting's name, and its new value as text
+ *      outputs:        false (with a message on stderr) if there's no such setting or the value doesn't fit it
+ *      side effects:   the setting changes
+ */
+bool Config::set(const std::string& key, const std::string& value) {
+    bool found = false;
+    bool ok = false;
+    each_setting(*this, [&](const char* name, auto& member) {
+        if (found || key != name) { return; }
+        found = true;
+        ok = parse(value, member);
+        if constexpr (std::is_arithmetic_v<std::decay_t<decltype(member)>>) {
+            if (ok) { ok = in_range(key, static_cast<double>(member)); }
+        }
+    });
+    if (!found) {
+        fprintf(stderr, "Error: unknown setting \"%s\" (--help lists them)\n", key.c_str());
+    } else if (!ok) {
+        fprintf(stderr, "Error: \"%s\" isn't a valid value for %s\n", value.c_str(), key.c_str());
+    }
+    return found && ok;
+}
+
+/*  Method to read settings from a file, one "key = value" per line
+ *      inputs:         the file's path
+ *      outputs:        false if it couldn't be opened or any line was bad
+ *      side effects:   every setting in the file changes
+ */
+bool Config::load_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        fprintf(stderr, "Error: couldn't open config file %s\n", path.c_str());
+        return false;
+    }
+    std::string line;
+    int number = 0;
+    while (std::getline(file, line)) {
+        number++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) { continue; }
+        std::size_t equals = line.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "Error: %s:%d should look like key = value\n", path.c_str(), number);
+            return false;
+        }
+        if (!set(trim(line.substr(0, equals)), trim(line.substr(equals + 1)))) { return false; }
+    }
+    return true;
+}
+
+/*  Method to read settings from the command line
+ *      inputs:         main's argc and argv
+ *      outputs:        false if anything was bad, or if --help was asked for (after printing it)
+ *      side effects:   settings change, left to right. a bare number is the frame count, like it's always been
+ */
+bool Config::load_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printf("usage: %s [frames] [--config file] [--key value | --key=value ...]\n", argv[0]);
+            printf("settings, with their current values:\n");
+            print(stdout);
+            return false;
+        }
+        if (arg.rfind("--", 0) != 0) {
+            if (!set("frames", arg)) { return false; }
+            continue;
+        }
+
+        std::string key = arg.substr(2);
+        std::string value;
+        std::size_t equals = key.find('=');
+        if (equals != std::string::npos) {
+            value = key.substr(equals + 1);
+            key = key.substr(0, equals);
+        } else if (i + 1 < argc) {
+            value = argv[++i];
+        } else {
+            fprintf(stderr, "Error: --%s needs a value\n", key.c_str());
+            return false;
+        }
+
+        if (key == "config") {
+            if (!load_file(value)) { return false; }
+        } else if (!set(key, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes every setting out in config file format, so the output can be saved and loaded back in
+void Config::print(FILE* out) const {
+    each_setting(*this, [&](const char* name, const auto& member) { show(out, name, member); });
+}
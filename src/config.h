@@ -0,0 +1,96 @@
+//
+// config.h
+// Runtime settings, read once at startup from a config file and the command line
+//
+
+#ifndef GPU_NBODY_CONFIG_H
+#define GPU_NBODY_CONFIG_H
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include "Constants.h"
+
+/*  Everything a run can be tuned with, so trying a new value doesn't mean a recompile
+ *  The defaults are the macros in Constants.h. On top of those go, in order:
+ *      a config file:      --config path/to/file, one "key = value" per line, # starts a comment
+ *      flags:              --key value or --key=value, with the same keys (and booleans as 0/1, true/false)
+ *  later ones win, so flags given after --config override the file. gpu_nbody --help lists every key
+ *
+ *  Simulation takes one of these and hands the parts that matter out to the tree, the solvers,
+ *  the generators and the renderer
+ */
+struct Config {
+    // run
+    std::size_t frames = 0;                  // how many frames to simulate (also the first bare argument)
+    double delta_t = DELTA_T;                // simulated time per frame
+    std::size_t checkpoint_every = CHECKPOINT_EVERY;
+    std::string checkpoint_file = "checkpoint.snap";
+    std::string resume;                      // carry on from this checkpoint, up to frame number frames
+    std::size_t trajectory_every = TRAJECTORY_EVERY;
+    std::string trajectory_file = "trajectory.traj"; // a resumed run carries this file on from the checkpoint's frame
+    bool trajectory_overwrite = TRAJECTORY_OVERWRITE;
+    std::size_t trajectory_block = TRAJECTORY_BLOCK;
+    int trajectory_position_bits = TRAJECTORY_POSITION_BITS;
+    int trajectory_velocity_bits = TRAJECTORY_VELOCITY_BITS;
+    std::string telemetry;                   // a JSON line per step and per frame goes here, "fd:N" for an open fd (see telemetry.h)
+
+    // bodies
+    std::size_t num_bodies = NUM_BODIES;
+    std::string layout = "disk";             // "disk" (gen_bodies_disk) or "uniform" (gen_bodies)
+    std::size_t seed = SEED;                 // see gen_body()
+    std::string ic_file;                     // load the bodies from this snapshot instead of generating them
+    std::string write_ics;                   // generate the bodies straight into this snapshot file, then stop
+    bool random_body_mass = RANDOM_BODY_MASS;
+    double body_min_mass = BODY_MIN_MASS;
+    double body_max_mass = BODY_MAX_MASS;
+    double body_fixed_mass = BODY_FIXED_MASS;
+    double inner_radius = INNER_RADIUS;
+    double outer_radius = OUTER_RADIUS;
+
+    // forces
+    double theta = THETA;
+    double epsilon = EPSILON;
+    int force_solver = FORCE_SOLVER;
+    bool morton_build = MORTON_BUILD;
+    std::size_t leaf_capacity = LEAF_CAPACITY;
+    std::size_t group_size = GROUP_SIZE;
+    bool pin_threads = PIN_THREADS;
+    double tune_error = TUNE_ERROR;
+    std::size_t tune_every = TUNE_EVERY;
+    std::size_t tune_samples = TUNE_SAMPLES;
+    bool quadrupole = QUADRUPOLE;
+    double fmm_theta = FMM_THETA;
+    long direct_crossover = DIRECT_CROSSOVER;
+    std::size_t direct_tile = DIRECT_TILE;
+    bool refit_tree = REFIT_TREE;
+    double refit_max_moved = REFIT_MAX_MOVED;
+    double refit_max_overflow = REFIT_MAX_OVERFLOW;
+    double refit_looseness = REFIT_LOOSENESS;
+    int step_levels = STEP_LEVELS;
+    double step_eta = STEP_ETA;
+
+    // rendering
+    int width = WIDTH;
+    int height = HEIGHT;
+    int dot_size = DOT_SIZE;
+    double particle_brightness = PARTICLE_BRIGHTNESS;
+    double particle_sharpness = PARTICLE_SHARPNESS;
+    double system_size = SYSTEM_SIZE;
+    double render_scale = RENDER_SCALE;
+    std::size_t render_queue = RENDER_QUEUE;
+    int render_threads = RENDER_THREADS;
+    int render_tile = RENDER_TILE;
+    double render_lod = RENDER_LOD;
+    std::string frame_sink = "qoi";          // where frames go: "qoi" or "ppm" files, a "raw" stream, or "none" (see frames.h)
+    std::string frame_dir = "images";        // the files go in here, as StepNNNNN.qoi / .ppm
+    std::string frame_stream = "frames.rgb"; // the raw stream goes here. "|command" pipes it into the command
+    std::size_t encode_threads = ENCODE_THREADS;
+
+    bool set(const std::string& key, const std::string& value);
+    bool load_file(const std::string& path);
+    bool load_args(int argc, char* argv[]);
+    void print(FILE* out) const;
+};
+
+#endif //GPU_NBODY_CONFIG_H
@@ -0,0 +1,137 @@
+//
+// direct.cpp
+// Direct summation force solver, see direct.h
+//
+#include <cmath>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <omp.h>
+
+#include "Constants.h"
+#include "direct.h"
+
+// ## IMPLEMENTATION FILE ##
+
+/*  Method to work out accelerations by direct summation
+ *      inputs:         the solver, the bodies, which of them want an acceleration (nullptr = all of them)
+ *      outputs:        none
+ *      side effects:   sets accel on the bodies that wanted one
+ *
+ *  the kernel skips a source sitting right on the target, so a body's own tile doesn't need special care
+ */
+static void direct_tiles(const Direct& direct, Bodies& bodies, const uint8_t* active) {
+    const std::size_t n = bodies.size();
+    const double epsil_sq = direct.epsilon * direct.epsilon;
+    const std::size_t blocks = (n + direct.block - 1) / direct.block;
+
+    #pragma omp parallel
+    {
+        // the block's running totals, and which of its bodies are in it
+        std::vector<double> sum_x(direct.block);
+        std::vector<double> sum_y(direct.block);
+        std::vector<std::size_t> targets;
+        targets.reserve(direct.block);
+
+        #pragma omp for schedule(dynamic)
+        for (std::size_t b = 0; b < blocks; b++) {
+            targets.clear();
+            for (std::size_t i = b * direct.block; i < std::min(n, (b + 1) * direct.block); i++) {
+                if (active == nullptr || active[i]) { targets.push_back(i); }
+            }
+            if (targets.empty()) { continue; }
+            std::fill(sum_x.begin(), sum_x.end(), 0.0);
+            std::fill(sum_y.begin(), sum_y.end(), 0.0);
+
+            for (std::size_t first = 0; first < n; first += direct.tile) {
+                const std::size_t count = std::min(direct.tile, n - first);
+                for (std::size_t t = 0; t < targets.size(); t++) {
+                    const std::size_t i = targets[t];
+                    direct.kernel(&bodies.x[first], &bodies.y[first], &bodies.mass[first], count,
+                                  bodies.x[i], bodies.y[i], G, epsil_sq, &sum_x[t], &sum_y[t]);
+                }
+            }
+
+            for (std::size_t t = 0; t < targets.size(); t++) {
+                bodies.set_accel(targets[t], vec2(sum_x[t], sum_y[t]));
+            }
+        }
+    }
+}
+
+void Direct::accel(Bodies& bodies) {
+    direct_tiles(*this, bodies, nullptr);
+}
+
+// Same, for only the bodies marked in active (by body index), for block timesteps
+void Direct::accel_active(Bodies& bodies, const std::vector<uint8_t>& active) {
+    direct_tiles(*this, bodies, active.data());
+}
+
+vec2 direct_accel(const Bodies& bodies, vec2 pos, double epsilon) {
+    vec2 accel(0, 0);
+    for (std::size_t j = 0; j < bodies.size(); j++) {
+        vec2 dist(bodies.x[j] - pos.x, bodies.y[j] - pos.y);
+        double dist_sq = dist.mag_sq();
+        if (dist_sq == 0) { continue; }
+        accel = accel + dist * (G * bodies.mass[j] / ((dist_sq + epsilon * epsilon) * sqrt(dist_sq)));
+    }
+    return accel;
+}
+
+/*  Method to time Direct against the tree (built, propagated and walked the way attract() does it)
+ *  on a random disk of bodies, doubling the count until the tree is faster
+ *      inputs:         the settings both get run with
+ *      outputs:        the first count where the tree won
+ *
+ *  each is timed best of 3, so a stray interruption doesn't move the answer. the bodies come from
+ *  their own generator with a fixed seed, so measuring doesn't use up numbers from the simulation's
+ */
+static std::size_t measure_crossover(const Config& config) {
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<> unit(0, 1);
+    Direct direct;
+    direct.tile = config.direct_tile;
+    direct.epsilon = config.epsilon;
+
+    std::size_t n = 128;
+    for (; n < 65536; n *= 2) {
+        Bodies bodies;
+        bodies.resize(n);
+        for (std::size_t i = 0; i < n; i++) {
+            double radius = config.outer_radius * std::sqrt(unit(rng));
+            double angle = 2 * PI * unit(rng);
+            bodies.x[i] = radius * std::cos(angle);
+            bodies.y[i] = radius * std::sin(angle);
+            bodies.mass[i] = 0.001;
+        }
+
+        double direct_time = 1e30;
+        double tree_time = 1e30;
+        for (int rep = 0; rep < 3; rep++) {
+            double start = omp_get_wtime();
+            direct.accel(bodies);
+            direct_time = std::min(direct_time, omp_get_wtime() - start);
+
+            start = omp_get_wtime();
+            Quad root;
+            root.new_containing(bodies);
+            Quadtree tree;
+            tree.leaf_capacity = config.leaf_capacity;
+            tree.theta = config.theta;
+            tree.epsilon = config.epsilon;
+            tree.build_morton(bodies, root);
+            tree.propogate();
+            tree.accel_grouped(bodies, config.group_size);
+            tree_time = std::min(tree_time, omp_get_wtime() - start);
+        }
+        if (tree_time < direct_time) { break; }
+    }
+    return n;
+}
+
+std::size_t direct_crossover(const Config& config) {
+    if (config.direct_crossover >= 0) { return static_cast<std::size_t>(config.direct_crossover); }
+    static const std::size_t measured = measure_crossover(config);
+    return measured;
+}
@@ -0,0 +1,44 @@
+//
+// direct.h
+// Direct summation force solver: every body against every other body, no tree
+//
+
+#ifndef GPU_NBODY_DIRECT_H
+#define GPU_NBODY_DIRECT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "quadtree.h"
+#include "kernels.h"
+#include "config.h"
+
+/*  O(N^2), but exact (same G and EPSILON as the tree walk) and with nothing to build first, so for a few
+ *  thousand bodies it's faster than the tree, and for any number of bodies it's the right answer to check
+ *  the tree against.
+ *
+ *  The bodies are cut into tiles of sources small enough to stay in L1, and into blocks of targets.
+ *  Each thread takes a block of targets and runs every one of them down one source tile before moving
+ *  on to the next tile, so each source gets loaded from memory once per block instead of once per target.
+ *  The tiles go through the same list kernel as the tree walk, so it's SIMD wherever that is.
+ */
+struct Direct {
+    std::size_t tile = DIRECT_TILE;         // sources per tile
+    std::size_t block = 64;                 // targets per block, one block is one task for a thread
+    double epsilon = EPSILON;               // softening length
+    ListKernel kernel = force_kernel().run; // adds up a tile for one target (see kernels.h)
+
+    void accel(Bodies& bodies);
+    void accel_active(Bodies& bodies, const std::vector<uint8_t>& active);
+};
+
+// Exact acceleration at one position from every body, one interaction at a time, for spot checks
+vec2 direct_accel(const Bodies& bodies, vec2 pos, double epsilon = EPSILON);
+
+/*  Below how many bodies Direct beats building and walking a tree on this machine
+ *  config.direct_crossover if that's set, otherwise timed once (both solvers, doubling N until the tree
+ *  wins) with the settings of the first config it's asked with
+ */
+std::size_t direct_crossover(const Config& config);
+
+#endif //GPU_NBODY_DIRECT_H
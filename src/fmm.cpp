@@ -0,0 +1,253 @@
+//
+// fmm.cpp
+// Fast multipole method force solver, see fmm.h
+//
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#include "Constants.h"
+#include "fmm.h"
+#include "kernels.h"
+
+// ## IMPLEMENTATION FILE ##
+
+// how many levels of splitting get handed out as separate tasks, same idea as in propogate()
+constexpr int FMM_TASK_LEVELS = 5;
+
+/*  Method to work out how far each node's bodies reach from its center of mass
+ *      inputs:         the tree, the fmm, a node, how deep it is
+ *      outputs:        none
+ *      side effects:   reach[] of the node and everything under it
+ *
+ *  leaves measure their bodies, branches take the furthest any child reaches, measured from their own
+ *  center. children before parents, split into tasks at the top like propogate()
+ */
+static void fmm_reach(Quadtree& tree, Fmm& fmm, std::size_t node, int level) {
+    Node& n = tree.nodes[node];
+    if (n.children == 0) {
+        double far_sq = 0;
+        for (std::size_t i = n.first; i < n.first + n.count; i++) {
+            double dx = tree.leaf_x[i] - n.centm.x;
+            double dy = tree.leaf_y[i] - n.centm.y;
+            far_sq = std::max(far_sq, dx * dx + dy * dy);
+        }
+        fmm.reach[node] = std::sqrt(far_sq);
+        return;
+    }
+
+    for (std::size_t c = n.children; c < n.children + 4; c++) {
+        if (tree.nodes[c].count == 0) { continue; }
+        if (level < FMM_TASK_LEVELS) {
+            #pragma omp task default(none) firstprivate(c, level) shared(tree, fmm)
+            fmm_reach(tree, fmm, c, level + 1);
+        } else {
+            fmm_reach(tree, fmm, c, level + 1);
+        }
+    }
+    #pragma omp taskwait
+
+    double reach = 0;
+    for (std::size_t c = n.children; c < n.children + 4; c++) {
+        const Node& child = tree.nodes[c];
+        if (child.count == 0) { continue; }
+        vec2 offset(child.centm.x - n.centm.x, child.centm.y - n.centm.y);
+        reach = std::max(reach, offset.mag() + fmm.reach[c]);
+    }
+    fmm.reach[node] = reach;
+}
+
+/*  Method to add the far field of one node (the source) onto the Local of another (the target)
+ *      inputs:         the target's Local, dist from the target's center of mass to the source's,
+ *                      the source node, softening squared
+ *      outputs:        none
+ *      side effects:   the Local is added onto
+ *
+ *  The pull of a point mass is G*m*g(d) with g(d) = d*K(|d|^2), K(s) = 1/((s + eps^2)*sqrt(s)), same as
+ *  everywhere else. At an offset y from the target's center it's g(dist - y), and Taylor expanding that in y:
+ *      g_k(dist - y) = g_k - y_i * d_i g_k + 1/2 y_i y_j * d_i d_j g_k
+ *      d_i g_k       = delta_ik K + 2 d_i d_k K'
+ *      d_i d_j g_k   = 2 K' (delta_ik d_j + delta_jk d_i + delta_ij d_k) + 4 d_i d_j d_k K''
+ *  the source's quadrupole only goes into the f part (see quadrupole_accel in kernels.cpp)
+ */
+static void fmm_m2l(Local& l, vec2 dist, const Node& source, double epsil_sq) {
+    const double dx = dist.x;
+    const double dy = dist.y;
+    double inv_s = 1.0 / (dx * dx + dy * dy);
+    double soft = 1.0 / (dx * dx + dy * dy + epsil_sq);
+    double k = soft * std::sqrt(inv_s);
+    double h = soft + 0.5 * inv_s;
+    double k1 = -k * h;                                          // K'
+    double k2 = k * (h * h + soft * soft + 0.5 * inv_s * inv_s); // K''
+    double gm = G * source.mass;
+
+    l.fx += gm * dx * k;
+    l.fy += gm * dy * k;
+    quadrupole_accel(dx, dy, source.qxx, source.qxy, source.qyy, G, epsil_sq, &l.fx, &l.fy);
+
+    l.jxx -= gm * (k + 2 * dx * dx * k1);
+    l.jxy -= gm * (2 * dx * dy * k1);
+    l.jyy -= gm * (k + 2 * dy * dy * k1);
+
+    l.hxxx += gm * (6 * k1 * dx + 4 * dx * dx * dx * k2);
+    l.hxxy += gm * (2 * k1 * dy + 4 * dx * dx * dy * k2);
+    l.hxyy += gm * (2 * k1 * dx + 4 * dx * dy * dy * k2);
+    l.hyyy += gm * (6 * k1 * dy + 4 * dy * dy * dy * k2);
+}
+
+// The acceleration a Local gives at an offset (x, y) from its center
+static vec2 fmm_eval(const Local& l, double x, double y) {
+    return vec2(l.fx + l.jxx * x + l.jxy * y + 0.5 * (l.hxxx * x * x + 2 * l.hxxy * x * y + l.hxyy * y * y),
+                l.fy + l.jxy * x + l.jyy * y + 0.5 * (l.hxxy * x * x + 2 * l.hxyy * x * y + l.hyyy * y * y));
+}
+
+// Moves a Local over to a new center, offset (x, y) from the old one, and adds it onto another
+static void fmm_l2l(Local& to, const Local& from, double x, double y) {
+    vec2 f = fmm_eval(from, x, y);
+    to.fx += f.x;
+    to.fy += f.y;
+    to.jxx += from.jxx + from.hxxx * x + from.hxxy * y;
+    to.jxy += from.jxy + from.hxxy * x + from.hxyy * y;
+    to.jyy += from.jyy + from.hxyy * x + from.hyyy * y;
+    to.hxxx += from.hxxx;
+    to.hxxy += from.hxxy;
+    to.hxyy += from.hxyy;
+    to.hyyy += from.hyyy;
+}
+
+/*  Method to add the pull of every body in one leaf onto every body in another, one by one
+ *  (or of a leaf on itself, where the kernel skips each body's pull on itself)
+ */
+static void fmm_p2p(Quadtree& tree, Fmm& fmm, const Node& target, const Node& source, double epsil_sq) {
+    for (std::size_t i = target.first; i < target.first + target.count; i++) {
+        tree.kernel(&tree.leaf_x[source.first], &tree.leaf_y[source.first], &tree.leaf_mass[source.first],
+                    source.count, tree.leaf_x[i], tree.leaf_y[i], G, epsil_sq, &fmm.near_x[i], &fmm.near_y[i]);
+    }
+}
+
+/*  Method to work out everything one node (the source) does to another (the target) and their insides
+ *      inputs:         the tree, the fmm, the target and source nodes, how many times the target's been split
+ *      outputs:        none
+ *      side effects:   adds onto local[] of the target and nodes under it, and near_x/near_y of its bodies
+ *
+ *  far enough apart: one m2l and done. otherwise split whichever is bigger, until they're far enough
+ *  apart or both leaves, then it's body by body. only the target side ever gets written to, so splits of
+ *  the target can go to separate tasks without two of them touching the same node
+ */
+static void fmm_interact(Quadtree& tree, Fmm& fmm, std::size_t target, std::size_t source, int level,
+                         double epsil_sq) {
+    const Node& a = tree.nodes[target];
+    const Node& b = tree.nodes[source];
+    const bool a_leaf = (a.children == 0);
+    const bool b_leaf = (b.children == 0);
+
+    // nothing to pull with, or nobody to pull on. refit() can leave nodes like that
+    if (b.mass == 0 || a.count == 0) { return; }
+
+    // a node against itself is never far enough, it's every pair of children instead
+    if (target == source) {
+        if (a_leaf) {
+            fmm_p2p(tree, fmm, a, a, epsil_sq);
+            return;
+        }
+        const std::size_t children = a.children;
+        auto with_siblings = [&](std::size_t ca) {
+            for (std::size_t cb = children; cb < children + 4; cb++) {
+                if (tree.nodes[cb].count == 0) { continue; }
+                fmm_interact(tree, fmm, ca, cb, level + 1, epsil_sq);
+            }
+        };
+        for (std::size_t ca = children; ca < children + 4; ca++) {
+            if (tree.nodes[ca].count == 0) { continue; }
+            if (level < FMM_TASK_LEVELS) {
+                #pragma omp task default(none) firstprivate(ca) shared(with_siblings)
+                with_siblings(ca);
+            } else {
+                with_siblings(ca);
+            }
+        }
+        #pragma omp taskwait
+        return;
+    }
+
+    vec2 dist(b.centm.x - a.centm.x, b.centm.y - a.centm.y);
+    double reach = fmm.reach[target] + fmm.reach[source];
+    if (reach * reach < fmm.theta * fmm.theta * dist.mag_sq()) {
+        fmm_m2l(fmm.local[target], dist, b, epsil_sq);
+        return;
+    }
+
+    if (a_leaf && b_leaf) {
+        fmm_p2p(tree, fmm, a, b, epsil_sq);
+    } else if (!a_leaf && (b_leaf || fmm.reach[target] >= fmm.reach[source])) {
+        for (std::size_t ca = a.children; ca < a.children + 4; ca++) {
+            if (tree.nodes[ca].count == 0) { continue; }
+            if (level < FMM_TASK_LEVELS) {
+                #pragma omp task default(none) firstprivate(ca, source, level, epsil_sq) shared(tree, fmm)
+                fmm_interact(tree, fmm, ca, source, level + 1, epsil_sq);
+            } else {
+                fmm_interact(tree, fmm, ca, source, level + 1, epsil_sq);
+            }
+        }
+        #pragma omp taskwait
+    } else {
+        for (std::size_t cb = b.children; cb < b.children + 4; cb++) {
+            if (tree.nodes[cb].count == 0) { continue; }
+            fmm_interact(tree, fmm, target, cb, level, epsil_sq);
+        }
+    }
+}
+
+/*  Method to hand each node's Local down to its children, and at the leaves out to the bodies
+ *      inputs:         the tree, the fmm, the bodies, a node, how deep it is
+ *      outputs:        none
+ *      side effects:   local[] of everything under the node, and accel of the bodies under it
+ */
+static void fmm_down(Quadtree& tree, Fmm& fmm, Bodies& bodies, std::size_t node, int level) {
+    const Node& n = tree.nodes[node];
+    const Local& l = fmm.local[node];
+    if (n.children == 0) {
+        for (std::size_t i = n.first; i < n.first + n.count; i++) {
+            vec2 far = fmm_eval(l, tree.leaf_x[i] - n.centm.x, tree.leaf_y[i] - n.centm.y);
+            bodies.set_accel(tree.leaf_body[i], vec2(far.x + fmm.near_x[i], far.y + fmm.near_y[i]));
+        }
+        return;
+    }
+
+    for (std::size_t c = n.children; c < n.children + 4; c++) {
+        const Node& child = tree.nodes[c];
+        if (child.count == 0) { continue; }
+        fmm_l2l(fmm.local[c], l, child.centm.x - n.centm.x, child.centm.y - n.centm.y);
+        if (level < FMM_TASK_LEVELS) {
+            #pragma omp task default(none) firstprivate(c, level) shared(tree, fmm, bodies)
+            fmm_down(tree, fmm, bodies, c, level + 1);
+        } else {
+            fmm_down(tree, fmm, bodies, c, level + 1);
+        }
+    }
+    #pragma omp taskwait
+}
+
+/*  Method to work out every body's acceleration with the FMM
+ *      inputs:         the tree (built by build_morton, propagated with quadrupole on), the bodies it was built from
+ *      outputs:        none
+ *      side effects:   sets accel on every body. reach/local/near_x/near_y get reused between calls
+ */
+void Fmm::accel(Quadtree& tree, Bodies& bodies) {
+    if (tree.nodes.empty() || tree.nodes[0].count == 0) { return; }
+    const double epsil_sq = epsilon * epsilon;
+
+    reach.resize(tree.nodes.size());
+    local.assign(tree.nodes.size(), Local());
+    near_x.assign(tree.leaf_x.size(), 0.0);
+    near_y.assign(tree.leaf_y.size(), 0.0);
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        fmm_reach(tree, *this, 0, 0);
+        fmm_interact(tree, *this, 0, 0, 0, epsil_sq);
+        fmm_down(tree, *this, bodies, 0, 0);
+    }
+}
@@ -0,0 +1,51 @@
+//
+// fmm.h
+// Fast multipole method force solver, built on the same quadtree as the Barnes-Hut walk
+//
+
+#ifndef GPU_NBODY_FMM_H
+#define GPU_NBODY_FMM_H
+
+#include <cstddef>
+#include <vector>
+#include "quadtree.h"
+
+/*  The far field around a node's center of mass, as a second order Taylor series
+ *  at an offset (x, y) from the center it's
+ *      a = f + J.(x, y) + 1/2 (x, y).H.(x, y)
+ *  J and H are symmetric, so only the different entries get stored
+ */
+struct Local {
+    double fx = 0, fy = 0;                          // the acceleration right at the center
+    double jxx = 0, jxy = 0, jyy = 0;               // its first derivatives
+    double hxxx = 0, hxxy = 0, hxyy = 0, hyyy = 0;  // and second derivatives
+};
+
+/*  Barnes-Hut takes every body and walks the tree for it. The FMM takes pairs of nodes instead:
+ *  two nodes far enough apart (for their size) trade one node-to-node interaction that covers every
+ *  body in both, and only nodes that are too close get split further. That's O(N) interactions
+ *  instead of O(N log N).
+ *
+ *  It uses the tree as built by build_morton and propagated with quadrupole on:
+ *      up:     the tree's masses, centers of mass and second moments are the multipoles. all that's
+ *              added here is how far each node's bodies reach from its center of mass
+ *      across: one walk over pairs of nodes. far pairs turn the source's multipole into a Local around
+ *              the target (monopole to second order, quadrupole to zeroth), near pairs of leaves add up
+ *              body by body with the list kernel
+ *      down:   every node's Local gets shifted onto its children, and evaluated at each body in the leaves
+ */
+struct Fmm {
+    double theta = FMM_THETA; // two nodes are far apart when (reach of one + reach of other) < theta * distance
+    double epsilon = EPSILON; // softening length
+
+    // per node, indexed like tree.nodes
+    std::vector<double> reach; // furthest any of the node's bodies is from its center of mass
+    std::vector<Local> local;  // far field around the node's center of mass
+    // per leaf slot, indexed like tree.leaf_x
+    std::vector<double> near_x; // the part of each body's acceleration added up body by body
+    std::vector<double> near_y;
+
+    void accel(Quadtree& tree, Bodies& bodies);
+};
+
+#endif //GPU_NBODY_FMM_H
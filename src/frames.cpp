@@ -0,0 +1,308 @@
+//
+// frames.cpp
+// Writing finished frames, see frames.h
+//
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+
+#include "frames.h"
+
+// ## IMPLEMENTATION FILE ##
+
+std::unique_ptr<FrameSink> make_frame_sink(const Config& config) {
+    if (config.frame_sink == "none") { return nullptr; }
+    if (config.frame_sink == "ppm") { return std::make_unique<FrameWriter>(config, FrameWriter::Format::Ppm); }
+    if (config.frame_sink == "raw") { return std::make_unique<FrameWriter>(config, FrameWriter::Format::Raw); }
+    if (config.frame_sink != "qoi") {
+        fprintf(stderr, "Error: no frame_sink called %s, writing qoi\n", config.frame_sink.c_str());
+    }
+    return std::make_unique<FrameWriter>(config, FrameWriter::Format::Qoi);
+}
+
+FrameWriter::FrameWriter(const Config& config, Format format)
+    : format(format), width(config.width), height(config.height), dir(config.frame_dir) {
+    if (format == Format::Raw) {
+        const std::string& target = config.frame_stream;
+        piped = !target.empty() && target[0] == '|';
+        stream = piped ? popen(target.c_str() + 1, "w") : std::fopen(target.c_str(), "wb");
+        if (!stream) {
+            fprintf(stderr, "Error: couldn't open %s for the frames\n", target.c_str());
+            failed = true;
+        }
+    } else {
+        // a new run's frames replace the last one's. a resumed run's carry on from them
+        std::error_code error;
+        std::filesystem::create_directories(dir, error);
+        if (config.resume.empty()) {
+            for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+                const std::string name = entry.path().filename().string();
+                const std::string ext = entry.path().extension().string();
+                if (name.rfind("Step", 0) == 0 && (ext == ".ppm" || ext == ".qoi")) {
+                    std::filesystem::remove(entry.path(), error);
+                }
+            }
+        }
+    }
+
+    // a stream has to stay in order, so one thread. files can be written in any order
+    const std::size_t threads = (format == Format::Raw) ? 1 : std::max(config.encode_threads, std::size_t(1));
+    max_pending = threads + 1;
+    for (std::size_t t = 0; t < threads; t++) {
+        workers.emplace_back(&FrameWriter::work, this);
+    }
+}
+
+FrameWriter::~FrameWriter() {
+    flush();
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread& worker : workers) { worker.join(); }
+    if (stream) {
+        if (piped) { pclose(stream); } else { std::fclose(stream); }
+    }
+}
+
+/*  Method to hand a frame over
+ *      inputs:         the frame, which step it is
+ *      outputs:        false if an earlier frame couldn't be written (this one's still taken)
+ *      side effects:   swaps the frame out of image for a spare buffer, waits if too many frames are queued
+ */
+bool FrameWriter::write(std::vector<uint8_t>& image, int step) {
+    std::unique_lock<std::mutex> hold(lock);
+    changed.wait(hold, [this]() { return jobs.size() + busy < max_pending; });
+    Job job;
+    job.step = step;
+    job.image.swap(image);
+    if (!spare.empty()) {
+        image.swap(spare.back());
+        spare.pop_back();
+    }
+    jobs.push_back(std::move(job));
+    const bool ok = !failed;
+    hold.unlock();
+    changed.notify_all();
+    return ok;
+}
+
+bool FrameWriter::flush() {
+    std::unique_lock<std::mutex> hold(lock);
+    changed.wait(hold, [this]() { return jobs.empty() && busy == 0; });
+    if (stream) { std::fflush(stream); }
+    return !failed;
+}
+
+// What each writing thread runs: takes the oldest frame, writes it, gives its buffer back, repeat until told to stop
+void FrameWriter::work() {
+    std::vector<uint8_t> encoded; // kept between frames, so it's only allocated once
+    std::unique_lock<std::mutex> hold(lock);
+    while (true) {
+        changed.wait(hold, [this]() { return !jobs.empty() || stopping; });
+        if (jobs.empty()) { return; }
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        busy++;
+        hold.unlock();
+
+        const std::size_t written = put(job, encoded);
+
+        hold.lock();
+        busy--;
+        if (written == 0) { failed = true; }
+        bytes += written;
+        frames++;
+        spare.push_back(std::move(job.image));
+        changed.notify_all();
+    }
+}
+
+/*  Method to encode and write one frame
+ *      inputs:         the frame, a buffer to encode into
+ *      outputs:        how many bytes got written, 0 if it couldn't be
+ *      side effects:   writes the file (or onto the stream, which only this thread touches)
+ */
+std::size_t FrameWriter::put(const Job& job, std::vector<uint8_t>& encoded) {
+    const std::size_t values = static_cast<std::size_t>(width) * height * 3;
+    if (format == Format::Raw) {
+        if (!stream || std::fwrite(job.image.data(), 1, values, stream) != values) { return 0; }
+        return values;
+    }
+
+    const uint8_t* data = job.image.data();
+    std::size_t size = values;
+    char header[64] = "";
+    std::size_t header_size = 0;
+    if (format == Format::Qoi) {
+        encode_qoi(job.image.data(), width, height, encoded);
+        data = encoded.data();
+        size = encoded.size();
+    } else {
+        header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/Step%05i.%s", job.step, format == Format::Qoi ? "qoi" : "ppm");
+    const std::string path = dir + name;
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Error: couldn't create %s\n", path.c_str());
+        return 0;
+    }
+    bool ok = std::fwrite(header, 1, header_size, file) == header_size && std::fwrite(data, 1, size, file) == size;
+    ok = (std::fclose(file) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error: couldn't write %s\n", path.c_str());
+        return 0;
+    }
+    return header_size + size;
+}
+
+/*  QOI, see qoiformat.org. Each pixel is one of (tried in this order):
+ *      the same as the last one       adds to a run, up to 62 of them in one byte
+ *      one seen recently              one byte: where it is in a 64 entry table, hashed on the color
+ *      close to the last one          one byte (-2..1 off each way) or two (green -32..31 off, red and
+ *                                     blue within -8..7 of however far green was)
+ *      anything else                  the color, four bytes
+ *  Our frames are mostly black with smooth dots on, so runs and small steps cover nearly all of it
+ */
+static uint32_t qoi_hash(uint8_t r, uint8_t g, uint8_t b) {
+    return (r * 3u + g * 5u + b * 7u + 255u * 11u) % 64u;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v) {
+    *p++ = static_cast<uint8_t>(v >> 24);
+    *p++ = static_cast<uint8_t>(v >> 16);
+    *p++ = static_cast<uint8_t>(v >> 8);
+    *p++ = static_cast<uint8_t>(v);
+    return p;
+}
+
+void encode_qoi(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out) {
+    const std::size_t pixels = static_cast<std::size_t>(width) * height;
+    out.resize(14 + pixels * 4 + 8); // as big as it can get, every pixel a full color
+    uint8_t* p = out.data();
+    std::memcpy(p, "qoif", 4);
+    p = put_u32(p + 4, static_cast<uint32_t>(width));
+    p = put_u32(p, static_cast<uint32_t>(height));
+    *p++ = 3; // rgb
+    *p++ = 0; // srgb
+
+    // colors packed with alpha 255 on top, so an empty (all 0) entry never matches one
+    uint32_t seen[64] = {};
+    uint8_t pr = 0, pg = 0, pb = 0;
+    int run = 0;
+    for (std::size_t i = 0; i < pixels; i++) {
+        const uint8_t r = rgb[3*i+0];
+        const uint8_t g = rgb[3*i+1];
+        const uint8_t b = rgb[3*i+2];
+        if (r == pr && g == pg && b == pb) {
+            run++;
+            if (run == 62 || i + 1 == pixels) {
+                *p++ = static_cast<uint8_t>(0xC0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *p++ = static_cast<uint8_t>(0xC0 | (run - 1));
+            run = 0;
+        }
+
+        const uint32_t packed = 0xFF000000u | (uint32_t(b) << 16) | (uint32_t(g) << 8) | r;
+        const uint32_t h = qoi_hash(r, g, b);
+        if (seen[h] == packed) {
+            *p++ = static_cast<uint8_t>(h);
+        } else {
+            seen[h] = packed;
+            const int dr = static_cast<int8_t>(r - pr);
+            const int dg = static_cast<int8_t>(g - pg);
+            const int db = static_cast<int8_t>(b - pb);
+            const int dr_g = dr - dg;
+            const int db_g = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *p++ = static_cast<uint8_t>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && dr_g >= -8 && dr_g <= 7 && db_g >= -8 && db_g <= 7) {
+                *p++ = static_cast<uint8_t>(0x80 | (dg + 32));
+                *p++ = static_cast<uint8_t>((dr_g + 8) << 4 | (db_g + 8));
+            } else {
+                *p++ = 0xFE;
+                *p++ = r;
+                *p++ = g;
+                *p++ = b;
+            }
+        }
+        pr = r;
+        pg = g;
+        pb = b;
+    }
+
+    static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    std::memcpy(p, end, sizeof(end));
+    p += sizeof(end);
+    out.resize(p - out.data());
+}
+
+// Reads back a 3 or 4 channel QOI file as rgb (alpha dropped). false if it isn't one, or is cut short or damaged
+bool decode_qoi(const uint8_t* data, std::size_t size, int& width, int& height, std::vector<uint8_t>& rgb) {
+    if (size < 14 + 8 || std::memcmp(data, "qoif", 4) != 0) { return false; }
+    auto get_u32 = [&](std::size_t at) {
+        return uint32_t(data[at]) << 24 | uint32_t(data[at + 1]) << 16 | uint32_t(data[at + 2]) << 8 | data[at + 3];
+    };
+    const uint32_t w = get_u32(4);
+    const uint32_t h = get_u32(8);
+    // a byte of chunks is at most 62 pixels (a run), so a header promising more than that can't be real.
+    // that also keeps pixels * 3 from overflowing, whatever the header says
+    const std::size_t chunks_end = size - 8;
+    const uint64_t pixels = uint64_t(w) * h;
+    if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX || pixels / 62 > chunks_end - 14) { return false; }
+    width = static_cast<int>(w);
+    height = static_cast<int>(h);
+    rgb.resize(static_cast<std::size_t>(pixels) * 3);
+
+    uint8_t seen[64][4] = {};
+    uint8_t px[4] = {0, 0, 0, 255};
+    std::size_t at = 14;
+    int run = 0;
+    for (std::size_t i = 0; i < pixels; i++) {
+        if (run > 0) {
+            run--;
+        } else if (at < chunks_end) {
+            const uint8_t op = data[at++];
+            if (op == 0xFE) {
+                if (chunks_end - at < 3) { return false; }
+                px[0] = data[at]; px[1] = data[at + 1]; px[2] = data[at + 2];
+                at += 3;
+            } else if (op == 0xFF) {
+                if (chunks_end - at < 4) { return false; }
+                px[0] = data[at]; px[1] = data[at + 1]; px[2] = data[at + 2]; px[3] = data[at + 3];
+                at += 4;
+            } else if ((op & 0xC0) == 0x00) {
+                std::memcpy(px, seen[op], 4);
+            } else if ((op & 0xC0) == 0x40) {
+                px[0] += ((op >> 4) & 3) - 2;
+                px[1] += ((op >> 2) & 3) - 2;
+                px[2] += (op & 3) - 2;
+            } else if ((op & 0xC0) == 0x80) {
+                if (at >= chunks_end) { return false; }
+                const uint8_t second = data[at++];
+                const int dg = (op & 0x3F) - 32;
+                px[0] += dg - 8 + ((second >> 4) & 0x0F);
+                px[1] += dg;
+                px[2] += dg - 8 + (second & 0x0F);
+            } else {
+                run = op & 0x3F;
+            }
+            std::memcpy(seen[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        } else {
+            return false;
+        }
+        rgb[3*i+0] = px[0];
+        rgb[3*i+1] = px[1];
+        rgb[3*i+2] = px[2];
+    }
+    return true;
+}
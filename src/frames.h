@@ -0,0 +1,92 @@
+//
+// frames.h
+// Where finished frames go: an image file per frame (QOI or PPM), or one raw video stream into a file or
+// straight into another program, encoded and written on threads of their own
+//
+
+#ifndef GPU_NBODY_FRAMES_H
+#define GPU_NBODY_FRAMES_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "config.h"
+
+/*  Anything finished frames can be handed to. A frame is 8 bit rgb, width x height of the config,
+ *  rows top to bottom (what tonemap() makes)
+ *  write() takes the frame by swapping it out of image, and puts back a buffer it's done with (or an
+ *  empty one) in its place, so frames don't get copied. flush() blocks until every frame handed over
+ *  so far is out, false if any of them couldn't be written
+ */
+struct FrameSink {
+    std::size_t bytes = 0;  // written so far, only up to date after flush()
+    std::size_t frames = 0;
+
+    virtual ~FrameSink() = default;
+    virtual bool write(std::vector<uint8_t>& image, int step) = 0;
+    virtual bool flush() = 0;
+};
+
+/*  The frame_sink setting:
+ *      "qoi"   frame_dir/StepNNNNN.qoi, lossless and a few times smaller than a PPM (see encode_qoi())
+ *      "ppm"   frame_dir/StepNNNNN.ppm, the raw pixels like it always was
+ *      "raw"   every frame's pixels one after another into frame_stream, a file, or "|command" to pipe
+ *              them into one, like ffmpeg (-f rawvideo -pix_fmt rgb24 -s WIDTHxHEIGHT -i -)
+ *      "none"  nothing gets written (null is returned)
+ *  Frames from a run that isn't a resumed one replace the old StepNNNNN files in frame_dir
+ */
+std::unique_ptr<FrameSink> make_frame_sink(const Config& config);
+
+/*  The sink behind every frame_sink format. write() queues the frame up and returns, encode_threads
+ *  threads encode and write the frames in the queue, a whole frame each. A raw stream has to go out in
+ *  order, so it only ever gets one. When encode_threads + 1 frames are already waiting, write() waits
+ */
+struct FrameWriter : FrameSink {
+    enum class Format { Qoi, Ppm, Raw };
+
+    FrameWriter(const Config& config, Format format);
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+    ~FrameWriter() override;
+
+    bool write(std::vector<uint8_t>& image, int step) override;
+    bool flush() override;
+
+private:
+    struct Job {
+        std::vector<uint8_t> image;
+        int step = 0;
+    };
+    Format format;
+    int width = 0;
+    int height = 0;
+    std::string dir;              // where the files go
+    std::FILE* stream = nullptr;  // or the one stream
+    bool piped = false;           // it's a program's stdin, so it gets pclose()d
+    std::size_t max_pending = 1;
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Job> jobs;                    // frames waiting to be written
+    std::vector<std::vector<uint8_t>> spare; // buffers of frames that are out, to hand back from write()
+    std::size_t busy = 0;                    // frames being written right now
+    bool stopping = false;
+    bool failed = false;
+
+    void work();
+    std::size_t put(const Job& job, std::vector<uint8_t>& encoded);
+};
+
+// QOI ("quite OK image" format), lossless. encode_qoi() replaces out with the file, header and all
+void encode_qoi(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out);
+bool decode_qoi(const uint8_t* data, std::size_t size, int& width, int& height, std::vector<uint8_t>& rgb);
+
+#endif //GPU_NBODY_FRAMES_H
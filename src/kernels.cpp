@@ -0,0 +1,328 @@
+//
+// kernels.cpp
+// Scalar and SIMD versions of the body-vs-list gravity kernel, and of the quadrupole correction
+//
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NBODY_X86 1
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+// ## IMPLEMENTATION FILE ##
+
+/*  The plain version, one interaction at a time
+ *  the others fall back on this for whatever's left over at the end of the list
+ */
+static void list_accel_scalar(const double* x, const double* y, const double* m, std::size_t n,
+                              double px, double py, double g, double epsil_sq, double* ax, double* ay) {
+    double sum_x = 0;
+    double sum_y = 0;
+    for (std::size_t j = 0; j < n; j++) {
+        double dx = x[j] - px;
+        double dy = y[j] - py;
+        double dist_sq = dx * dx + dy * dy;
+        double denom = (dist_sq + epsil_sq) * std::sqrt(dist_sq);
+        double f = (dist_sq > 0) ? g * m[j] / denom : 0.0;
+        sum_x += dx * f;
+        sum_y += dy * f;
+    }
+    *ax += sum_x;
+    *ay += sum_y;
+}
+
+/*  The quadrupole correction for a node that's being taken as one body
+ *  The monopole pull is g*m*d*K(|d|^2) with K(s) = 1/((s + eps^2)*sqrt(s)), same as the list kernels.
+ *  Taylor expanding that around the center of mass, the first order term is zero, and the second
+ *  order term works out to
+ *      g * (2*K'*Q.d + (tr(Q)*K' + 2*(d.Q.d)*K'') * d)
+ *  where Q is the second moments, and with h = 1/(s + eps^2) + 1/(2s)
+ *      K' = -K*h,      K'' = K*(h^2 + 1/(s + eps^2)^2 + 1/(2s^2))
+ *  the softening is kept in, so it stays right for nodes that aren't much further away than EPSILON
+ */
+void quadrupole_accel(double dx, double dy, double qxx, double qxy, double qyy,
+                      double g, double epsil_sq, double* ax, double* ay) {
+    double inv_s = 1.0 / (dx * dx + dy * dy);
+    double soft = 1.0 / (dx * dx + dy * dy + epsil_sq);
+    double k = soft * std::sqrt(inv_s);
+    double h = soft + 0.5 * inv_s;
+    double k1 = -k * h;                                          // K'
+    double k2 = k * (h * h + soft * soft + 0.5 * inv_s * inv_s); // K''
+
+    double qd_x = qxx * dx + qxy * dy;
+    double qd_y = qxy * dx + qyy * dy;
+    double along = (qxx + qyy) * k1 + 2 * (dx * qd_x + dy * qd_y) * k2;
+    *ax += g * (2 * k1 * qd_x + along * dx);
+    *ay += g * (2 * k1 * qd_y + along * dy);
+}
+
+static void quad_accel_scalar(const double* x, const double* y, const double* qxx, const double* qxy,
+                              const double* qyy, std::size_t n, double px, double py, double g, double epsil_sq,
+                              double* ax, double* ay) {
+    for (std::size_t j = 0; j < n; j++) {
+        quadrupole_accel(x[j] - px, y[j] - py, qxx[j], qxy[j], qyy[j], g, epsil_sq, ax, ay);
+    }
+}
+
+#ifdef NBODY_X86
+
+/*  The SIMD versions all do the same thing as the scalar one, a few lanes at a time:
+ *      dist_sq = dx^2 + dy^2
+ *      f       = g * m / ((dist_sq + eps^2) * sqrt(dist_sq)),  zeroed wherever dist_sq is 0
+ *  SSE2 and AVX2 use the exact sqrt and divide and no fma, so each lane matches the scalar math bit
+ *  for bit and only the order the lanes get added up in is different. That also means they're stuck
+ *  at the speed of the divider, which doesn't get any faster with wider registers.
+ *  AVX-512 gets around that with the hardware reciprocal estimates plus newton steps, which lands
+ *  within a few ulp of the scalar answer.
+ */
+
+// SSE2, 2 at a time. every x86-64 chip has this, so it's the floor
+static void list_accel_sse2(const double* x, const double* y, const double* m, std::size_t n,
+                            double px, double py, double g, double epsil_sq, double* ax, double* ay) {
+    const __m128d vpx = _mm_set1_pd(px);
+    const __m128d vpy = _mm_set1_pd(py);
+    const __m128d vg = _mm_set1_pd(g);
+    const __m128d veps = _mm_set1_pd(epsil_sq);
+    const __m128d zero = _mm_setzero_pd();
+    __m128d sum_x = zero;
+    __m128d sum_y = zero;
+
+    std::size_t j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(x + j), vpx);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(y + j), vpy);
+        __m128d dist_sq = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+        __m128d denom = _mm_mul_pd(_mm_add_pd(dist_sq, veps), _mm_sqrt_pd(dist_sq));
+        __m128d f = _mm_div_pd(_mm_mul_pd(vg, _mm_loadu_pd(m + j)), denom);
+        f = _mm_and_pd(f, _mm_cmpgt_pd(dist_sq, zero));
+        sum_x = _mm_add_pd(sum_x, _mm_mul_pd(dx, f));
+        sum_y = _mm_add_pd(sum_y, _mm_mul_pd(dy, f));
+    }
+
+    double lanes_x[2];
+    double lanes_y[2];
+    _mm_storeu_pd(lanes_x, sum_x);
+    _mm_storeu_pd(lanes_y, sum_y);
+    *ax += lanes_x[0] + lanes_x[1];
+    *ay += lanes_y[0] + lanes_y[1];
+    list_accel_scalar(x + j, y + j, m + j, n - j, px, py, g, epsil_sq, ax, ay);
+}
+
+// AVX2, 4 at a time
+__attribute__((target("avx2")))
+static void list_accel_avx2(const double* x, const double* y, const double* m, std::size_t n,
+                            double px, double py, double g, double epsil_sq, double* ax, double* ay) {
+    const __m256d vpx = _mm256_set1_pd(px);
+    const __m256d vpy = _mm256_set1_pd(py);
+    const __m256d vg = _mm256_set1_pd(g);
+    const __m256d veps = _mm256_set1_pd(epsil_sq);
+    const __m256d zero = _mm256_setzero_pd();
+    __m256d sum_x = zero;
+    __m256d sum_y = zero;
+
+    std::size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), vpx);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), vpy);
+        __m256d dist_sq = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+        __m256d denom = _mm256_mul_pd(_mm256_add_pd(dist_sq, veps), _mm256_sqrt_pd(dist_sq));
+        __m256d f = _mm256_div_pd(_mm256_mul_pd(vg, _mm256_loadu_pd(m + j)), denom);
+        f = _mm256_and_pd(f, _mm256_cmp_pd(dist_sq, zero, _CMP_GT_OQ));
+        sum_x = _mm256_add_pd(sum_x, _mm256_mul_pd(dx, f));
+        sum_y = _mm256_add_pd(sum_y, _mm256_mul_pd(dy, f));
+    }
+
+    double lanes_x[4];
+    double lanes_y[4];
+    _mm256_storeu_pd(lanes_x, sum_x);
+    _mm256_storeu_pd(lanes_y, sum_y);
+    *ax += (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+    *ay += (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+    list_accel_scalar(x + j, y + j, m + j, n - j, px, py, g, epsil_sq, ax, ay);
+}
+
+// AVX-512, 8 at a time. the leftovers go through a masked load instead of the scalar loop
+// adds up the 8 lanes, in the same order _mm512_reduce_add_pd does (halves, then quarters, then the pair)
+// by hand, because GCC 12's version of that one (like the unmasked rsqrt14/rcp14) starts from an undefined
+// register, which -Wall warns about
+__attribute__((target("avx512f")))
+static inline double add_lanes(__m512d v) {
+    double l[8];
+    _mm512_storeu_pd(l, v);
+    return ((l[0] + l[4]) + (l[2] + l[6])) + ((l[1] + l[5]) + (l[3] + l[7]));
+}
+
+__attribute__((target("avx512f")))
+static void list_accel_avx512(const double* x, const double* y, const double* m, std::size_t n,
+                              double px, double py, double g, double epsil_sq, double* ax, double* ay) {
+    const __m512d vpx = _mm512_set1_pd(px);
+    const __m512d vpy = _mm512_set1_pd(py);
+    const __m512d vg = _mm512_set1_pd(g);
+    const __m512d veps = _mm512_set1_pd(epsil_sq);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d three_halves = _mm512_set1_pd(1.5);
+    const __m512d two = _mm512_set1_pd(2.0);
+    __m512d sum_x = zero;
+    __m512d sum_y = zero;
+
+    for (std::size_t j = 0; j < n; j += 8) {
+        // all 8 lanes on, except on the last partial chunk
+        __mmask8 live = (n - j >= 8) ? static_cast<__mmask8>(0xFF) : static_cast<__mmask8>((1u << (n - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, x + j), vpx);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, y + j), vpy);
+        __m512d dist_sq = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy));
+        __m512d soft_sq = _mm512_add_pd(dist_sq, veps);
+
+        // 1/dist and 1/(dist^2 + eps^2) from the 14 bit estimates, two newton steps each
+        __m512d inv_dist = _mm512_maskz_rsqrt14_pd(0xFF, dist_sq);
+        inv_dist = _mm512_mul_pd(inv_dist, _mm512_fnmadd_pd(_mm512_mul_pd(half, dist_sq),
+                                                            _mm512_mul_pd(inv_dist, inv_dist), three_halves));
+        inv_dist = _mm512_mul_pd(inv_dist, _mm512_fnmadd_pd(_mm512_mul_pd(half, dist_sq),
+                                                            _mm512_mul_pd(inv_dist, inv_dist), three_halves));
+        __m512d inv_soft = _mm512_maskz_rcp14_pd(0xFF, soft_sq);
+        inv_soft = _mm512_mul_pd(inv_soft, _mm512_fnmadd_pd(soft_sq, inv_soft, two));
+        inv_soft = _mm512_mul_pd(inv_soft, _mm512_fnmadd_pd(soft_sq, inv_soft, two));
+
+        __mmask8 pull = live & _mm512_cmp_pd_mask(dist_sq, zero, _CMP_GT_OQ);
+        __m512d f = _mm512_maskz_mul_pd(pull, _mm512_mul_pd(vg, _mm512_maskz_loadu_pd(live, m + j)),
+                                        _mm512_mul_pd(inv_dist, inv_soft));
+        sum_x = _mm512_add_pd(sum_x, _mm512_mul_pd(dx, f));
+        sum_y = _mm512_add_pd(sum_y, _mm512_mul_pd(dy, f));
+    }
+
+    *ax += add_lanes(sum_x);
+    *ay += add_lanes(sum_y);
+}
+
+/*  The quadrupole correction, 4 and 8 at a time. same split as the list kernels: AVX2 does the exact
+ *  divides and sqrt, AVX-512 goes through the estimates. no SSE2 one, the scalar loop is about as quick
+ */
+__attribute__((target("avx2")))
+static void quad_accel_avx2(const double* x, const double* y, const double* qxx, const double* qxy,
+                            const double* qyy, std::size_t n, double px, double py, double g, double epsil_sq,
+                            double* ax, double* ay) {
+    const __m256d vpx = _mm256_set1_pd(px);
+    const __m256d vpy = _mm256_set1_pd(py);
+    const __m256d veps = _mm256_set1_pd(epsil_sq);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d two = _mm256_set1_pd(2.0);
+    __m256d sum_x = _mm256_setzero_pd();
+    __m256d sum_y = _mm256_setzero_pd();
+
+    std::size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), vpx);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), vpy);
+        __m256d vxx = _mm256_loadu_pd(qxx + j);
+        __m256d vxy = _mm256_loadu_pd(qxy + j);
+        __m256d vyy = _mm256_loadu_pd(qyy + j);
+        __m256d s = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+        __m256d inv_s = _mm256_div_pd(one, s);
+        __m256d soft = _mm256_div_pd(one, _mm256_add_pd(s, veps));
+        __m256d k = _mm256_mul_pd(soft, _mm256_sqrt_pd(inv_s));
+        __m256d h = _mm256_add_pd(soft, _mm256_mul_pd(half, inv_s));
+        __m256d k1 = _mm256_sub_pd(_mm256_setzero_pd(), _mm256_mul_pd(k, h));
+        __m256d k2 = _mm256_mul_pd(k, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(soft, soft)),
+                                                    _mm256_mul_pd(half, _mm256_mul_pd(inv_s, inv_s))));
+
+        __m256d qd_x = _mm256_add_pd(_mm256_mul_pd(vxx, dx), _mm256_mul_pd(vxy, dy));
+        __m256d qd_y = _mm256_add_pd(_mm256_mul_pd(vxy, dx), _mm256_mul_pd(vyy, dy));
+        __m256d dqd = _mm256_add_pd(_mm256_mul_pd(dx, qd_x), _mm256_mul_pd(dy, qd_y));
+        __m256d along = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(vxx, vyy), k1),
+                                      _mm256_mul_pd(_mm256_mul_pd(two, dqd), k2));
+        __m256d k1_2 = _mm256_mul_pd(two, k1);
+        sum_x = _mm256_add_pd(sum_x, _mm256_add_pd(_mm256_mul_pd(k1_2, qd_x), _mm256_mul_pd(along, dx)));
+        sum_y = _mm256_add_pd(sum_y, _mm256_add_pd(_mm256_mul_pd(k1_2, qd_y), _mm256_mul_pd(along, dy)));
+    }
+
+    double lanes_x[4];
+    double lanes_y[4];
+    _mm256_storeu_pd(lanes_x, sum_x);
+    _mm256_storeu_pd(lanes_y, sum_y);
+    *ax += g * ((lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]));
+    *ay += g * ((lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]));
+    quad_accel_scalar(x + j, y + j, qxx + j, qxy + j, qyy + j, n - j, px, py, g, epsil_sq, ax, ay);
+}
+
+__attribute__((target("avx512f")))
+static void quad_accel_avx512(const double* x, const double* y, const double* qxx, const double* qxy,
+                              const double* qyy, std::size_t n, double px, double py, double g, double epsil_sq,
+                              double* ax, double* ay) {
+    const __m512d vpx = _mm512_set1_pd(px);
+    const __m512d vpy = _mm512_set1_pd(py);
+    const __m512d veps = _mm512_set1_pd(epsil_sq);
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d three_halves = _mm512_set1_pd(1.5);
+    const __m512d two = _mm512_set1_pd(2.0);
+    __m512d sum_x = _mm512_setzero_pd();
+    __m512d sum_y = _mm512_setzero_pd();
+
+    for (std::size_t j = 0; j < n; j += 8) {
+        // the dead lanes get moved far off and have no moments, so they add exactly nothing
+        __mmask8 live = (n - j >= 8) ? static_cast<__mmask8>(0xFF) : static_cast<__mmask8>((1u << (n - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_mask_loadu_pd(_mm512_add_pd(vpx, two), live, x + j), vpx);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(live, y + j), vpy);
+        __m512d vxx = _mm512_maskz_loadu_pd(live, qxx + j);
+        __m512d vxy = _mm512_maskz_loadu_pd(live, qxy + j);
+        __m512d vyy = _mm512_maskz_loadu_pd(live, qyy + j);
+        __m512d s = _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy));
+        __m512d soft_sq = _mm512_add_pd(s, veps);
+
+        // 1/sqrt(s) and 1/(s + eps^2) from the 14 bit estimates, two newton steps each
+        __m512d inv_dist = _mm512_maskz_rsqrt14_pd(0xFF, s);
+        inv_dist = _mm512_mul_pd(inv_dist, _mm512_fnmadd_pd(_mm512_mul_pd(half, s),
+                                                            _mm512_mul_pd(inv_dist, inv_dist), three_halves));
+        inv_dist = _mm512_mul_pd(inv_dist, _mm512_fnmadd_pd(_mm512_mul_pd(half, s),
+                                                            _mm512_mul_pd(inv_dist, inv_dist), three_halves));
+        __m512d soft = _mm512_maskz_rcp14_pd(0xFF, soft_sq);
+        soft = _mm512_mul_pd(soft, _mm512_fnmadd_pd(soft_sq, soft, two));
+        soft = _mm512_mul_pd(soft, _mm512_fnmadd_pd(soft_sq, soft, two));
+        __m512d inv_s = _mm512_mul_pd(inv_dist, inv_dist);
+
+        __m512d k = _mm512_mul_pd(soft, inv_dist);
+        __m512d h = _mm512_fmadd_pd(half, inv_s, soft);
+        __m512d k1 = _mm512_sub_pd(_mm512_setzero_pd(), _mm512_mul_pd(k, h));
+        __m512d k2 = _mm512_mul_pd(k, _mm512_fmadd_pd(h, h, _mm512_fmadd_pd(soft, soft,
+                                                                           _mm512_mul_pd(half, _mm512_mul_pd(inv_s, inv_s)))));
+
+        __m512d qd_x = _mm512_fmadd_pd(vxx, dx, _mm512_mul_pd(vxy, dy));
+        __m512d qd_y = _mm512_fmadd_pd(vxy, dx, _mm512_mul_pd(vyy, dy));
+        __m512d dqd = _mm512_fmadd_pd(dx, qd_x, _mm512_mul_pd(dy, qd_y));
+        __m512d along = _mm512_fmadd_pd(_mm512_add_pd(vxx, vyy), k1, _mm512_mul_pd(_mm512_mul_pd(two, dqd), k2));
+        __m512d k1_2 = _mm512_mul_pd(two, k1);
+        sum_x = _mm512_add_pd(sum_x, _mm512_fmadd_pd(k1_2, qd_x, _mm512_mul_pd(along, dx)));
+        sum_y = _mm512_add_pd(sum_y, _mm512_fmadd_pd(k1_2, qd_y, _mm512_mul_pd(along, dy)));
+    }
+
+    *ax += g * add_lanes(sum_x);
+    *ay += g * add_lanes(sum_y);
+}
+
+#endif // NBODY_X86
+
+std::vector<ForceKernel> force_kernels() {
+    std::vector<ForceKernel> kernels = {{"scalar", 1, list_accel_scalar, quad_accel_scalar}};
+#ifdef NBODY_X86
+    __builtin_cpu_init();
+    kernels.push_back({"sse2", 2, list_accel_sse2, quad_accel_scalar});
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", 4, list_accel_avx2, quad_accel_avx2});
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back({"avx512", 8, list_accel_avx512, quad_accel_avx512});
+    }
+#endif
+    return kernels;
+}
+
+const ForceKernel& force_kernel() {
+    // the list is widest-last, so the best one is at the back
+    static const ForceKernel best = force_kernels().back();
+    return best;
+}
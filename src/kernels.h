@@ -0,0 +1,47 @@
+//
+// kernels.h
+// The body-vs-list gravity kernel, in a scalar version and SIMD versions picked at runtime
+//
+
+#ifndef GPU_NBODY_KERNELS_H
+#define GPU_NBODY_KERNELS_H
+
+#include <cstddef>
+#include <vector>
+
+/*  Adds up the pull of n point masses on one position
+ *      x, y, m:        the point masses, as separate arrays
+ *      px, py:         the position being pulled on
+ *      g, epsil_sq:    gravity and the softening squared, same meaning as in Quadtree::accel
+ *      ax, ay:         where the total gets added
+ *  a point mass sitting right on (px, py) adds nothing, that's the body itself
+ */
+using ListKernel = void (*)(const double* x, const double* y, const double* m, std::size_t n,
+                            double px, double py, double g, double epsil_sq, double* ax, double* ay);
+
+/*  Adds up the quadrupole corrections of n nodes on one position, on top of their monopole pull
+ *      x, y:               the nodes' centers of mass
+ *      qxx, qxy, qyy:      their second moments around it (see Node)
+ *      the rest:           same as ListKernel
+ */
+using QuadKernel = void (*)(const double* x, const double* y, const double* qxx, const double* qxy, const double* qyy,
+                            std::size_t n, double px, double py, double g, double epsil_sq, double* ax, double* ay);
+
+// The same correction for just one node, dx and dy going from the position to its center of mass
+void quadrupole_accel(double dx, double dy, double qxx, double qxy, double qyy,
+                      double g, double epsil_sq, double* ax, double* ay);
+
+struct ForceKernel {
+    const char* name;
+    int width;      // interactions per instruction
+    ListKernel run;
+    QuadKernel quad;
+};
+
+// The widest kernel this CPU can run. Checked once, the first time it's asked for
+const ForceKernel& force_kernel();
+
+// Every kernel this CPU can run, scalar first. For the benchmarks and for checking them against each other
+std::vector<ForceKernel> force_kernels();
+
+#endif //GPU_NBODY_KERNELS_H
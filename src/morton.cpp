@@ -0,0 +1,124 @@
+//
+// morton.cpp
+// Morton keys and the parallel radix sort used by Quadtree::build_morton
+//
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <omp.h>
+
+#include "morton.h"
+
+// ## IMPLEMENTATION FILE ##
+
+/*  Spreads the bits of a 32 bit number out so there is a zero between each of them
+ *  i.e. abcd -> 0a0b0c0d
+ *  interleaving two of these gives the z-curve order
+ */
+static uint64_t spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2))  & 0x3333333333333333ull;
+    x = (x | (x << 1))  & 0x5555555555555555ull;
+    return x;
+}
+
+// Maps a fraction of the root box (0 to 1) onto an integer cell, clamping anything that falls off the edge
+static uint32_t to_cell(double f) {
+    constexpr uint32_t max_cell = (1u << MORTON_LEVELS) - 1;
+    double c = f * double(1u << MORTON_LEVELS);
+    if (!(c > 0)) { return 0; } // also catches NaN
+    if (c >= max_cell) { return max_cell; }
+    return static_cast<uint32_t>(c);
+}
+
+/*  Method to get the key of a position inside a root box
+ *      inputs:         a position, the root quad it lives in
+ *      outputs:        the 62 bit key, 2 bits per level
+ *      side effects:   none
+ *
+ *  note: a position sitting exactly on a center line lands in the east/south cell here, where
+ *          find_quadrant would put it west/north. accel() doesn't care which side it ends up on.
+ */
+uint64_t morton_encode(vec2 pos, const Quad& root) {
+    double fx = 0;
+    double fy = 0;
+    if (root.length > 0) {
+        double half = root.length * 0.5;
+        fx = (pos.x - (root.center.x - half)) / root.length;
+        // y is measured down from the top edge so the high bit of each digit means "south",
+        // which lines the digits up with find_quadrant's NW, NE, SW, SE numbering
+        fy = ((root.center.y + half) - pos.y) / root.length;
+    }
+    return (spread_bits(to_cell(fy)) << 1) | spread_bits(to_cell(fx));
+}
+
+/*  Method to compute and sort the keys of every body
+ *      inputs:         the list of bodies, the root box (from Quad::new_containing)
+ *      outputs:        one key per body, sorted ascending
+ *      side effects:   none
+ *
+ *  This is a plain LSD radix sort, 8 bits per pass. Each thread counts digits in its own slice,
+ *  the counts get turned into write offsets, and then each thread scatters its slice.
+ *  Passes where every key has the same digit get skipped.
+ */
+std::vector<MortonKey> morton_sort(const Bodies& bodies, const Quad& root) {
+    const std::size_t n = bodies.size();
+    std::vector<MortonKey> keys(n);
+    std::vector<MortonKey> scratch(n);
+
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        keys[i].key = morton_encode(bodies.pos(i), root);
+        keys[i].index = static_cast<uint32_t>(i);
+    }
+
+    constexpr int radix = 256;
+    std::vector<std::size_t> counts(static_cast<std::size_t>(omp_get_max_threads()) * radix);
+
+    for (int shift = 0; shift < 2 * MORTON_LEVELS; shift += 8) {
+        bool skip = false;
+
+        #pragma omp parallel
+        {
+            const int t = omp_get_thread_num();
+            const int nt = omp_get_num_threads();
+            const std::size_t begin = n * t / nt;
+            const std::size_t end = n * (t + 1) / nt;
+            std::size_t* count = &counts[static_cast<std::size_t>(t) * radix];
+
+            std::fill(count, count + radix, 0);
+            for (std::size_t i = begin; i < end; i++) {
+                count[(keys[i].key >> shift) & (radix - 1)]++;
+            }
+            #pragma omp barrier
+
+            // turn the counts into starting offsets: all of digit 0 (thread by thread), then digit 1...
+            #pragma omp single
+            {
+                std::size_t offset = 0;
+                for (int d = 0; d < radix; d++) {
+                    std::size_t total = 0;
+                    for (int tt = 0; tt < nt; tt++) {
+                        std::size_t c = counts[static_cast<std::size_t>(tt) * radix + d];
+                        counts[static_cast<std::size_t>(tt) * radix + d] = offset;
+                        offset += c;
+                        total += c;
+                    }
+                    if (total == n) { skip = true; }
+                }
+            }
+
+            if (!skip) {
+                for (std::size_t i = begin; i < end; i++) {
+                    scratch[count[(keys[i].key >> shift) & (radix - 1)]++] = keys[i];
+                }
+            }
+        }
+
+        if (!skip) { keys.swap(scratch); }
+    }
+    return keys;
+}
@@ -0,0 +1,38 @@
+//
+// morton.h
+// Morton (Z-curve) keys for the bottom-up tree build
+//
+
+#ifndef GPU_NBODY_MORTON_H
+#define GPU_NBODY_MORTON_H
+
+#include <cstdint>
+#include <vector>
+#include "quadtree.h"
+
+// number of quadtree levels a key can resolve. 2 bits per level, so 31 levels fits in a uint64_t
+// bodies closer together than root.length / 2^31 end up sharing a leaf, same as coincident bodies do in insert()
+constexpr int MORTON_LEVELS = 31;
+
+/*  A body's key paired with its index in the body list
+ *  the key is read 2 bits at a time from the top, and each 2 bit digit is the quadrant number
+ *  that find_quadrant would hand back at that level (NW = 0, NE = 1, SW = 2, SE = 3)
+ *  so sorting by key puts the bodies in exactly the order the tree lays out its children
+ */
+struct MortonKey {
+    uint64_t key;
+    uint32_t index;
+};
+
+// Key of a single position inside the given root box
+uint64_t morton_encode(vec2 pos, const Quad& root);
+
+// The quadrant digit of a key at a given depth (0 = the root's children)
+inline int morton_digit(uint64_t key, int level) {
+    return static_cast<int>((key >> (2 * (MORTON_LEVELS - 1 - level))) & 3);
+}
+
+// Computes every body's key and radix-sorts them, both in parallel
+std::vector<MortonKey> morton_sort(const Bodies& bodies, const Quad& root);
+
+#endif //GPU_NBODY_MORTON_H
@@ -11,6 +11,8 @@
 #include "quadtree.h"
 #include "simulation.h"
 #include "render.h"
+#include "config.h"
+#include "utils.h"
 
 
 // I wanna implement charged particles
@@ -28,39 +30,73 @@ int main(int argc, char * argv[]){
     std::cout << std::unitbuf;  // Disable buffering for cout (for wrapper)
 
 
-    if (argc < 2) {
+    // settings: Constants.h defaults, then --config file and --key value flags (see config.h)
+    Config config;
+    if (!config.load_args(argc, argv)) {
+        return 1;
+    }
+    // a seed of 0 means a new one every run. it's picked here, once, so everything in the run generates from
+    // the same one, and checkpoints and the trajectory record the seed it really was (a resume takes its own)
+    config.seed = pick_seed(config);
+    // before anything big gets allocated, so every thread's first touches land next to where it stays
+    if (config.pin_threads) {
+        pin_threads();
+    }
+    // just making initial conditions: straight to disk, no simulating (and no need to fit them all in memory)
+    if (!config.write_ics.empty()) {
+        return stream_bodies(config.write_ics, config) ? 0 : 1;
+    }
+    if (config.frames == 0) {
         std::cerr << "Error: Please provide a number of frames for the simulation to generate \n";
         return 0;
     }
 
-    system("rm images/*");
-
     // create the simulation. all data generation happens in there
-    Simulation sim = Simulation();
+    // or pick one back up from a checkpoint, keeping the frames it already made
+    Simulation sim = config.resume.empty() ? Simulation(config) : Simulation(config.resume, config);
+    const std::size_t first_frame = sim.frame;
 
-    // Makes arrays to hold the data of the image
-    // they arent vectors because they don't need to be resized
-    char * image = new char[WIDTH*HEIGHT*3];
-    double * hdImage = new double[WIDTH*HEIGHT*3];
+    // draws each frame on its own thread while the next step runs, and encodes and writes them on others
+    // (see RenderPipeline and frames.h). a new run's frames replace the old ones in frame_dir
+    RenderPipeline renderer(config);
+    // and what each of those took, for whatever's watching (see telemetry.h)
+    Telemetry telemetry;
+    telemetry.open(config.telemetry);
+    telemetry.start(sim);
+    renderer.telemetry = &telemetry;
 
-    int stepcount = atoi(argv[1]);
-    for (int i=0; i<stepcount;i++ ) {
+    std::size_t stepcount = config.frames;
+    while (sim.frame < stepcount) {
         sim.step();
+        telemetry.step(sim);
         std::cout << "Step " << sim.frame << "\n";
         /*
         if (sim.bodies.size() > 0) {
             std::cout << "Step " << sim.frame << " - First body pos: ("
                       << sim.bodies[0].pos.x << ", " << sim.bodies[0].pos.y << ")\n";
             std::cout << "  Pixel coords: ("
-                      << toPixelSpace(sim.bodies[0].pos.x, WIDTH) << ", "
-                      << toPixelSpace(sim.bodies[0].pos.y, HEIGHT) << ")\n";
+                      << toPixelSpace(sim.bodies[0].pos.x, config.width, config) << ", "
+                      << toPixelSpace(sim.bodies[0].pos.y, config.height, config) << ")\n";
             std::cout << "  Velocity mag: " << magnitude(sim.bodies[0].vel) << "\n";
         }
          */
-        createFrame(image, hdImage, sim.bodies, sim.frame);
+        renderer.submit(sim.bodies, static_cast<int>(sim.frame), &sim.ygg);
+    }
+    renderer.finish();
+    telemetry.close();
+    // where the time went, averaged over every step (drawing mostly overlaps the steps, waiting is the part that didn't)
+    if (sim.frame > first_frame) {
+        double per = 1e3 / (sim.frame - first_frame);
+        printf("Average ms per frame: iterate %.2f, bounds %.2f, build %.2f, propagate %.2f, force %.2f, tune %.2f\n",
+               sim.total_times.iterate * per, sim.total_times.bounds * per, sim.total_times.build * per,
+               sim.total_times.propagate * per, sim.total_times.force * per, sim.total_times.tune * per);
+        printf("Average ms per frame drawing %.2f, waiting on it %.2f, %.2f MB of %s per frame\n",
+               renderer.drawing * per, renderer.waiting * per, renderer.written() / 1e6 / (sim.frame - first_frame),
+               config.frame_sink.c_str());
     }
-    std::cout << "Simulation completed successfully. Generating video... \n";
-    system("./make_video.sh");
+    sim.checkpointer.wait(); // the last checkpoint has to be on disk before we go
+    sim.trajectory.close();  // and the end of the trajectory, with its index
+    std::cout << "Simulation completed successfully.\n";
 
 
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+//
+// philox.h
+// Philox4x32-10, a counter-based random number generator
+//
+
+#ifndef GPU_NBODY_PHILOX_H
+#define GPU_NBODY_PHILOX_H
+
+#include <array>
+#include <cstdint>
+
+/*  A normal generator (like std::mt19937) has state that every number moves forward, so the numbers
+ *  for body i depend on every body generated before it, and the bodies have to be made one at a time.
+ *  Philox has no state: it scrambles a counter with a key, and the same (key, counter) always gives the
+ *  same 4 numbers. Key it with the seed, count with the body's index, and body i's numbers only depend
+ *  on (seed, i), so the bodies can be made in any order, on any number of threads, and come out the same.
+ *
+ *  This is Philox4x32 with 10 rounds, from Salmon et al. "Parallel random numbers: as easy as 1, 2, 3" (2011),
+ *  same constants as Random123 and curand, so it passes BigCrush
+ */
+struct Philox {
+    uint64_t seed;
+
+    explicit Philox(uint64_t seed) : seed(seed) {}
+
+    // The 4 random 32 bit numbers for a counter, here (what it's for, which block of numbers for it)
+    std::array<uint32_t, 4> block(uint64_t index, uint32_t block) const {
+        uint32_t c0 = static_cast<uint32_t>(index);
+        uint32_t c1 = static_cast<uint32_t>(index >> 32);
+        uint32_t c2 = block;
+        uint32_t c3 = 0;
+        uint32_t k0 = static_cast<uint32_t>(seed);
+        uint32_t k1 = static_cast<uint32_t>(seed >> 32);
+        for (int round = 0; round < 10; round++) {
+            uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+            uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+            uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+            uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+            c1 = static_cast<uint32_t>(p1);
+            c3 = static_cast<uint32_t>(p0);
+            c0 = n0;
+            c2 = n2;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        return {c0, c1, c2, c3};
+    }
+
+    // Two uniform doubles in [0, 1) for a counter, 53 random bits each
+    std::array<double, 2> uniform2(uint64_t index, uint32_t block) const {
+        std::array<uint32_t, 4> bits = this->block(index, block);
+        return {to_unit(bits[0], bits[1]), to_unit(bits[2], bits[3])};
+    }
+
+    static double to_unit(uint32_t hi, uint32_t lo) {
+        uint64_t bits = (static_cast<uint64_t>(hi) << 32 | lo) >> 11;
+        return static_cast<double>(bits) * (1.0 / 9007199254740992.0); // 2^-53
+    }
+};
+
+#endif //GPU_NBODY_PHILOX_H
@@ -6,13 +6,36 @@
 #include "Constants.h"
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <omp.h>
 
 #include "quadtree.h"
+#include "morton.h"
 
 // ## IMPLEMENTATION FILE ##
 
 
+/*  Method to place a new block of memory, one page at a time
+ *      inputs:         the block, how big it is
+ *      outputs:        none
+ *      side effects:   writes a byte to every page, each thread the pages a static loop over them would give it
+ *
+ *  Linux puts a page in the memory of the NUMA node whoever touches it first is running on. Left to the
+ *  thread that allocates it (filling it in, or vector's resize), all of a big array ends up next to that
+ *  one thread. This way the stretch each thread's static loops go over is next to that thread (and with
+ *  pin_threads() it stays there). Small blocks, and ones allocated inside a parallel loop, aren't touched
+ */
+void first_touch(void* memory, std::size_t bytes) {
+    const std::size_t page = 4096;
+    if (bytes < (std::size_t(1) << 20) || omp_in_parallel()) { return; }
+    char* start = static_cast<char*>(memory);
+    const std::size_t pages = (bytes + page - 1) / page;
+    #pragma omp parallel for schedule(static)
+    for (std::size_t p = 0; p < pages; p++) {
+        start[p * page] = 0;
+    }
+}
+
 /*  Method to create a root node that encompasses all given bodies
  *  inputs: a list of bodies
  *  outputs: nothing?
@@ -27,19 +50,139 @@ void Body::update(double delta_t) {
     pos = pos + (vel * delta_t);
 }
 
-void Quad::new_containing(const std::vector<Body>& bodies) {
+Column& Column::operator=(const Column& other) {
+    if (this != &other) {
+        release();
+        resize(other.count);
+        std::memcpy(values, other.values, count * sizeof(double));
+    }
+    return *this;
+}
+
+/*  Method to change how many values the column holds, new ones set to value
+ *  a view that has to grow gets copied into memory of its own first
+ */
+void Column::resize(std::size_t n, double value) {
+    if (n > capacity) {
+        AlignedAllocator<double> alloc;
+        double* grown = alloc.allocate(n);
+        std::size_t kept = std::min(count, n);
+        if (kept > 0) { std::memcpy(grown, values, kept * sizeof(double)); }
+        release();
+        values = grown;
+        capacity = n;
+        count = kept;
+    }
+    for (std::size_t i = count; i < n; i++) {
+        values[i] = value;
+    }
+    count = n;
+}
+
+// Points the column at n doubles it doesn't own, and drops whatever it had
+void Column::view(double* memory, std::size_t n, std::shared_ptr<void> memory_owner) {
+    release();
+    values = memory;
+    count = n;
+    owner = std::move(memory_owner);
+}
+
+void Column::release() {
+    if (owner == nullptr && values != nullptr) {
+        AlignedAllocator<double>().deallocate(values, capacity);
+    }
+    values = nullptr;
+    count = 0;
+    capacity = 0;
+    owner.reset();
+}
+
+void Column::swap(Column& other) noexcept {
+    std::swap(values, other.values);
+    std::swap(count, other.count);
+    std::swap(capacity, other.capacity);
+    std::swap(owner, other.owner);
+}
+
+Bodies::Bodies(const std::vector<Body>& bodies) {
+    resize(bodies.size());
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        set(i, bodies[i]);
+    }
+}
+
+void Bodies::resize(std::size_t n) {
+    for (Column* column : {&x, &y, &vx, &vy, &ax, &ay, &mass}) {
+        column->resize(n, 0.0);
+    }
+}
+
+void Bodies::set(std::size_t i, const Body& body) {
+    x[i] = body.pos.x;
+    y[i] = body.pos.y;
+    vx[i] = body.vel.x;
+    vy[i] = body.vel.y;
+    ax[i] = body.accel.x;
+    ay[i] = body.accel.y;
+    mass[i] = body.mass;
+}
+
+std::vector<Body> Bodies::to_vector() const {
+    std::vector<Body> bodies(size());
+    for (std::size_t i = 0; i < size(); i++) {
+        bodies[i] = (*this)[i];
+    }
+    return bodies;
+}
+
+/*  Method to move every body forward one step, the same math as Body::update
+ *  just the four arrays it needs, one plain loop over each index, so the compiler vectorizes it
+ */
+void Bodies::update(double delta_t) {
+    const std::size_t n = size();
+    double* __restrict px = x.data();
+    double* __restrict py = y.data();
+    double* __restrict pvx = vx.data();
+    double* __restrict pvy = vy.data();
+    const double* __restrict pax = ax.data();
+    const double* __restrict pay = ay.data();
+    #pragma omp parallel for simd schedule(static)
+    for (std::size_t i = 0; i < n; i++) {
+        pvx[i] += pax[i] * delta_t;
+        pvy[i] += pay[i] * delta_t;
+        px[i] += pvx[i] * delta_t;
+        py[i] += pvy[i] * delta_t;
+    }
+}
+
+// Method to move every body along its velocity without touching the velocity, the leapfrog's drift
+void Bodies::drift(double delta_t) {
+    const std::size_t n = size();
+    double* __restrict px = x.data();
+    double* __restrict py = y.data();
+    const double* __restrict pvx = vx.data();
+    const double* __restrict pvy = vy.data();
+    #pragma omp parallel for simd schedule(static)
+    for (std::size_t i = 0; i < n; i++) {
+        px[i] += pvx[i] * delta_t;
+        py[i] += pvy[i] * delta_t;
+    }
+}
+
+void Quad::new_containing(const Bodies& bodies) {
     double min_x = std::numeric_limits<double>::max();
     double min_y = std::numeric_limits<double>::max();
-    double max_x = std::numeric_limits<double>::min();
-    double max_y = std::numeric_limits<double>::min();
+    double max_x = std::numeric_limits<double>::lowest();
+    double max_y = std::numeric_limits<double>::lowest();
 
     // for body in bodies:
-    for (const Body& body : bodies) {
+    #pragma omp parallel for reduction(min:min_x,min_y) reduction(max:max_x,max_y)
+    for (std::size_t i = 0; i < bodies.size(); i++) {
         // count down and up such that you end up with values that bound all points in the list
-        min_x = std::min(min_x, body.pos.x);
-        min_y = std::min(min_y, body.pos.y);
-        max_x = std::max(max_x, body.pos.x);
-        max_y = std::max(max_y, body.pos.y);
+        min_x = std::min(min_x, bodies.x[i]);
+        min_y = std::min(min_y, bodies.y[i]);
+        max_x = std::max(max_x, bodies.x[i]);
+        max_y = std::max(max_y, bodies.y[i]);
     }
     center = vec2((min_x + max_x) * .5, (min_y + max_y) *.5);
     length = std::max(max_x - min_x, max_y - min_y);
@@ -62,6 +205,12 @@ int Quad::find_quadrant(vec2 pos) {
     return 3; // pos.x > center.x && pos.y < center.y
 }
 
+// Whether a position is inside (or right on the edge of) the box, optionally scaled up around its center
+bool Quad::contains(vec2 pos, double scale) const {
+    double half = length * 0.5 * scale;
+    return std::abs(pos.x - center.x) <= half && std::abs(pos.y - center.y) <= half;
+}
+
 // Returns one sub-quad for a given quadrant
 Quad Quad::into_quadrant(int quadrant) const  {
     // generates dummy quadrant
@@ -170,6 +319,7 @@ void Quadtree::insert(vec2 body_pos, double body_mass) {
 
     auto bp = body_pos; // = pos
     auto np = nodes[node].centm; // == p
+    auto nm = nodes[node].mass; // hang on to this too, nodes[node] stops being the old leaf once we move down
     while(true) {
         // children == index of first newly created child node
         auto children = this->subdivide(node);
@@ -188,8 +338,8 @@ void Quadtree::insert(vec2 body_pos, double body_mass) {
             auto n1 = children + q1;
             auto n2 = children + q2;
 
-            nodes[n1].centm = nodes[node].centm;
-            nodes[n1].mass = nodes[node].mass;
+            nodes[n1].centm = np;
+            nodes[n1].mass = nm;
             nodes[n2].centm = body_pos;
             nodes[n2].mass = body_mass;
             return;
@@ -208,6 +358,10 @@ void Quadtree::insert(vec2 body_pos, double body_mass) {
 void Quadtree::reset(Quad root) {
     nodes.clear();
     parents.clear(); //maybe? we dont have that yet
+    leaf_x.clear();
+    leaf_y.clear();
+    leaf_mass.clear();
+    leaf_body.clear();
     nodes.push_back(Node(root));
 }
 
@@ -237,9 +391,393 @@ std::size_t Quadtree::subdivide(std::size_t node) {
     return children;
 }
 
+// A subtree that build_morton hands off to a worker thread
+struct MortonTask {
+    std::size_t node;   // index of the subtree's root in the main tree
+    std::size_t begin;  // the run of sorted keys that falls inside it
+    std::size_t end;
+    int level;          // which digit of the key picks the quadrant of its children
+};
+
+// placeholder "next" for the root of a subtree that hasn't been spliced into the main tree yet
+constexpr std::size_t DETACHED = std::numeric_limits<std::size_t>::max();
+
+// Sets the mass and center of mass of a leaf from the bodies in a run of sorted keys
+static void morton_leaf(Node& leaf, const std::vector<MortonKey>& keys, const Bodies& bodies,
+                        std::size_t begin, std::size_t end) {
+    // the common case, one body alone in its leaf. same as insert() would do
+    if (end - begin == 1) {
+        const std::size_t b = keys[begin].index;
+        leaf.centm = bodies.pos(b);
+        leaf.mass = bodies.mass[b];
+        return;
+    }
+    // otherwise it's a bucket (or bodies too close to tell apart)
+    vec2 weighted(0, 0);
+    double mass = 0;
+    for (std::size_t i = begin; i < end; i++) {
+        const std::size_t b = keys[i].index;
+        weighted = weighted + bodies.pos(b) * bodies.mass[b];
+        mass += bodies.mass[b];
+    }
+    leaf.mass = mass;
+    leaf.centm = (mass > 0) ? weighted / mass : bodies.pos(keys[begin].index);
+}
+
+/*  Method to build the part of the tree under one node out of a run of sorted keys
+ *      inputs:         the tree, the node, the sorted keys and bodies, the run [begin, end),
+ *                      the depth of the node's children, and optionally a list to put tasks in
+ *      outputs:        none
+ *      side effects:   subdivides nodes and fills in leaves, the same way insert() would
+ *
+ *  if tasks isn't null, any run of cutoff bodies or less gets written down as a task instead of built
+ */
+static void morton_build(Quadtree& tree, std::size_t node, const std::vector<MortonKey>& keys,
+                         const Bodies& bodies, std::size_t begin, std::size_t end, int level,
+                         std::size_t cutoff, std::vector<MortonTask>* tasks) {
+    // empty quadrant, it stays an empty leaf
+    if (begin == end) { return; }
+
+    // every node remembers its run of bodies, so a whole subtree can be handed out as a group
+    tree.nodes[node].first = begin;
+    tree.nodes[node].count = end - begin;
+
+    // few enough bodies to fit in a bucket, or bodies the keys can't tell apart: this is a leaf
+    if (end - begin <= std::max<std::size_t>(tree.leaf_capacity, 1)
+        || level == MORTON_LEVELS || keys[begin].key == keys[end - 1].key) {
+        morton_leaf(tree.nodes[node], keys, bodies, begin, end);
+        return;
+    }
+
+    if (tasks != nullptr && end - begin <= cutoff) {
+        tasks->push_back({node, begin, end, level});
+        return;
+    }
+
+    std::size_t children = tree.subdivide(node);
+
+    // the keys are sorted, so the bodies of each quadrant are one contiguous run
+    std::size_t start = begin;
+    for (int q = 0; q < 4; q++) {
+        std::size_t stop = end;
+        if (q < 3) {
+            auto split = std::partition_point(keys.begin() + start, keys.begin() + end,
+                    [&](const MortonKey& k) { return morton_digit(k.key, level) <= q; });
+            stop = split - keys.begin();
+        }
+        morton_build(tree, children + q, keys, bodies, start, stop, level + 1, cutoff, tasks);
+        start = stop;
+    }
+}
+
+/*  Method to build the whole tree at once from Morton-sorted bodies, instead of inserting them one by one
+ *      inputs:         the list of bodies, the root quad (from Quad::new_containing)
+ *      outputs:        none
+ *      side effects:   the tree is reset and rebuilt. nodes/children/next/parents come out in the same
+ *                      layout insert() makes, so propogate() and accel() work on it unchanged
+ *                      leaves hold up to leaf_capacity bodies, copied into leaf_x/leaf_y/leaf_mass in key order
+ *
+ *  1. key and radix-sort the bodies (in parallel, see morton.cpp)
+ *  2. build the top few levels on one thread, until the runs get small enough to hand out
+ *  3. build those subtrees in parallel, each into its own scratch tree
+ *  4. splice the scratch trees onto the end of the main one, shifting their indices as we go
+ */
+void Quadtree::build_morton(const Bodies& bodies, Quad root) {
+    reset(root);
+    if (bodies.empty()) { return; }
+
+    std::vector<MortonKey> keys = morton_sort(bodies, root);
+
+    leaf_x.resize(bodies.size());
+    leaf_y.resize(bodies.size());
+    leaf_mass.resize(bodies.size());
+    leaf_body.resize(bodies.size());
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < keys.size(); i++) {
+        leaf_x[i] = bodies.x[keys[i].index];
+        leaf_y[i] = bodies.y[keys[i].index];
+        leaf_mass[i] = bodies.mass[keys[i].index];
+        leaf_body[i] = keys[i].index;
+    }
+
+    std::size_t cutoff = std::max<std::size_t>(bodies.size() / (16 * omp_get_max_threads()), 256);
+    std::vector<MortonTask> tasks;
+    morton_build(*this, 0, keys, bodies, 0, bodies.size(), 0, cutoff, &tasks);
+
+    // scratch node 0 stands in for the task's root node
+    std::vector<Quadtree> subtrees(tasks.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (std::size_t t = 0; t < tasks.size(); t++) {
+        Quadtree& sub = subtrees[t];
+        sub.leaf_capacity = leaf_capacity;
+        sub.nodes.push_back(Node(nodes[tasks[t].node].quad, DETACHED));
+        morton_build(sub, 0, keys, bodies, tasks[t].begin, tasks[t].end, tasks[t].level, 0, nullptr);
+    }
+
+    // work out where each subtree lands (everything but its root, which already exists)
+    std::vector<std::size_t> node_offset(tasks.size());
+    std::vector<std::size_t> parent_offset(tasks.size());
+    std::size_t node_count = nodes.size();
+    std::size_t parent_count = parents.size();
+    for (std::size_t t = 0; t < tasks.size(); t++) {
+        node_offset[t] = node_count;
+        parent_offset[t] = parent_count;
+        node_count += subtrees[t].nodes.size() - 1;
+        parent_count += subtrees[t].parents.size();
+    }
+    nodes.resize(node_count);
+    parents.resize(parent_count);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (std::size_t t = 0; t < tasks.size(); t++) {
+        const Quadtree& sub = subtrees[t];
+        const std::size_t task_root = tasks[t].node;
+        const std::size_t outer_next = nodes[task_root].next;
+        auto place = [&](std::size_t local) {
+            return (local == 0) ? task_root : node_offset[t] + local - 1;
+        };
+
+        nodes[task_root].children = place(sub.nodes[0].children);
+        for (std::size_t i = 1; i < sub.nodes.size(); i++) {
+            Node n = sub.nodes[i];
+            if (n.children != 0) { n.children = place(n.children); }
+            n.next = (n.next == DETACHED) ? outer_next : place(n.next);
+            nodes[place(i)] = n;
+        }
+        for (std::size_t i = 0; i < sub.parents.size(); i++) {
+            parents[parent_offset[t] + i] = place(sub.parents[i]);
+        }
+    }
+}
+
+// how many levels down branches_up() hands subtrees out as separate tasks. 4^5 = 1024 at the bottom,
+// enough to keep every thread busy even when the tree is lopsided
+constexpr int BRANCH_TASK_LEVELS = 5;
+
+// node has to be a branch. leaves are skipped before the call, so they don't cost a task or a call
+template <typename F>
+static void branches_up_from(Quadtree& tree, std::size_t node, int level, const F& fn) {
+    const std::size_t children = tree.nodes[node].children;
+    if (level < BRANCH_TASK_LEVELS) {
+        for (std::size_t c = children; c < children + 4; c++) {
+            if (tree.nodes[c].children == 0) { continue; }
+            #pragma omp task default(none) firstprivate(c, level) shared(tree, fn)
+            branches_up_from(tree, c, level + 1, fn);
+        }
+        #pragma omp taskwait
+    } else {
+        for (std::size_t c = children; c < children + 4; c++) {
+            if (tree.nodes[c].children == 0) { continue; }
+            branches_up_from(tree, c, level + 1, fn);
+        }
+    }
+    fn(node);
+}
+
+/*  Method to run fn on every branch node, children always before their parent
+ *      inputs:         a tree, fn(node index)
+ *      outputs:        none
+ *      side effects:   whatever fn does
+ *
+ *  Subtrees don't share any nodes, so the top BRANCH_TASK_LEVELS levels get split into tasks for the
+ *  threads to grab, and under that each thread walks its subtree depth first on its own. no barriers
+ *  between levels and no list of nodes to build first, and the depth first walk goes through nodes[]
+ *  in about the order build_morton laid them out in
+ */
+template <typename F>
+static void branches_up(Quadtree& tree, const F& fn) {
+    if (tree.nodes.empty() || tree.nodes[0].children == 0) { return; }
+    #pragma omp parallel
+    #pragma omp single
+    branches_up_from(tree, 0, 0, fn);
+}
+
+/*  Method to update last step's tree for the bodies' new positions, instead of building a new one
+ *      inputs:         the bodies the tree was built from (with build_morton), after they've moved
+ *      outputs:        true if the tree was updated, false if it needs a full rebuild instead
+ *      side effects:   body copies, leaf ranges and leaf masses are updated. the nodes don't change
+ *                      call propogate() afterwards like after any build
+ *
+ *  With a small time step most bodies are still in (or near) the same leaf as last step. So:
+ *  1. copy in the new positions, flag every body that's strayed too far from its leaf's quad, and
+ *     walk each of those down from the root to the leaf it's in now
+ *     leaves are loose: a body can sit up to refit_looseness times the quad out before it counts
+ *  2. give up if too many moved, or any left the root box (then the tree is too stale to bother)
+ *  3. sort the movers by where they're going
+ *  4. lay the bodies out again so each leaf's bodies are still next to each other, and redo the
+ *     leaf masses. give up if that piles too many bodies into one leaf
+ *  5. redo the body ranges of the branches, and how far their bodies actually spread. pack() opens
+ *     nodes by that spread when it's bigger than the quad, so loose leaves don't cost accuracy
+ */
+bool Quadtree::refit(const Bodies& bodies) {
+    const std::size_t n = bodies.size();
+    if (nodes.empty() || leaf_body.size() != n || n == 0) { return false; }
+
+    // every leaf, in tree order (which is also the order their bodies are laid out in)
+    std::vector<std::size_t> leaves;
+    for (std::size_t node = 0; ; ) {
+        if (nodes[node].children != 0) {
+            node = nodes[node].children;
+            continue;
+        }
+        leaves.push_back(node);
+        if (nodes[node].next == 0) { break; } else { node = nodes[node].next; }
+    }
+
+    // 1. new positions, who left, and (walking down from the root) which leaf each of them is in now
+    std::vector<uint8_t> leaving(n, 0);
+    std::vector<std::size_t> departures(leaves.size(), 0);
+    std::vector<std::pair<std::size_t, std::size_t>> arrivals; // (leaf node it lands in, old slot)
+    bool escaped = false;
+    #pragma omp parallel reduction(||:escaped)
+    {
+        std::vector<std::pair<std::size_t, std::size_t>> found;
+        #pragma omp for schedule(dynamic, 64)
+        for (std::size_t l = 0; l < leaves.size(); l++) {
+            const Node& leaf = nodes[leaves[l]];
+            for (std::size_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+                const vec2 pos = bodies.pos(leaf_body[i]);
+                leaf_x[i] = pos.x;
+                leaf_y[i] = pos.y;
+                if (leaf.quad.contains(pos, refit_looseness)) { continue; }
+
+                leaving[i] = 1;
+                departures[l] += 1;
+                if (!nodes[0].quad.contains(pos)) {
+                    escaped = true;
+                    continue;
+                }
+                std::size_t node = 0;
+                while (nodes[node].children != 0) {
+                    node = nodes[node].children + nodes[node].quad.find_quadrant(pos);
+                }
+                found.push_back({node, i});
+            }
+        }
+        #pragma omp critical
+        arrivals.insert(arrivals.end(), found.begin(), found.end());
+    }
+
+    // 2. too much has changed, start over
+    if (escaped || arrivals.size() > refit_max_moved * n) { return false; }
+
+    // 3. sorted by destination, so each leaf's arrivals are one run
+    std::sort(arrivals.begin(), arrivals.end());
+
+    // 4. new counts and starting points for every leaf
+    std::vector<std::size_t> new_first(leaves.size());
+    std::vector<std::size_t> arrivals_first(leaves.size());
+    std::vector<std::size_t> arrivals_count(leaves.size());
+    std::size_t offset = 0;
+    for (std::size_t l = 0; l < leaves.size(); l++) {
+        const Node& leaf = nodes[leaves[l]];
+        auto run = std::equal_range(arrivals.begin(), arrivals.end(), std::make_pair(leaves[l], std::size_t(0)),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+        arrivals_first[l] = run.first - arrivals.begin();
+        arrivals_count[l] = run.second - run.first;
+
+        std::size_t count = leaf.count - departures[l] + arrivals_count[l];
+        // a leaf filling up well past its capacity means the tree doesn't fit the bodies any more
+        if (arrivals_count[l] > 0 && count > refit_max_overflow * std::max<std::size_t>(leaf_capacity, 1)) {
+            return false;
+        }
+        new_first[l] = offset;
+        offset += count;
+    }
+
+    TreeArray<double> new_x(n);
+    TreeArray<double> new_y(n);
+    TreeArray<double> new_mass(n);
+    TreeArray<uint32_t> new_body(n);
+    // bounding box of the bodies under each node
+    std::vector<vec2> lo(nodes.size());
+    std::vector<vec2> hi(nodes.size());
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (std::size_t l = 0; l < leaves.size(); l++) {
+        Node& leaf = nodes[leaves[l]];
+        std::size_t out = new_first[l];
+        auto place = [&](std::size_t i) {
+            new_x[out] = leaf_x[i];
+            new_y[out] = leaf_y[i];
+            new_mass[out] = leaf_mass[i];
+            new_body[out] = leaf_body[i];
+            out++;
+        };
+        // the ones that stayed, then the ones that just got here
+        for (std::size_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+            if (!leaving[i]) { place(i); }
+        }
+        for (std::size_t a = arrivals_first[l]; a < arrivals_first[l] + arrivals_count[l]; a++) {
+            place(arrivals[a].second);
+        }
+
+        leaf.first = new_first[l];
+        leaf.count = out - new_first[l];
+        vec2 weighted(0, 0);
+        double mass = 0;
+        vec2 low(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
+        vec2 high(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest());
+        for (std::size_t i = leaf.first; i < out; i++) {
+            weighted = weighted + vec2(new_x[i], new_y[i]) * new_mass[i];
+            mass += new_mass[i];
+            low = vec2(std::min(low.x, new_x[i]), std::min(low.y, new_y[i]));
+            high = vec2(std::max(high.x, new_x[i]), std::max(high.y, new_y[i]));
+        }
+        leaf.mass = mass;
+        leaf.centm = (mass > 0) ? weighted / mass : vec2(0, 0);
+        // a body alone in its leaf has to be exactly at the center of mass, same as morton_leaf(), or the
+        // kernel can't tell it's looking at itself (x*m/m rounds) and it pulls on itself at full strength
+        if (leaf.count == 1) { leaf.centm = vec2(new_x[leaf.first], new_y[leaf.first]); }
+        lo[leaves[l]] = low;
+        hi[leaves[l]] = high;
+        leaf.extent = (leaf.count > 0) ? std::max(high.x - low.x, high.y - low.y) : 0;
+    }
+    leaf_x.swap(new_x);
+    leaf_y.swap(new_y);
+    leaf_mass.swap(new_mass);
+    leaf_body.swap(new_body);
+
+    // 5. branches cover the runs and boxes of their children. same children-first order propogate() uses
+    branches_up(*this, [&](std::size_t b) {
+        Node& branch = nodes[b];
+        branch.count = 0;
+        lo[b] = vec2(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
+        hi[b] = vec2(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest());
+        for (int q = 3; q >= 0; q--) {
+            std::size_t c = branch.children + q;
+            if (nodes[c].count == 0) { continue; }
+            branch.first = nodes[c].first; // going backwards, so the first non-empty child wins
+            branch.count += nodes[c].count;
+            lo[b] = vec2(std::min(lo[b].x, lo[c].x), std::min(lo[b].y, lo[c].y));
+            hi[b] = vec2(std::max(hi[b].x, hi[c].x), std::max(hi[b].y, hi[c].y));
+        }
+        branch.extent = std::max(hi[b].x - lo[b].x, hi[b].y - lo[b].y);
+    });
+    return true;
+}
+
+/*  Method to work out the mass and center of mass of every branch from its children
+ *      inputs:         none
+ *      outputs:        none
+ *      side effects:   mass and centm of every branch node, then trav[] through pack()
+ *
+ *  used to go backwards through a copy of parents[] on one thread. now runs in parallel, see branches_up()
+ */
 void Quadtree::propogate() {
-    for (auto& node : std::vector<std::size_t>(parents.rbegin(), parents.rend())) {
-        // node is a value
+    // second moments of a bucket leaf, straight from its bodies. single bodies have none
+    auto leaf_moments = [this](Node& leaf) {
+        leaf.qxx = leaf.qxy = leaf.qyy = 0;
+        if (leaf.count <= 1) { return; }
+        for (std::size_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+            double dx = leaf_x[i] - leaf.centm.x;
+            double dy = leaf_y[i] - leaf.centm.y;
+            leaf.qxx += leaf_mass[i] * dx * dx;
+            leaf.qxy += leaf_mass[i] * dx * dy;
+            leaf.qyy += leaf_mass[i] * dy * dy;
+        }
+    };
+
+    branches_up(*this, [&](std::size_t node) {
         auto i = nodes[node].children;
 
         nodes[node].centm = nodes[i].centm * nodes[i].mass
@@ -252,19 +790,76 @@ void Quadtree::propogate() {
                            + nodes[i + 2].mass
                            + nodes[i + 3].mass;
 
-        nodes[node].centm = (nodes[node].centm)/(nodes[node].mass);
+        // refit() can leave a branch with nobody in it. no mass, so no center of mass either, and 0/0
+        // would have made this and every node above it NaN. the middle of its quad, like build gives it
+        nodes[node].centm = (nodes[node].mass > 0) ? nodes[node].centm / nodes[node].mass : nodes[node].quad.center;
+
+        if (!quadrupole) { return; }
+        // the children's moments, moved over to this node's center (parallel axis theorem)
+        Node& branch = nodes[node];
+        branch.qxx = branch.qxy = branch.qyy = 0;
+        for (std::size_t c = i; c < i + 4; c++) {
+            Node& child = nodes[c];
+            if (child.mass == 0) { continue; }
+            if (child.children == 0) { leaf_moments(child); }
+            double dx = child.centm.x - branch.centm.x;
+            double dy = child.centm.y - branch.centm.y;
+            branch.qxx += child.qxx + child.mass * dx * dx;
+            branch.qxy += child.qxy + child.mass * dx * dy;
+            branch.qyy += child.qyy + child.mass * dy * dy;
+        }
+    });
+    if (quadrupole && !nodes.empty() && nodes[0].children == 0) { leaf_moments(nodes[0]); }
+    pack();
+}
+
+/*  Method to pack the hot half of every node into trav[], once propogate() has the masses
+ *      inputs:         none
+ *      outputs:        none
+ *      side effects:   trav[] is rebuilt, one entry per node, same indices as nodes[]
+ *
+ *  the opening test gets worked out here once per node instead of once per visit, and the links
+ *  get pointed past empty nodes so accel() never even looks at them
+ */
+void Quadtree::pack() {
+    const double theta_sq = theta*theta;
+    trav.resize(nodes.size());
+
+    // follows next pointers until it lands on a node with something in it (or the end of the tree)
+    auto skip_empty = [&](std::size_t i) {
+        while (i != 0 && nodes[i].is_empty()) { i = nodes[i].next; }
+        return i;
+    };
+
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+        Node& n = nodes[i];
+        TravNode& t = trav[i];
+        t.centm = n.centm;
+        t.mass = n.mass;
+        // plain leaves always count as one body, so they get a distance every body is past
+        // otherwise it's the quad's size, or how far the bodies have spread if refit() let them out of it
+        double size = std::max(n.quad.length, n.extent);
+        t.open_sq = (n.is_leaf() && n.count <= 1) ? -1 : size * size / theta_sq;
+        t.children = static_cast<uint32_t>(n.is_leaf() ? 0 : skip_empty(n.children));
+        t.next = static_cast<uint32_t>(skip_empty(n.next));
+        t.first = static_cast<uint32_t>(n.first);
+        t.count = static_cast<uint32_t>(n.count);
+        t.qxx = quadrupole ? static_cast<float>(n.qxx) : 0.0f;
+        t.qxy = quadrupole ? static_cast<float>(n.qxy) : 0.0f;
+        t.qyy = quadrupole ? static_cast<float>(n.qyy) : 0.0f;
     }
 }
 
-vec2 Quadtree::accel(vec2& body_pos) {
+vec2 Quadtree::accel(const vec2& body_pos, std::size_t* interactions) {
     vec2 accel(0,0);
     std::size_t node = 0; //node index -- starts at 0, i.e. root
-    auto theta_sq = THETA*THETA;
-    auto epsil_sq = EPSILON*EPSILON;
+    std::size_t count = 0; // how many bodies/nodes we end up pulling on this body with
+    auto epsil_sq = epsilon * epsilon;
 
     while (true) {
        //printf("calculating acceleration for node %zu \n", node);
-       Node& n = nodes[node];
+       const TravNode& n = trav[node];
 
        // distance to the center of mass
        vec2 dist(n.centm.x - body_pos.x, n.centm.y - body_pos.y);
@@ -273,26 +868,263 @@ vec2 Quadtree::accel(vec2& body_pos) {
        double dist_sq = dist.mag_sq();
 
        // "treat this as a single body" test (the barnes-hut approximation secret sauce):
-       // leaf OR (size^2 < d^2 * t_sq)  <=> (size/d < theta)
-       if (n.is_leaf() || (n.quad.length * n.quad.length) < dist_sq * theta_sq) {
-           // sqrt(dist_sq) might cause problems?
+       // (size/d < theta) <=> (d^2 > (size/theta)^2), and pack() already worked out the right side
+       // plain leaves always pass it
+       if (n.open_sq < dist_sq) {
+            // sqrt(dist_sq) might cause problems?
             auto denom = (dist_sq + epsil_sq) * sqrt(dist_sq);
             // this actually makes me want to throw up it's so ugly. i hate c++
             // prevents infinite forces
 
             accel = accel + (dist * std::min(G * n.mass/denom, std::numeric_limits<double>::max()));
             //accel = (dist * (G * n.mass / denom));
+            // plain leaves are a single body, nothing to correct
+            if (quadrupole && n.open_sq >= 0) {
+                quadrupole_accel(dist.x, dist.y, n.qxx, n.qxy, n.qyy, G, epsil_sq, &accel.x, &accel.y);
+            }
+            count += 1;
 
-            // if there is no next node -- i.e. if we have reached the end of the tree -- break
-            // otherwise, set the node to the next node and loop
-            if (n.next == 0) { break; } else { node = n.next; }
-            
        // if we can't treat the node as a single body:
        //   move to the first child and loop
+       } else if (n.children != 0) {
+            node = n.children;
+            continue;
+
+       // a bucket leaf that's too close to lump together: add up its bodies one by one instead
+       // they're stored next to each other so the SIMD kernel can chew through them
        } else {
-           node = n.children;
+            kernel(&leaf_x[n.first], &leaf_y[n.first], &leaf_mass[n.first], n.count,
+                   body_pos.x, body_pos.y, G, epsil_sq, &accel.x, &accel.y);
+            count += n.count;
        }
+
+       // if there is no next node -- i.e. if we have reached the end of the tree -- break
+       // otherwise, set the node to the next node and loop
+       if (n.next == 0) { break; } else { node = n.next; }
     }
+
+    if (interactions != nullptr) { *interactions += count; }
     return accel;
 }
 
+/*  Costs for the cost zones (see zones.h): how many interactions each body's walk took goes in cost[],
+ *  by body index so it keeps from step to step whatever the tree does. Until a body has had a walk it
+ *  counts as 1, and bodies that aren't due one count as 0
+ */
+static void fit_costs(std::vector<float>& cost, std::size_t n) {
+    if (cost.size() != n) { cost.assign(n, 1.0f); }
+}
+
+/*  Method to work out accelerations a group of bodies at a time, instead of one walk per body
+ *      inputs:         the bodies the tree was built from (with build_morton), the most bodies per group
+ *      outputs:        none
+ *      side effects:   sets accel on every body
+ *
+ *  A group is the biggest subtree with group_size bodies or less under it. Bodies in a group sit close
+ *  together, so they'd all open nearly the same nodes anyway. Instead we walk the tree once per group,
+ *  testing each node against the nearest point of the group's bounding box. If a node passes that, it
+ *  passes for every body in the box, so it goes on the list as one body. Anything that doesn't pass
+ *  gets opened, and near buckets go on the list body by body. Then every member just runs down the list.
+ *  The list is never less accurate than each body's own walk, just sometimes a bit longer.
+ */
+void Quadtree::accel_grouped(Bodies& bodies, std::size_t group_size) {
+    walk_groups(bodies, group_size, nullptr);
+}
+
+/*  Method to work out accelerations for only some of the bodies, the rest are left alone
+ *      inputs:         the bodies the tree was built from, which of them need an acceleration (by body index),
+ *                      the most bodies per group (0 = one walk per body)
+ *      outputs:        none
+ *      side effects:   sets accel on the active bodies
+ *
+ *  for block timesteps, where most substeps only a few bodies are due a kick. the tree still has every
+ *  body in it, it's just that groups with nobody active don't get walked at all
+ */
+void Quadtree::accel_active(Bodies& bodies, const std::vector<uint8_t>& active, std::size_t group_size) {
+    if (group_size > 0 && !leaf_body.empty()) {
+        walk_groups(bodies, group_size, active.data());
+    } else {
+        walk_bodies(bodies, active.data());
+    }
+}
+
+/*  Method to work out accelerations one walk per body, split between threads in cost zones
+ *      inputs:         the bodies the tree was built from, which of them need an acceleration (nullptr = all)
+ *      outputs:        none
+ *      side effects:   sets accel on the bodies that needed one, and their cost
+ *
+ *  the bodies go in leaf order when build_morton or refit made the tree, so each zone is one stretch of
+ *  space. a tree made by insert() has no leaf order, so then it's just the order of the bodies
+ */
+void Quadtree::walk_bodies(Bodies& bodies, const uint8_t* active) {
+    const std::size_t n = bodies.size();
+    const bool sorted = (leaf_body.size() == n);
+    fit_costs(cost, n);
+    zone_cost.resize(n);
+    #pragma omp parallel for schedule(static)
+    for (std::size_t k = 0; k < n; k++) {
+        const std::size_t i = sorted ? leaf_body[k] : k;
+        zone_cost[k] = (active == nullptr || active[i]) ? cost[i] : 0.0f;
+    }
+    zones.split(zone_cost.data(), n, omp_get_max_threads());
+
+    std::size_t pulled = 0;
+    #pragma omp parallel reduction(+:pulled)
+    for (CostZones::Taker take = zones.taker(64); take.next(); ) {
+        for (std::size_t k = take.begin; k < take.end; k++) {
+            const std::size_t i = sorted ? leaf_body[k] : k;
+            if (active != nullptr && !active[i]) { continue; }
+            std::size_t count = 0;
+            bodies.set_accel(i, accel(bodies.pos(i), &count));
+            cost[i] = static_cast<float>(count);
+            pulled += count;
+        }
+    }
+    interactions += pulled;
+}
+
+// accel_grouped() and accel_active(), active = nullptr when every body wants an acceleration
+// the groups are in Morton order, and get split between threads by what their members cost last time
+void Quadtree::walk_groups(Bodies& bodies, std::size_t group_size, const uint8_t* active) {
+    // 1. find the groups, walking the tree top down and stopping at the first small enough node
+    std::vector<std::size_t> groups;
+    std::size_t node = 0;
+    while (true) {
+        const TravNode& n = trav[node];
+        if (n.count <= group_size || n.children == 0) {
+            groups.push_back(node);
+        } else {
+            node = n.children;
+            continue;
+        }
+        if (n.next == 0) { break; } else { node = n.next; }
+    }
+
+    auto epsil_sq = epsilon * epsilon;
+
+    // 2. one interaction list per group, split into cost zones
+    fit_costs(cost, bodies.size());
+    zone_cost.resize(groups.size());
+    #pragma omp parallel for schedule(static)
+    for (std::size_t g = 0; g < groups.size(); g++) {
+        const TravNode& group = trav[groups[g]];
+        float total = 0;
+        for (std::size_t i = group.first; i < group.first + group.count; i++) {
+            if (active == nullptr || active[leaf_body[i]]) { total += cost[leaf_body[i]]; }
+        }
+        zone_cost[g] = total;
+    }
+    zones.split(zone_cost.data(), groups.size(), omp_get_max_threads());
+
+    std::size_t pulled = 0;
+    #pragma omp parallel reduction(+:pulled)
+    {
+        // reused from group to group so we're not allocating all the time
+        // x, y and mass get their own arrays, that's what the SIMD kernel wants
+        std::vector<double> list_x;
+        std::vector<double> list_y;
+        std::vector<double> list_mass;
+        // and the nodes on it that also need the quadrupole correction
+        std::vector<double> quad_x;
+        std::vector<double> quad_y;
+        std::vector<double> quad_xx;
+        std::vector<double> quad_xy;
+        std::vector<double> quad_yy;
+        auto add_to_list = [&](vec2 pos, double mass) {
+            list_x.push_back(pos.x);
+            list_y.push_back(pos.y);
+            list_mass.push_back(mass);
+        };
+
+        for (CostZones::Taker take = zones.taker(1); take.next(); ) {
+            const TravNode& group = trav[groups[take.begin]];
+            const std::size_t begin = group.first;
+            const std::size_t end = group.first + group.count;
+
+            // bounding box of the bodies actually in the group (tighter than its quad)
+            // only the ones that want an acceleration count, and if that's nobody there's no walk
+            vec2 lo(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
+            vec2 hi(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest());
+            bool anyone = false;
+            for (std::size_t i = begin; i < end; i++) {
+                if (active != nullptr && !active[leaf_body[i]]) { continue; }
+                lo = vec2(std::min(lo.x, leaf_x[i]), std::min(lo.y, leaf_y[i]));
+                hi = vec2(std::max(hi.x, leaf_x[i]), std::max(hi.y, leaf_y[i]));
+                anyone = true;
+            }
+            if (!anyone) { continue; }
+            const vec2 center = (lo + hi) * 0.5;
+            const vec2 half((hi.x - lo.x) * 0.5, (hi.y - lo.y) * 0.5);
+
+            list_x.clear();
+            list_y.clear();
+            list_mass.clear();
+            quad_x.clear();
+            quad_y.clear();
+            quad_xx.clear();
+            quad_xy.clear();
+            quad_yy.clear();
+            std::size_t walk = 0;
+            while (true) {
+                const TravNode& n = trav[walk];
+
+                // distance from the center of mass to the closest point of the box
+                double dx = std::max(0.0, std::abs(n.centm.x - center.x) - half.x);
+                double dy = std::max(0.0, std::abs(n.centm.y - center.y) - half.y);
+
+                // same test as accel(), but against the closest any group member could be
+                if (n.open_sq < dx * dx + dy * dy) {
+                    add_to_list(n.centm, n.mass);
+                    if (quadrupole && n.open_sq >= 0) {
+                        quad_x.push_back(n.centm.x);
+                        quad_y.push_back(n.centm.y);
+                        quad_xx.push_back(n.qxx);
+                        quad_xy.push_back(n.qxy);
+                        quad_yy.push_back(n.qyy);
+                    }
+                } else if (n.children != 0) {
+                    walk = n.children;
+                    continue;
+                } else {
+                    list_x.insert(list_x.end(), &leaf_x[n.first], &leaf_x[n.first] + n.count);
+                    list_y.insert(list_y.end(), &leaf_y[n.first], &leaf_y[n.first] + n.count);
+                    list_mass.insert(list_mass.end(), &leaf_mass[n.first], &leaf_mass[n.first] + n.count);
+                }
+                if (n.next == 0) { break; } else { walk = n.next; }
+            }
+
+            // 3. every member of the group runs down the same list
+            //    (the body itself is on the list when its own bucket got opened, the kernel skips it)
+            for (std::size_t i = begin; i < end; i++) {
+                if (active != nullptr && !active[leaf_body[i]]) { continue; }
+                vec2 accel(0, 0);
+                kernel(list_x.data(), list_y.data(), list_mass.data(), list_mass.size(),
+                       leaf_x[i], leaf_y[i], G, epsil_sq, &accel.x, &accel.y);
+                quad_kernel(quad_x.data(), quad_y.data(), quad_xx.data(), quad_xy.data(), quad_yy.data(),
+                            quad_x.size(), leaf_x[i], leaf_y[i], G, epsil_sq, &accel.x, &accel.y);
+                bodies.set_accel(leaf_body[i], accel);
+                cost[leaf_body[i]] = static_cast<float>(list_mass.size() + quad_x.size());
+                pulled += list_mass.size() + quad_x.size();
+            }
+        }
+    }
+    interactions += pulled;
+}
+
+/*  Method to find how many levels deep the tree goes (the root alone is depth 1)
+ *  parents[] is in the order nodes were split, so a parent always shows up before its children
+ *  and one pass is enough
+ */
+std::size_t Quadtree::depth() const {
+    std::vector<std::size_t> level(nodes.size(), 1);
+    std::size_t deepest = nodes.empty() ? 0 : 1;
+    for (std::size_t parent : parents) {
+        std::size_t i = nodes[parent].children;
+        for (int q = 0; q < 4; q++) {
+            level[i + q] = level[parent] + 1;
+        }
+        deepest = std::max(deepest, level[parent] + 1);
+    }
+    return deepest;
+}
+
@@ -8,8 +8,13 @@
 #include <cstdint>
 #include <limits>
 #include "Constants.h"
+#include "kernels.h"
+#include "zones.h"
 #include <algorithm>
 #include <valarray>
+#include <new>
+#include <memory>
+#include <cstring>
 
 #ifndef GPU_NBODY_QUADTREE_H
 #define GPU_NBODY_QUADTREE_H
@@ -79,13 +84,107 @@ struct Body {
     void update(double delta_t);
 };
 
+// Touches a new block a page at a time, split between the threads like a static loop over it would be (see quadtree.cpp)
+void first_touch(void* memory, std::size_t bytes);
+
+/*  Hands out memory lined up on 64 bytes (a cache line, and an AVX-512 register), for the Bodies arrays
+ *  (and the tree's) so the SIMD loops never straddle a line at the start of an array
+ *  Big blocks get first_touch()ed, so on a NUMA machine each thread's part of them is in its own node's memory
+ */
+template <typename T>
+struct AlignedAllocator {
+    using value_type = T;
+    static constexpr std::size_t alignment = 64;
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+    T* allocate(std::size_t n) {
+        T* memory = static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment)));
+        first_touch(memory, n * sizeof(T));
+        return memory;
+    }
+    void deallocate(T* p, std::size_t) {
+        ::operator delete(p, std::align_val_t(alignment));
+    }
+    template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+/*  One field of Bodies, as one array of doubles. Works like a vector (data, size, resize, [])
+ *  Usually it owns its memory, lined up with AlignedAllocator. It can also be pointed at memory that
+ *  something else owns (view()), like a column of a memory mapped snapshot, so loading one doesn't
+ *  copy anything. owner keeps that memory alive for as long as any column points into it
+ *  Copying a column always gives an owned copy
+ */
+class Column {
+public:
+    Column() = default;
+    Column(const Column& other) { *this = other; }
+    Column(Column&& other) noexcept { swap(other); }
+    Column& operator=(const Column& other);
+    Column& operator=(Column&& other) noexcept { swap(other); return *this; }
+    ~Column() { release(); }
+
+    double* data() { return values; }
+    const double* data() const { return values; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    double& operator[](std::size_t i) { return values[i]; }
+    const double& operator[](std::size_t i) const { return values[i]; }
+    double* begin() { return values; }
+    double* end() { return values + count; }
+    const double* begin() const { return values; }
+    const double* end() const { return values + count; }
+
+    void resize(std::size_t n, double value = 0.0);
+    void view(double* memory, std::size_t n, std::shared_ptr<void> memory_owner);
+    bool is_view() const { return owner != nullptr; }
+
+private:
+    double* values = nullptr;
+    std::size_t count = 0;
+    std::size_t capacity = 0;    // how much of values is ours, 0 for a view
+    std::shared_ptr<void> owner; // whatever keeps a view's memory around
+    void release();
+    void swap(Column& other) noexcept;
+};
+
+/*  All the bodies in the simulation, stored a field at a time (structure of arrays) instead of a Body at
+ *  a time. The integrator only touches position, velocity and acceleration, and the tree only reads
+ *  position and mass, so each loop streams just the arrays it needs, and they vectorize cleanly.
+ *  bodies[i] still hands back a Body for code that wants one at a time. It's a copy, not a view, so it's
+ *  const: bodies[i].pos.x = ... would only change the copy, and this way it doesn't compile. set() writes one
+ */
+struct Bodies {
+    Column x, y;    // position
+    Column vx, vy;  // velocity
+    Column ax, ay;  // acceleration
+    Column mass;
+
+    Bodies() = default;
+    explicit Bodies(const std::vector<Body>& bodies);
+
+    std::size_t size() const { return x.size(); }
+    bool empty() const { return x.empty(); }
+    void resize(std::size_t n);
+
+    vec2 pos(std::size_t i) const { return vec2(x[i], y[i]); }
+    const Body operator[](std::size_t i) const { return Body(mass[i], vec2(x[i], y[i]), vec2(vx[i], vy[i]), vec2(ax[i], ay[i])); }
+    void set(std::size_t i, const Body& body);
+    void set_accel(std::size_t i, vec2 accel) { ax[i] = accel.x; ay[i] = accel.y; }
+    std::vector<Body> to_vector() const;
+
+    void update(double delta_t);
+    void drift(double delta_t);
+};
+
 // struct that defines the bounding box of the node
 struct Quad {
     //Quad() = default;
     vec2 center;    // the point at the center of the box
     double length;  // the side length of the box.
-    void new_containing(const std::vector<Body>& bodies);
+    void new_containing(const Bodies& bodies);
     int find_quadrant(vec2 pos);
+    bool contains(vec2 pos, double scale = 1) const;
     Quad into_quadrant(int quadrant) const;
     std::array<Quad, 4> subdivide_quad() const;
 };
@@ -96,29 +195,83 @@ struct Node {
     Node (Quad quad, std::size_t next): quad(quad), next(next) {}
     std::size_t children = 0; // stores the index of the first child in the ygg list
     std::size_t next = 0; // stores the index of the next full size node after the kiddos
-    vec2 centm; // for "center of mass"
-    double mass; // for total mass of all bodies in the node
+    vec2 centm = vec2(0, 0); // for "center of mass"
+    double mass = 0; // for total mass of all bodies in the node
     Quad quad; //stores the data that defines the bounding box
+    std::size_t first = 0; // index of the node's first body in leaf_x/leaf_y/leaf_mass (build_morton only)
+    std::size_t count = 0; // and how many bodies are under it. 0 for empty nodes and anything insert() made
+    double extent = 0; // side of the box its bodies actually fill, if refit() let them drift out of the quad
+    double qxx = 0, qxy = 0, qyy = 0; // second moments of its mass around centm, sum of m*dx*dx etc (QUADRUPOLE only)
     bool has_children();
     bool is_empty();
     bool is_leaf();
 };
 
+/*  The part of a node that accel() actually reads, packed into one cache line
+ *  pack() builds these from nodes[] after every propogate(), at the same indices. nodes[] keeps the
+ *  rest (the quad, the size_t links) for building the tree
+ */
+struct alignas(64) TravNode {
+    vec2 centm;         // center of mass
+    double mass;        // total mass
+    double open_sq;     // (side length / theta)^2 -- past this distance squared the node counts as one body
+    uint32_t children;  // first non-empty child, 0 for leaves
+    uint32_t next;      // next non-empty node after this one and its kiddos, 0 at the end of the tree
+    uint32_t first;     // where the node's bodies start in leaf_x/leaf_y/leaf_mass
+    uint32_t count;     // and how many there are
+    float qxx, qxy, qyy; // the node's second moments. they only go into a small correction, so floats are plenty
+};
+static_assert(sizeof(TravNode) == 64, "TravNode should fill exactly one cache line");
+
+// the tree's arrays, lined up and first touched like the bodies' columns
+template <typename T>
+using TreeArray = std::vector<T, AlignedAllocator<T>>;
+
 // Fundamental structure of the program
 // really it's just a list of nodes
 struct Quadtree {
     /*
         nodes[i]   = the actual quadtree node
         parents[i] = index of parent of nodes[i], in nodes[]
+        trav[i]    = the packed copy of nodes[i] that accel() walks
+        leaf_x/leaf_y/leaf_mass = copies of the bodies, in leaf order, so each bucket leaf's bodies sit
+                             next to each other (only filled in by build_morton)
+        leaf_body[i] = which body in the original list leaf slot i came from
      */
-    std::vector<Node> nodes;
+    TreeArray<Node> nodes;
     std::vector<std::size_t> parents;
+    TreeArray<TravNode> trav;
+    TreeArray<double> leaf_x;
+    TreeArray<double> leaf_y;
+    TreeArray<double> leaf_mass;
+    TreeArray<uint32_t> leaf_body;
+    std::size_t leaf_capacity = LEAF_CAPACITY; // most bodies build_morton will put in one leaf
+    double theta = THETA;                      // opening angle, goes into open_sq in pack()
+    double epsilon = EPSILON;                  // softening length
+    double refit_looseness = REFIT_LOOSENESS;       // see refit()
+    double refit_max_moved = REFIT_MAX_MOVED;
+    double refit_max_overflow = REFIT_MAX_OVERFLOW;
+    bool quadrupole = QUADRUPOLE;              // whether nodes taken as one body also get the quadrupole correction
+    std::size_t interactions = 0;              // bodies and nodes the walks have pulled on bodies with, added up
+    std::vector<float> cost;                   // per body (by index), what its last walk pulled on it with. the cost zones go by it
+    std::vector<float> zone_cost;              // and each group's (or body's) in the order they're handed out
+    CostZones zones;                           // how the walks get split between threads (see zones.h)
+    ListKernel kernel = force_kernel().run; // adds up lists of bodies, SIMD if the CPU has it (see kernels.h)
+    QuadKernel quad_kernel = force_kernel().quad; // and the quadrupole corrections of lists of nodes
     // Methods:
     void insert(vec2 pos, double mass);
     void reset(Quad root);
     std::size_t subdivide(std::size_t node);
+    void build_morton(const Bodies& bodies, Quad root);
+    bool refit(const Bodies& bodies);
     void propogate();
-    vec2 accel(vec2& body_pos);
+    void pack();
+    vec2 accel(const vec2& body_pos, std::size_t* interactions = nullptr);
+    void accel_grouped(Bodies& bodies, std::size_t group_size);
+    void accel_active(Bodies& bodies, const std::vector<uint8_t>& active, std::size_t group_size);
+    void walk_groups(Bodies& bodies, std::size_t group_size, const uint8_t* active);
+    void walk_bodies(Bodies& bodies, const uint8_t* active);
+    std::size_t depth() const;
 };
 
 
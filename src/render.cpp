@@ -1,17 +1,19 @@
 #include <iostream>
+#include <cmath>
+#include <algorithm>
 #include <cstring>
-#include <fstream>
+#include <omp.h>
 #include "simulation.h"
 #include "Constants.h"
 #include "render.h"
 
 
 
-void render_frame(Simulation sim) {
+void render_frame(const Simulation& sim) {
     /*  Simulation variables
         double delta_t;              // Time step
         std::size_t frame;           // Frame counter
-        std::vector<Body> bodies;    // All bodies in the simulation
+        Bodies bodies;               // All bodies in the simulation
         Quadtree ygg;                // The Barnes–Hut quadtree ("Yggdrasil")
      */
 
@@ -23,22 +25,23 @@ void render_frame(Simulation sim) {
      */
 
 }
-void renderClear(char* image, double* hdImage)
+void renderClear(double* hdImage, const Config& config)
 {
-    memset(image, 0, WIDTH*HEIGHT*3);
-    memset(hdImage, 0, WIDTH*HEIGHT*3*sizeof(double));
+    // only the doubles, tonemap() writes over every byte of the 8 bit image anyway
+    const std::size_t pixels = static_cast<std::size_t>(config.width) * config.height;
+    memset(hdImage, 0, pixels*3*sizeof(double));
 }
 
-double toPixelSpace(double p, int size)
+double toPixelSpace(double p, int size, const Config& config)
 {
     //const double SYSTEM_SIZE = 3.5;    // Max distance from center in your length units
     //const double RENDER_SCALE = 2.5;   // Extra zoom/padding
 
-    // Map from [-SYSTEM_SIZE*RENDER_SCALE, +SYSTEM_SIZE*RENDER_SCALE] to [0, size]
+    // Map from [-system_size*render_scale, +system_size*render_scale] to [0, size]
     // p=0 (center) -> size/2 (middle pixel)
     // p=-8.75 -> 0
     // p=+8.75 -> size
-    return (size/2.0) * (1.0 + p/(SYSTEM_SIZE*RENDER_SCALE));
+    return (size/2.0) * (1.0 + p/(config.system_size*config.render_scale));
 }
 
 double magnitude(const vec2& v)
@@ -51,118 +54,591 @@ double clamp(double x)
     return fmax(fmin(x,1.0),0.0);
 }
 
-void colorAt(int x, int y, const struct color& c, double f, double* hdImage)
+void colorAt(int x, int y, const struct color& c, double f, double* hdImage, int width)
 {
-    int pix = 3*(x+WIDTH*y);
+    int pix = 3*(x+width*y);
     hdImage[pix+0] += c.r*f; // Add red contribution
     hdImage[pix+1] += c.g*f; // Add grn contribution
     hdImage[pix+2] += c.b*f; // Add blu contribution
 }
 
-void colorDot(double x, double y, double vMag, double* hdImage)
+/*  The dot itself. DotSize is the dot size when it's known at compile time, so the loops have fixed
+ *  bounds the compiler can unroll. 0 means it isn't, and dot_size gets used instead
+ *  colorDot picks which one to call from config.dot_size, the usual sizes each get their own copy
+ */
+template <int DotSize>
+static void colorDotSized(double x, double y, const color& c, double* hdImage, const Config& config, int dot_size)
 {
-    // These are weird and arbitrary. They were chosen with much more care in the Peter Whidden implementation.
-    constexpr double velocityMax = 4; // MAX_VEL_COLOR
-    constexpr double velocityMin = .1; // MIN_VEL_COLOR
-
-    if (vMag < velocityMin)
-        return;
-    const double vPortion = sqrt((vMag-velocityMin) / velocityMax);
-    color c;
-    c.r = clamp(4*(vPortion-0.333));
-    c.g = clamp(fmin(4*vPortion,4.0*(1.0-vPortion)));
-    c.b = clamp(4*(0.5-vPortion));
+    const int size = (DotSize > 0) ? DotSize : dot_size;
+    const int span = 2 * (size/2); // pixels across, an odd size loses one
+    const int width = config.width;
+    const int height = config.height;
 
     // Compute pixel position once
-    const double xPixel = toPixelSpace(x, WIDTH);
-    const double yPixel = toPixelSpace(y, HEIGHT);
+    const double xPixel = toPixelSpace(x, width, config);
+    const double yPixel = toPixelSpace(y, height, config);
     const int xP = static_cast<int>(floor(xPixel));
     const int yP = static_cast<int>(floor(yPixel));
 
     // Precompute constants
-    constexpr double sharpnessSq = PARTICLE_SHARPNESS * PARTICLE_SHARPNESS;
+    const double sharpnessSq = config.particle_sharpness * config.particle_sharpness;
+    const double brightness = config.particle_brightness;
     constexpr double exponent = 0.75;
 
     // Calculate bounds with safety checks
-    const int xMin = xP - DOT_SIZE/2;
-    const int xMax = xP + DOT_SIZE/2;
-    const int yMin = yP - DOT_SIZE/2;
-    const int yMax = yP + DOT_SIZE/2;
+    const int xMin = xP - size/2;
+    const int yMin = yP - size/2;
 
-    for (int i = xMin; i < xMax; i++)
+    for (int di = 0; di < span; di++)
     {
         // Bounds check and precompute x component
-        if (i < 0 || i >= WIDTH) continue;
+        const int i = xMin + di;
+        if (i < 0 || i >= width) continue;
 
         const double dx = i - xPixel;
         const double expX = exp(sharpnessSq * dx * dx);
 
-        for (int j = yMin; j < yMax; j++)
+        for (int dj = 0; dj < span; dj++)
         {
             // Bounds check
-            if (j < 0 || j >= HEIGHT) continue;
+            const int j = yMin + dj;
+            if (j < 0 || j >= height) continue;
 
             const double dy = j - yPixel;
             const double expY = exp(sharpnessSq * dy * dy);
 
-            const double cFactor = PARTICLE_BRIGHTNESS /
+            const double cFactor = brightness /
                                    (pow(expX + expY, exponent) + 1.0);
 
-            colorAt(i, j, c, cFactor, hdImage);
+            colorAt(i, j, c, cFactor, hdImage, width);
         }
     }
+}
+
+// The color of a dot from how fast its body's going. false for ones too slow to draw at all
+static bool dotColor(double vMag, color& c)
+{
+    // These are weird and arbitrary. They were chosen with much more care in the Peter Whidden implementation.
+    constexpr double velocityMax = 4; // MAX_VEL_COLOR
+    constexpr double velocityMin = .1; // MIN_VEL_COLOR
 
+    if (vMag < velocityMin)
+        return false;
+    const double vPortion = sqrt((vMag-velocityMin) / velocityMax);
+    c.r = clamp(4*(vPortion-0.333));
+    c.g = clamp(fmin(4*vPortion,4.0*(1.0-vPortion)));
+    c.b = clamp(4*(0.5-vPortion));
+    return true;
 }
 
-void renderBodies(std::vector<Body> bodies, double* hdImage)
+void colorDot(double x, double y, double vMag, double* hdImage, const Config& config)
 {
-    int rendered = 0;
-    // could cause slight issues, probably worth it though
-    #pragma omp parallel for
-    for (const Body& body : bodies) {
-        double x = toPixelSpace(body.pos.x, WIDTH);
-        double y = toPixelSpace(body.pos.y, HEIGHT);
+    color c;
+    if (!dotColor(vMag, c))
+        return;
 
-        // dot size is just "8" and apparently defines the "range of pixels to render" (???)
-        if (x>DOT_SIZE && x<WIDTH-DOT_SIZE &&
-            y>DOT_SIZE && y<HEIGHT-DOT_SIZE)
-        {
-            rendered++;
-            double vMag = magnitude(body.vel);
-            colorDot(body.pos.x, body.pos.y, vMag, hdImage);
+    switch (config.dot_size) {
+        case 8:  colorDotSized<8>(x, y, c, hdImage, config, 8); break;
+        case 16: colorDotSized<16>(x, y, c, hdImage, config, 16); break;
+        case 32: colorDotSized<32>(x, y, c, hdImage, config, 32); break;
+        default: colorDotSized<0>(x, y, c, hdImage, config, config.dot_size); break;
+    }
+}
+
+/*  Builds the stamps: the same brightness colorDotSized works out for every pixel, with the dot's
+ *  center qx/subpixels and qy/subpixels of the way across its pixel, 0 to 1 both included
+ */
+DotStamps::DotStamps(const Config& config) : size(config.dot_size), span(2 * (config.dot_size/2))
+{
+    const double sharpnessSq = config.particle_sharpness * config.particle_sharpness;
+    const double brightness = config.particle_brightness;
+    constexpr double exponent = 0.75;
+    values.resize(static_cast<std::size_t>(subpixels + 1) * (subpixels + 1) * span * span);
+    for (int qy = 0; qy <= subpixels; qy++) {
+        for (int qx = 0; qx <= subpixels; qx++) {
+            double* out = &values[(static_cast<std::size_t>(qy) * (subpixels + 1) + qx) * span * span];
+            for (int dj = 0; dj < span; dj++) {
+                const double dy = dj - size/2 - static_cast<double>(qy) / subpixels;
+                const double expY = exp(sharpnessSq * dy * dy);
+                for (int di = 0; di < span; di++) {
+                    const double dx = di - size/2 - static_cast<double>(qx) / subpixels;
+                    const double expX = exp(sharpnessSq * dx * dx);
+                    out[dj * span + di] = brightness / (pow(expX + expY, exponent) + 1.0);
+                }
+            }
         }
     }
-    //std::cout << "Rendered " << rendered << " out of " << bodies.size() << " bodies\n";
 }
 
-void writeRender(char* data, double* hdImage, int step)
+/*  colorDot, off the stamps: blends the four stamps around where the dot lands in its pixel
+ *  (bilinearly, so it's off by the square of a subpixel, not a subpixel), and adds that on a row at a
+ *  time. rows of the image are what's next to each other in memory, so the inner loop runs along one.
+ *  The dot goes into out, a piece of the image out_width pixels wide starting at (out_x, out_y), and
+ *  only the part of it inside the clip box [x0, x1) x [y0, y1) gets drawn
+ */
+static void splatDot(double xPixel, double yPixel, const color& c, const DotStamps& stamps, double* out,
+                     int out_x, int out_y, int out_width, int x0, int y0, int x1, int y1)
 {
+    const int subpixels = stamps.subpixels;
+    const int span = stamps.span;
+    if (span == 0)
+        return;
 
-    for (int i=0; i<WIDTH*HEIGHT*3; i++)
+    const int xP = static_cast<int>(floor(xPixel));
+    const int yP = static_cast<int>(floor(yPixel));
+    // the stamps either side each way, and how far between them it is
+    const double sx = (xPixel - xP) * subpixels;
+    const double sy = (yPixel - yP) * subpixels;
+    const int qx = std::min(static_cast<int>(sx), subpixels - 1);
+    const int qy = std::min(static_cast<int>(sy), subpixels - 1);
+    const double wx = sx - qx;
+    const double wy = sy - qy;
+    const double* s00 = stamps.stamp(qx, qy);
+    const double* s10 = stamps.stamp(qx + 1, qy);
+    const double* s01 = stamps.stamp(qx, qy + 1);
+    const double* s11 = stamps.stamp(qx + 1, qy + 1);
+    const double w00 = (1 - wx) * (1 - wy);
+    const double w10 = wx * (1 - wy);
+    const double w01 = (1 - wx) * wy;
+    const double w11 = wx * wy;
+
+    // the part of the dot that's in the clip box
+    const int xMin = xP - stamps.size/2;
+    const int yMin = yP - stamps.size/2;
+    const int diFrom = std::max(0, x0 - xMin);
+    const int diTo = std::min(span, x1 - xMin);
+    const int djFrom = std::max(0, y0 - yMin);
+    const int djTo = std::min(span, y1 - yMin);
+    if (diFrom >= diTo || djFrom >= djTo)
+        return;
+
+    // blended into one dot first, that loop's straight through memory and vectorizes
+    thread_local std::vector<double> dot;
+    dot.resize(static_cast<std::size_t>(span) * span);
+    for (int k = 0; k < span * span; k++)
     {
-        data[i] = int(255.0*clamp(hdImage[i]));
+        dot[k] = w00 * s00[k] + w10 * s10[k] + w01 * s01[k] + w11 * s11[k];
     }
 
-    int frame = step;
-    char name[128];
-    sprintf(name, "images/Step%05i.ppm", frame);
-    std::ofstream file (name, std::ofstream::binary);
+    for (int dj = djFrom; dj < djTo; dj++)
+    {
+        const double* row = dot.data() + dj * span;
+        double* pixels = out + 3 * (static_cast<std::size_t>(yMin + dj - out_y) * out_width + (xMin - out_x));
+        for (int di = diFrom; di < diTo; di++)
+        {
+            const double f = row[di];
+            pixels[3*di+0] += c.r*f;
+            pixels[3*di+1] += c.g*f;
+            pixels[3*di+2] += c.b*f;
+        }
+    }
+}
+
+// One dot straight onto the whole image, from the stamps. the same as colorDot, give or take the blending
+void stampDot(double x, double y, double vMag, double* hdImage, const Config& config, const DotStamps& stamps)
+{
+    color c;
+    if (!dotColor(vMag, c))
+        return;
+    splatDot(toPixelSpace(x, config.width, config), toPixelSpace(y, config.height, config), c, stamps,
+             hdImage, 0, 0, config.width, 0, 0, config.width, config.height);
+}
+
+Rasterizer::Rasterizer(const Config& config) : stamps(config), tile(std::max(config.render_tile, 1)) {}
+
+/*  Method to draw a frame's dots onto the image
+ *      inputs:         every body's position and speed, the image, the config
+ *      outputs:        none
+ *      side effects:   adds the dots onto hdImage, sets drawn
+ *
+ *  bodies too close to the edge of the image (within a dot size) or too slow to have a color don't get
+ *  drawn, same as always. Sorting into tiles is a counting sort over chunks of bodies, one chunk per
+ *  thread: count how many of each chunk go in each tile, add those up into where each chunk's bodies
+ *  start in each tile, then put them there. chunks go in body order, so tiles come out in body order
+ */
+void Rasterizer::draw(const double* x, const double* y, const double* speed, std::size_t n, double* hdImage,
+                      const Config& config, const double* weight)
+{
+    const int width = config.width;
+    const int height = config.height;
+    const int dot_size = config.dot_size;
+    const int tiles_x = (width + tile - 1) / tile;
+    const int tiles_y = (height + tile - 1) / tile;
+    const std::size_t tiles = static_cast<std::size_t>(tiles_x) * tiles_y;
+    const std::size_t chunks = static_cast<std::size_t>(omp_get_max_threads());
+
+    // the tiles body i's dot covers, false if it isn't drawn
+    auto covers = [&](std::size_t i, int& tx0, int& ty0, int& tx1, int& ty1) {
+        const double xPixel = toPixelSpace(x[i], width, config);
+        const double yPixel = toPixelSpace(y[i], height, config);
+        color c;
+        if (!(xPixel>dot_size && xPixel<width-dot_size && yPixel>dot_size && yPixel<height-dot_size) ||
+            !dotColor(speed[i], c) || stamps.span == 0) {
+            return false;
+        }
+        const int xMin = static_cast<int>(floor(xPixel)) - stamps.size/2;
+        const int yMin = static_cast<int>(floor(yPixel)) - stamps.size/2;
+        tx0 = std::max(xMin, 0) / tile;
+        ty0 = std::max(yMin, 0) / tile;
+        tx1 = std::min(xMin + stamps.span - 1, width - 1) / tile;
+        ty1 = std::min(yMin + stamps.span - 1, height - 1) / tile;
+        return true;
+    };
+    auto chunk_begin = [&](std::size_t chunk) { return n * chunk / chunks; };
+
+    // 1. how many of each chunk's bodies go in each tile
+    chunk_tiles.assign(chunks * tiles, 0);
+    std::size_t visible = 0;
+    #pragma omp parallel for schedule(static, 1) reduction(+:visible)
+    for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+        std::size_t* count = &chunk_tiles[chunk * tiles];
+        for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+            int tx0, ty0, tx1, ty1;
+            if (!covers(i, tx0, ty0, tx1, ty1)) { continue; }
+            visible++;
+            for (int ty = ty0; ty <= ty1; ty++) {
+                for (int tx = tx0; tx <= tx1; tx++) { count[static_cast<std::size_t>(ty) * tiles_x + tx]++; }
+            }
+        }
+    }
+    drawn = visible;
+
+    // 2. where each tile starts, and within it where each chunk starts
+    tile_first.resize(tiles + 1);
+    std::size_t total = 0;
+    for (std::size_t t = 0; t < tiles; t++) {
+        tile_first[t] = total;
+        for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+            std::size_t count = chunk_tiles[chunk * tiles + t];
+            chunk_tiles[chunk * tiles + t] = total;
+            total += count;
+        }
+    }
+    tile_first[tiles] = total;
+    tile_bodies.resize(total);
+
+    // 3. and put them there
+    #pragma omp parallel for schedule(static, 1)
+    for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+        std::size_t* next = &chunk_tiles[chunk * tiles];
+        for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+            int tx0, ty0, tx1, ty1;
+            if (!covers(i, tx0, ty0, tx1, ty1)) { continue; }
+            for (int ty = ty0; ty <= ty1; ty++) {
+                for (int tx = tx0; tx <= tx1; tx++) {
+                    tile_bodies[next[static_cast<std::size_t>(ty) * tiles_x + tx]++] = static_cast<uint32_t>(i);
+                }
+            }
+        }
+    }
 
-    if (file.is_open())
+    // 4. each tile into a buffer of the thread's own, then onto the image
+    const std::size_t tile_values = static_cast<std::size_t>(tile) * tile * 3;
+    buffers.resize(chunks * tile_values);
+    #pragma omp parallel
     {
-//		size = file.tellg();
-        file << "P6\n" << WIDTH << " " << HEIGHT << "\n" << "255\n";
-        file.write(data, WIDTH*HEIGHT*3);
-        file.close();
+        double* buffer = &buffers[static_cast<std::size_t>(omp_get_thread_num()) * tile_values];
+        #pragma omp for schedule(dynamic)
+        for (std::size_t t = 0; t < tiles; t++) {
+            if (tile_first[t] == tile_first[t + 1]) { continue; }
+            const int x0 = static_cast<int>(t % tiles_x) * tile;
+            const int y0 = static_cast<int>(t / tiles_x) * tile;
+            const int x1 = std::min(x0 + tile, width);
+            const int y1 = std::min(y0 + tile, height);
+            const int tile_width = x1 - x0;
+            std::fill(buffer, buffer + static_cast<std::size_t>(tile_width) * (y1 - y0) * 3, 0.0);
+
+            for (std::size_t k = tile_first[t]; k < tile_first[t + 1]; k++) {
+                const std::size_t i = tile_bodies[k];
+                color c;
+                dotColor(speed[i], c);
+                if (weight) { c = color{c.r * weight[i], c.g * weight[i], c.b * weight[i]}; }
+                splatDot(toPixelSpace(x[i], width, config), toPixelSpace(y[i], height, config), c, stamps,
+                         buffer, x0, y0, tile_width, x0, y0, x1, y1);
+            }
+
+            for (int row = y0; row < y1; row++) {
+                const double* from = buffer + static_cast<std::size_t>(row - y0) * tile_width * 3;
+                double* to = hdImage + (static_cast<std::size_t>(row) * width + x0) * 3;
+                for (int k = 0; k < tile_width * 3; k++) { to[k] += from[k]; }
+            }
+        }
+    }
+}
+
+void renderBodies(const Bodies& bodies, double* hdImage, const Config& config, Rasterizer& raster)
+{
+    const std::size_t n = bodies.size();
+    raster.speeds.resize(n);
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        raster.speeds[i] = std::sqrt(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
     }
+    raster.draw(bodies.x.data(), bodies.y.data(), raster.speeds.data(), n, hdImage, config);
+    //std::cout << "Rendered " << raster.drawn << " out of " << n << " bodies\n";
+}
 
+// Like renderBodies, from bare arrays: position, and speed (for the color) instead of velocity
+void renderPoints(const double* x, const double* y, const double* speed, std::size_t n, double* hdImage,
+                  const Config& config, Rasterizer& raster, const double* weight)
+{
+    raster.draw(x, y, speed, n, hdImage, config, weight);
+}
+
+bool LevelOfDetail::usable(const Bodies& bodies, const Quadtree& tree)
+{
+    // insert() doesn't keep body ranges, and a tree from some other set of bodies won't line up
+    return !tree.nodes.empty() && !bodies.empty() && tree.leaf_body.size() == bodies.size() &&
+           tree.nodes[0].count == bodies.size();
+}
+
+/*  Method to pick the dots for a frame out of the tree
+ *      inputs:         the bodies, the tree made from them (see usable()), the config
+ *      outputs:        x, y, speed and weight of every dot, in the order they should be drawn
+ *      side effects:   sets nodes and singles
+ *
+ *  The walk goes down the tree on one thread, and stops at far fewer nodes than there are bodies.
+ *  Adding up their bodies' speeds is the part that still goes through every body, so that's split
+ *  over threads, a picked node each. Bodies too slow to get a color don't count towards a node's
+ *  weight or its speed, same as they wouldn't get drawn on their own
+ */
+void LevelOfDetail::pick(const Bodies& bodies, const Quadtree& tree, const Config& config, std::vector<double>& x,
+                         std::vector<double>& y, std::vector<double>& speed, std::vector<double>& weight)
+{
+    const int size = std::max(config.width, config.height);
+    const double limit = config.render_lod;
+
+    // 1. down from the root, stopping at every node under the limit and every leaf
+    picked.clear();
+    first.clear();
+    std::size_t dots = 0;
+    nodes = singles = 0;
+    for (std::size_t node = 0; ; ) {
+        const Node& here = tree.nodes[node];
+        const double across = toPixelSpace(std::max(here.quad.length, here.extent), size, config) -
+                              toPixelSpace(0, size, config);
+        const bool whole = across < limit;
+        if (here.count > 0 && !whole && here.children != 0) {
+            node = here.children;
+            continue;
+        }
+        if (here.count > 0) {
+            picked.push_back(node);
+            first.push_back(dots);
+            // a leaf big enough to see gets its bodies drawn one by one
+            const std::size_t made = whole ? 1 : here.count;
+            dots += made;
+            (whole ? nodes : singles) += made;
+        }
+        if (here.next == 0) { break; } else { node = here.next; }
+    }
+    first.push_back(dots);
+
+    // 2. and the dots for each of them
+    x.resize(dots);
+    y.resize(dots);
+    speed.resize(dots);
+    weight.resize(dots);
+    auto speed_of = [&](std::size_t slot) {
+        const std::size_t i = tree.leaf_body[slot];
+        return std::sqrt(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+    };
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (std::size_t p = 0; p < picked.size(); p++) {
+        const Node& here = tree.nodes[picked[p]];
+        std::size_t out = first[p];
+        // one dot per body (a leaf that's big enough, or a node with just the one body in it anyway)
+        if (first[p + 1] - out > 1 || here.count == 1) {
+            for (std::size_t slot = here.first; slot < here.first + here.count; slot++, out++) {
+                x[out] = tree.leaf_x[slot];
+                y[out] = tree.leaf_y[slot];
+                speed[out] = speed_of(slot);
+                weight[out] = 1;
+            }
+            continue;
+        }
+        double total = 0;
+        std::size_t counted = 0;
+        for (std::size_t slot = here.first; slot < here.first + here.count; slot++) {
+            const double v = speed_of(slot);
+            color c;
+            if (dotColor(v, c)) {
+                total += v;
+                counted++;
+            }
+        }
+        x[out] = here.centm.x;
+        y[out] = here.centm.y;
+        speed[out] = (counted > 0) ? total / counted : 0;
+        weight[out] = static_cast<double>(counted);
+    }
 }
 
-void createFrame(char* image, double* hdImage, std::vector<Body> bodies, int step)
+/*  Method to turn the drawn image into the 8 bit one that gets written
+ *      inputs:         the image as drawn (doubles, 1 is full brightness), how many values it has
+ *      outputs:        none
+ *      side effects:   fills image, the same bytes writeRender's loop used to make, on every thread
+ */
+void tonemap(const double* hdImage, uint8_t* image, std::size_t values)
 {
-    renderClear(image, hdImage);
-    renderBodies(bodies, hdImage);
-    writeRender(image, hdImage, step);
+    // clamp() spelled out with compares, which vectorize where fmin/fmax calls don't. same answer, NaN included
+    #pragma omp parallel for simd schedule(static)
+    for (std::size_t i = 0; i < values; i++)
+    {
+        double v = hdImage[i];
+        v = (v < 1.0) ? v : 1.0;
+        v = (v > 0.0) ? v : 0.0;
+        image[i] = static_cast<uint8_t>(static_cast<int>(255.0 * v));
+    }
+}
+
+RenderPipeline::RenderPipeline(const Config& config) : config(config), raster(config), sink(make_frame_sink(config)) {
+    const std::size_t pixels = static_cast<std::size_t>(config.width) * config.height;
+    image.resize(pixels * 3);
+    hdImage.resize(pixels * 3);
+    slots.resize(config.render_queue);
+    if (!slots.empty()) {
+        drawer = std::thread(&RenderPipeline::draw_frames, this);
+    }
+}
+
+RenderPipeline::~RenderPipeline() {
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (drawer.joinable()) { drawer.join(); }
+}
+
+/*  Method to hand a frame over to be drawn
+ *      inputs:         the bodies as they are now, which step it is, the tree made from them (only
+ *                      used with render_lod, can be null)
+ *      outputs:        none
+ *      side effects:   copies their positions and speeds (or the level of detail dots) into a free slot
+ *                      (waiting for one if there isn't), or with no slots draws and writes the frame right here
+ */
+void RenderPipeline::submit(const Bodies& bodies, int step, const Quadtree* tree) {
+    if (slots.empty()) {
+        double start = omp_get_wtime();
+        if (config.render_lod > 0 && tree && LevelOfDetail::usable(bodies, *tree)) {
+            fill(inline_slot, bodies, step, tree);
+            draw(inline_slot);
+        } else {
+            FrameTimes times;
+            double at = omp_get_wtime();
+            renderClear(hdImage.data(), config);
+            times.clear = omp_get_wtime() - at;
+            at = omp_get_wtime();
+            renderBodies(bodies, hdImage.data(), config, raster);
+            times.splat = omp_get_wtime() - at;
+            output(step, times);
+        }
+        drawing += omp_get_wtime() - start;
+        return;
+    }
+
+    double start = omp_get_wtime();
+    std::unique_lock<std::mutex> hold(lock);
+    changed.wait(hold, [this]() { return queued < slots.size(); });
+    waiting += omp_get_wtime() - start;
+    Slot& slot = slots[(oldest + queued) % slots.size()];
+    hold.unlock(); // nobody else touches a free slot
+
+    fill(slot, bodies, step, tree);
+
+    hold.lock();
+    queued++;
+    hold.unlock();
+    changed.notify_all();
+}
+
+// Copies what the frame needs into a slot: every body, or the level of detail dots if there's a tree for them
+void RenderPipeline::fill(Slot& slot, const Bodies& bodies, int step, const Quadtree* tree) {
+    const double start = omp_get_wtime();
+    slot.step = step;
+    slot.times = FrameTimes();
+    if (config.render_lod > 0 && tree && LevelOfDetail::usable(bodies, *tree)) {
+        lod.pick(bodies, *tree, config, slot.x, slot.y, slot.speed, slot.weight);
+        slot.times.fill = omp_get_wtime() - start;
+        return;
+    }
+
+    const std::size_t n = bodies.size();
+    slot.x.resize(n);
+    slot.y.resize(n);
+    slot.speed.resize(n);
+    slot.weight.clear();
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        slot.x[i] = bodies.x[i];
+        slot.y[i] = bodies.y[i];
+        slot.speed[i] = std::sqrt(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+    }
+    slot.times.fill = omp_get_wtime() - start;
+}
+
+void RenderPipeline::finish() {
+    std::unique_lock<std::mutex> hold(lock);
+    changed.wait(hold, [this]() { return queued == 0; });
+    hold.unlock();
+    if (sink) { sink->flush(); }
+}
+
+// What the drawing thread runs: draws the oldest waiting slot, frees it, repeat until told to stop
+void RenderPipeline::draw_frames() {
+    // every parallel loop drawing does (and first_touch() for big buffers) opens a team from this thread,
+    // on top of the step's team that's running at the same time. keep this one small so they don't fight
+    // over every core. only this thread's setting changes, drawing inline (render_queue 0) still gets them all
+    omp_set_num_threads(config.render_threads);
+    while (true) {
+        std::unique_lock<std::mutex> hold(lock);
+        changed.wait(hold, [this]() { return queued > 0 || stopping; });
+        if (queued == 0) { return; }
+        const Slot& slot = slots[oldest];
+        hold.unlock();
+
+        double start = omp_get_wtime();
+        draw(slot);
+        drawing += omp_get_wtime() - start;
+
+        hold.lock();
+        oldest = (oldest + 1) % slots.size();
+        queued--;
+        hold.unlock();
+        changed.notify_all();
+    }
+}
+
+void RenderPipeline::draw(const Slot& slot) {
+    FrameTimes times = slot.times;
+    double at = omp_get_wtime();
+    renderClear(hdImage.data(), config);
+    times.clear = omp_get_wtime() - at;
+    at = omp_get_wtime();
+    renderPoints(slot.x.data(), slot.y.data(), slot.speed.data(), slot.x.size(), hdImage.data(), config, raster,
+                 slot.weight.empty() ? nullptr : slot.weight.data());
+    times.splat = omp_get_wtime() - at;
+    output(slot.step, times);
+}
+
+/*  Method to finish a frame off: to 8 bits and off to the sink, then the telemetry line for it
+ *      inputs:         which step it is, how long it's taken so far
+ *      outputs:        none
+ *      side effects:   image is whatever buffer write() handed back, to tonemap into next time
+ */
+void RenderPipeline::output(int step, FrameTimes& times) {
+    if (sink) {
+        double at = omp_get_wtime();
+        const std::size_t values = hdImage.size();
+        image.resize(values);
+        tonemap(hdImage.data(), image.data(), values);
+        times.tonemap = omp_get_wtime() - at;
+        at = omp_get_wtime();
+        sink->write(image, step);
+        times.write = omp_get_wtime() - at;
+    }
+    if (telemetry) { telemetry->frame(step, times, raster.drawn); }
 }
 
 /*  TODO:
@@ -1,19 +1,162 @@
 #pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 #include "simulation.h"
+#include "config.h"
+#include "frames.h"
+#include "telemetry.h"
 
-void createFrame(char* image, double* hdImage, std::vector<Body> bodies, int step);
-void writeRender(char* data, double* hdImage, int step);
-void renderBodies(std::vector<Body> bodies, double* hdImage);
-void colorDot(double x, double y, double vMag, double* hdImage);
-void colorAt(int x, int y, const struct color& c, double f, double* hdImage);
+struct DotStamps;
+struct Rasterizer;
+
+// the image size, zoom and dot look all come from the config (width, height, system_size, dot_size, ...)
+void tonemap(const double* hdImage, uint8_t* image, std::size_t values);
+void renderBodies(const Bodies& bodies, double* hdImage, const Config& config, Rasterizer& raster);
+void renderPoints(const double* x, const double* y, const double* speed, std::size_t n, double* hdImage,
+                  const Config& config, Rasterizer& raster, const double* weight = nullptr);
+void colorDot(double x, double y, double vMag, double* hdImage, const Config& config);
+void stampDot(double x, double y, double vMag, double* hdImage, const Config& config, const DotStamps& stamps);
+void colorAt(int x, int y, const struct color& c, double f, double* hdImage, int width);
 double clamp(double x);
 double magnitude(const vec2& v);
-double toPixelSpace(double p, int size);
-void renderClear(char* image, double* hdImage);
+double toPixelSpace(double p, int size, const Config& config);
+void renderClear(double* hdImage, const Config& config);
 
 struct color
 {
     double r, g, b;
+};
+
+/*  The dot colorDot draws, worked out ahead of time, so drawing one is just adding tables on
+ *  How bright each pixel of a dot is only depends on where in its pixel the dot's center lands, so
+ *  there's a stamp (span x span brightnesses) for each of a (subpixels + 1) x (subpixels + 1) grid of
+ *  places in the pixel, edges included. stampDot blends the four around where the center really is
+ *  Built once for a config's dot_size, particle_sharpness and particle_brightness
+ */
+struct DotStamps {
+    int size = 0;      // dot_size they were made for
+    int span = 0;      // pixels across, 2 * (size/2) like colorDot
+    int subpixels = DOT_SUBPIXELS;
+    std::vector<double> values; // the stamps, each span rows of span
+
+    explicit DotStamps(const Config& config);
+    const double* stamp(int qx, int qy) const {
+        return &values[(static_cast<std::size_t>(qy) * (subpixels + 1) + qx) * span * span];
+    }
+};
+
+/*  Draws all the dots of a frame in parallel, without two threads ever adding onto the same pixel
+ *  The image is cut into tile x tile squares. draw() first sorts the bodies into the tiles their dots
+ *  cover (a dot over an edge goes into every tile it touches, and each only draws its part), in
+ *  body order within each tile. Then threads take whole tiles, add up its dots in a buffer of their
+ *  own and copy it into the image. Each pixel gets its dots added in body order whatever the number
+ *  of threads, so the image comes out exactly the same on any number of them
+ *  Everything's kept between frames, so after the first one nothing gets allocated
+ *  weight, if it's given, scales each dot's brightness (a dot standing in for that many bodies)
+ */
+struct Rasterizer {
+    DotStamps stamps;
+    int tile = RENDER_TILE;
+    std::size_t drawn = 0;      // how many dots the last draw() put on the image
+    std::vector<double> speeds; // room for renderBodies to work out speeds in
+
+    explicit Rasterizer(const Config& config);
+    void draw(const double* x, const double* y, const double* speed, std::size_t n, double* hdImage,
+              const Config& config, const double* weight = nullptr);
+
+private:
+    std::vector<std::size_t> tile_first;  // where each tile's bodies start in tile_bodies, and one past the end
+    std::vector<uint32_t> tile_bodies;
+    std::vector<std::size_t> chunk_tiles; // per chunk of bodies, how many go in each tile (then where they go)
+    std::vector<double> buffers;          // a tile of pixels per thread
+};
+
+/*  Level of detail, for when there are far more bodies than pixels: the dots come from the tree instead
+ *  of from every body. Walking down from the root, a node less than render_lod pixels across becomes
+ *  one dot at its center of mass, as bright as all of its bodies put together (its weight) and colored
+ *  by their average speed. Only leaves bigger than that get their bodies drawn one at a time. So the
+ *  number of dots goes with the size of the image, not with the number of bodies
+ *  Needs the tree build_morton (or refit) made from these same bodies, for the body ranges. The
+ *  simulation's is, at the end of a step: its last force pass built it after the last drift
+ */
+struct LevelOfDetail {
+    std::size_t nodes = 0;   // dots the last pick() made out of whole nodes
+    std::size_t singles = 0; // and out of single bodies
+
+    static bool usable(const Bodies& bodies, const Quadtree& tree);
+    void pick(const Bodies& bodies, const Quadtree& tree, const Config& config, std::vector<double>& x,
+              std::vector<double>& y, std::vector<double>& speed, std::vector<double>& weight);
+
+private:
+    std::vector<std::size_t> picked; // the nodes the walk stopped at
+    std::vector<std::size_t> first;  // where each one's dots start
+};
+
+// Wall clock seconds spent on each part of one frame
+struct FrameTimes {
+    double fill = 0;    // copying the bodies for it out of the simulation (or picking level of detail dots)
+    double clear = 0;   // zeroing the image
+    double splat = 0;   // drawing the dots
+    double tonemap = 0; // down to 8 bits
+    double write = 0;   // handing it to the frame sink, and waiting for it if it's behind
+};
+
+/*  Draws frames on a thread of its own, so the next step gets going while the last one's still being
+ *  drawn, and hands them to the frame sink (see frames.h), which encodes and writes them on its own
+ *  submit() copies just what the drawing needs (position and speed) out of the bodies into one of
+ *  render_queue slots, and returns. The drawing thread goes through the slots in order, all into the
+ *  one image buffer it owns. When every slot is still waiting to be drawn submit() waits for one, so
+ *  the renderer is never more than render_queue frames behind. The slots and the image are only
+ *  allocated the first time, nothing gets allocated per frame after that. The drawing thread's parallel
+ *  loops get render_threads threads, the step keeps the rest
+ *  With render_queue 0 there's no thread, submit() draws and writes the frame itself, like before
+ *  Given the tree and a render_lod, the slot gets LevelOfDetail's dots instead of every body
+ */
+struct RenderPipeline {
+    explicit RenderPipeline(const Config& config);
+    RenderPipeline(const RenderPipeline&) = delete;
+    RenderPipeline& operator=(const RenderPipeline&) = delete;
+    ~RenderPipeline();
+
+    void submit(const Bodies& bodies, int step, const Quadtree* tree = nullptr);
+    void finish(); // blocks until every frame submitted so far is written
+    std::size_t written() const { return sink ? sink->bytes : 0; } // bytes of frames, up to the last finish()
+
+    double drawing = 0; // seconds spent drawing frames and handing them over
+    double waiting = 0; // seconds submit() spent waiting for a free slot
+    Telemetry* telemetry = nullptr; // gets a line for every frame, if it's set
+
+private:
+    // what one frame needs: where every body is, and how fast it's going (for its color)
+    // or with level of detail, where each dot is, its speed, and how many bodies it stands for
+    struct Slot {
+        std::vector<double> x, y, speed;
+        std::vector<double> weight; // empty without level of detail
+        int step = 0;
+        FrameTimes times;
+    };
+    Config config;
+    Rasterizer raster;
+    LevelOfDetail lod;
+    Slot inline_slot; // for level of detail with render_queue 0
+    std::unique_ptr<FrameSink> sink; // null with frame_sink none
+    std::vector<uint8_t> image;
+    std::vector<double> hdImage;
+    std::vector<Slot> slots;
+    std::size_t oldest = 0; // first slot waiting to be drawn
+    std::size_t queued = 0; // and how many are waiting (the one being drawn counts until it's written)
+    bool stopping = false;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread drawer;
+
+    void fill(Slot& slot, const Bodies& bodies, int step, const Quadtree* tree);
+    void draw_frames();
+    void draw(const Slot& slot);
+    void output(int step, FrameTimes& times);
 };
\ No newline at end of file
@@ -1,50 +1,336 @@
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
 #include "simulation.h"
 
 
 // Implementation of Simulation methods
-Simulation::Simulation()
-        : delta_t(0.05),
+Simulation::Simulation() : Simulation(Config()) {}
+
+Simulation::Simulation(const Config& config)
+        : config(config),
+          delta_t(config.delta_t),
           frame(0),
-          bodies(gen_bodies_disk(NUM_BODIES)),
-          ygg(build_quadtree(bodies)) {}
+          bodies(gen_bodies_for(config)) {
+    // no tree yet, the first attract() builds one (in parallel), the same as it would every step
+    configure();
+}
+
+Simulation::Simulation(double delta_t, std::size_t frame, std::vector<Body> bodies, Quadtree ygg,
+                       const Config& config)
+        : config(config), delta_t(delta_t), frame(frame), bodies(Bodies(bodies)), ygg(std::move(ygg)) {
+    configure();
+}
+
+/*  Constructor to resume a run from a checkpoint
+ *  the bodies come straight out of the mapped file (see read_snapshot), frame, delta_t and seed from its header,
+ *  everything else from the config. the step levels get capped at the config's step_levels, which is
+ *  only right if they were the same when the checkpoint was written
+ */
+Simulation::Simulation(const std::string& checkpoint, const Config& config) : config(config) {
+    Snapshot snapshot;
+    if (!read_snapshot(checkpoint, snapshot)) {
+        exit(1);
+    }
+    delta_t = snapshot.header.delta_t;
+    frame = snapshot.header.frame;
+    resumed_frame = frame;
+    this->config.seed = snapshot.header.seed; // so later checkpoints still say where the bodies came from
+    bodies = std::move(snapshot.bodies);
+    // and no tree for the same reason as above. building one here would read every page of the mapping, on one thread
+    configure();
 
-Simulation::Simulation(double delta_t, std::size_t frame, std::vector<Body> bodies, Quadtree ygg)
-        : delta_t(delta_t), frame(frame), bodies(std::move(bodies)), ygg(std::move(ygg)) {}
+    if (snapshot.header.flags & SNAP_KICKED) {
+        kicked = true;
+        step_level = std::move(snapshot.level);
+        for (uint8_t& level : step_level) {
+            level = static_cast<uint8_t>(std::min<int>(level, step_levels));
+        }
+    }
+    printf("Resumed %zu bodies at frame %zu from %s\n", bodies.size(), frame, checkpoint.c_str());
+}
+
+void Simulation::configure() {
+    ygg.theta = config.theta;
+    ygg.epsilon = config.epsilon;
+    ygg.leaf_capacity = config.leaf_capacity;
+    ygg.refit_looseness = config.refit_looseness;
+    ygg.refit_max_moved = config.refit_max_moved;
+    ygg.refit_max_overflow = config.refit_max_overflow;
+    fmm.theta = config.fmm_theta;
+    fmm.epsilon = config.epsilon;
+    direct.tile = config.direct_tile;
+    direct.epsilon = config.epsilon;
+    solver = static_cast<Solver>(config.force_solver);
+    step_levels = config.step_levels;
+    step_eta = config.step_eta;
+    tuner = ForceTuner(config);
+}
 
+/*  Method to move the simulation forward delta_t, with a kick-drift-kick leapfrog on block timesteps
+ *
+ *  Every body takes steps of delta_t / 2^level, with its level picked from how hard it's being pulled
+ *  (see level_for), so bodies deep in the well take lots of short steps and the quiet ones take a few
+ *  long ones. A body's step goes:
+ *      kick:   half its step's worth of its acceleration onto its velocity
+ *      drift:  everyone moves along their velocity, a substep at a time
+ *      kick:   new acceleration at the end of its step, the other half step's worth of it
+ *  The closing kick of one step and the opening kick of the next happen together, so velocities are
+ *  always half a step ahead of positions.
+ *
+ *  Time inside a step is counted in ticks, the shortest step there is. Each substep goes to the next tick
+ *  where some body's step ends. All bodies drift there (positions have to be right for the tree), but only
+ *  the ones finishing a step get a new acceleration, through the partial walk. Shorter steps always line
+ *  up with longer ones, so at the end of delta_t everyone finishes together and the frame is in sync.
+ *
+ *  A body can always move to a shorter step. It only moves to a longer one where that longer step would
+ *  start on its own boundary, so steps never get out of line.
+ */
 void Simulation::step() {
+    last_times = StepTimes();
+    const std::size_t n = bodies.size();
+    const uint64_t ticks = uint64_t(1) << step_levels;       // delta_t, in ticks
+    const double tick = delta_t / static_cast<double>(ticks); // a tick, in time
+    auto length = [&](int level) { return ticks >> level; };  // a step at some level, in ticks
+
+    if (tuner.due(frame)) {
+        tune();
+    }
+
+    double start = omp_get_wtime();
+    // before anything moves everyone needs an acceleration, a step, and the first half kick
+    if (!kicked) {
+        attract(true);
+        substeps++;
+        force_evals += n;
+        start = omp_get_wtime();
+        step_level.resize(n);
+        #pragma omp parallel for
+        for (std::size_t i = 0; i < n; i++) {
+            step_level[i] = static_cast<uint8_t>(level_for(i));
+            double half = 0.5 * length(step_level[i]) * tick;
+            bodies.vx[i] += bodies.ax[i] * half;
+            bodies.vy[i] += bodies.ay[i] * half;
+        }
+        kicked = true;
+    }
+    active.resize(n);
+
+    uint64_t now = 0;
+    while (now < ticks) {
+        // the shortest step anyone's on ends first, and everyone else's step ends on one of its boundaries
+        int deepest = 0;
+        #pragma omp parallel for reduction(max:deepest)
+        for (std::size_t i = 0; i < n; i++) {
+            deepest = std::max<int>(deepest, step_level[i]);
+        }
+        const uint64_t next = (now / length(deepest) + 1) * length(deepest);
+
+        iterate((next - now) * tick);
+        std::size_t due = 0;
+        #pragma omp parallel for reduction(+:due)
+        for (std::size_t i = 0; i < n; i++) {
+            active[i] = (next % length(step_level[i]) == 0);
+            due += active[i];
+        }
+        last_times.iterate += omp_get_wtime() - start;
+
+        attract(due == n);
+        substeps++;
+        force_evals += due;
+
+        start = omp_get_wtime();
+        #pragma omp parallel for
+        for (std::size_t i = 0; i < n; i++) {
+            if (!active[i]) { continue; }
+            // closing half kick for the step that just ended
+            int level = step_level[i];
+            double half = 0.5 * length(level) * tick;
+            bodies.vx[i] += bodies.ax[i] * half;
+            bodies.vy[i] += bodies.ay[i] * half;
+
+            // pick the next step: shorter whenever, longer only while it'd still start on a boundary
+            int wanted = level_for(i);
+            if (wanted > level) {
+                level = wanted;
+            } else {
+                while (level > wanted && next % length(level - 1) == 0) { level--; }
+            }
+            step_level[i] = static_cast<uint8_t>(level);
+
+            // and the opening half kick for it
+            half = 0.5 * length(level) * tick;
+            bodies.vx[i] += bodies.ax[i] * half;
+            bodies.vy[i] += bodies.ay[i] * half;
+        }
+        now = next;
+    }
+    last_times.iterate += omp_get_wtime() - start;
 
-    iterate();
     //collide(); // i want collision detection but that seems like a WHOLE thing so we're ignoring it for now
-    attract();
     frame += 1;
+
+    total_times.iterate += last_times.iterate;
+    total_times.bounds += last_times.bounds;
+    total_times.build += last_times.build;
+    total_times.propagate += last_times.propagate;
+    total_times.force += last_times.force;
+    total_times.tune += last_times.tune;
+
+    if (config.checkpoint_every > 0 && frame % config.checkpoint_every == 0) {
+        checkpoint();
+    }
+    if (config.trajectory_every > 0 && frame % config.trajectory_every == 0) {
+        record_trajectory();
+    }
+}
+
+void Simulation::checkpoint() {
+    SnapshotHeader header;
+    header.frame = frame;
+    header.delta_t = delta_t;
+    header.seed = config.seed;
+    header.flags = kicked ? SNAP_KICKED : 0;
+    checkpointer.save(config.checkpoint_file, header, bodies, step_level);
+}
+
+// the file gets started the first time there's something to put in it
+// (or carried on from the checkpoint's frame, for a resumed run)
+void Simulation::record_trajectory() {
+    if (!trajectory.is_open()) {
+        TrajectoryHeader header;
+        header.seed = config.seed;
+        header.delta_t = delta_t;
+        header.position_bits = static_cast<uint32_t>(config.trajectory_position_bits);
+        header.velocity_bits = static_cast<uint32_t>(config.trajectory_velocity_bits);
+        trajectory.block_frames = std::max<std::size_t>(config.trajectory_block, 1);
+        bool opened = config.resume.empty()
+                ? trajectory.open(config.trajectory_file, header, bodies.mass, config.trajectory_overwrite)
+                : trajectory.resume(config.trajectory_file, header, bodies.mass, resumed_frame);
+        if (!opened) {
+            config.trajectory_every = 0; // said why already, don't keep trying every frame
+            return;
+        }
+    }
+    trajectory.record(bodies, frame);
 }
 
-void Simulation::iterate() {
-    #pragma omp parallel for
-    for (Body& body : bodies) {
-        body.update(delta_t);
+/*  Method to have the tuner pick theta and leaf_capacity again (see ForceTuner)
+ *  only for the tree walk, and only with enough bodies that attract() would use it. the tree's left
+ *  built with the new settings, so the refit can start again from it
+ */
+void Simulation::tune() {
+    if (solver != Solver::BarnesHut || bodies.size() < direct_crossover(config)) { return; }
+    double start = omp_get_wtime();
+    tuner.tune(bodies, ygg, config);
+    config.theta = ygg.theta;
+    config.leaf_capacity = ygg.leaf_capacity;
+    refit_wait = 0;
+    refit_backoff = 1;
+    last_times.tune += omp_get_wtime() - start;
+    printf("Tuned at frame %zu: theta %.2f, leaf_capacity %zu, force error %.3g%% (budget %.3g%%), force pass %.1f ms\n",
+           frame, tuner.theta, tuner.leaf_capacity, tuner.error * 100, tuner.budget * 100, tuner.force * 1e3);
+}
+
+void Simulation::iterate(double dt) {
+    bodies.drift(dt);
+}
+
+/*  Method to pick the step a body should be on, from its acceleration
+ *  the step that's short enough is sqrt(2 * eta * softening / |accel|), same as most tree codes use.
+ *  the level is how many times delta_t has to be halved to get under that, capped at step_levels
+ */
+int Simulation::level_for(std::size_t i) const {
+    double accel = std::sqrt(bodies.ax[i] * bodies.ax[i] + bodies.ay[i] * bodies.ay[i]);
+    if (accel == 0) { return 0; }
+    double wanted = std::sqrt(2 * step_eta * config.epsilon / accel);
+    int level = 0;
+    double dt = delta_t;
+    while (level < step_levels && dt > wanted) {
+        dt *= 0.5;
+        level++;
     }
+    return level;
 }
 
 void Simulation::collide() {
     // TODO: Implement collision detection/response
 }
 
-void Simulation::attract() {
-    //printf("attracting!\n");
-    Quad root;
-    root.new_containing(bodies);
-    ygg.reset(root);
+void Simulation::attract(bool everyone) {
+    // with few enough bodies building a tree costs more than it saves, so just add up every pair
+    if (solver == Solver::Direct || bodies.size() < direct_crossover(config)) {
+        double start = omp_get_wtime();
+        if (everyone) {
+            direct.accel(bodies);
+            interactions += bodies.size() * bodies.size();
+        } else {
+            direct.accel_active(bodies, active);
+            interactions += std::count(active.begin(), active.end(), 1) * bodies.size();
+        }
+        last_times.force += omp_get_wtime() - start;
+    } else {
+        attract_tree(everyone);
+    }
+}
 
-    for (Body& body : bodies) {
-        ygg.insert(body.pos, body.mass);
+void Simulation::attract_tree(bool everyone) {
+    //printf("attracting!\n");
+    double start = omp_get_wtime();
+    // most steps last step's tree still fits well enough to just move the odd body over
+    // when it doesn't, stop trying for a while (longer each time) so the check isn't wasted every step
+    bool refitted = false;
+    if (config.morton_build && config.refit_tree) {
+        if (refit_wait > 0) {
+            refit_wait--;
+        } else if (ygg.refit(bodies)) {
+            refitted = true;
+            refit_backoff = 1;
+        } else {
+            refit_wait = refit_backoff;
+            refit_backoff = std::min<std::size_t>(refit_backoff * 2, 64);
+        }
     }
+    double bounding = 0;
+    if (!refitted) {
+        double bounds_start = omp_get_wtime();
+        Quad root;
+        root.new_containing(bodies);
+        bounding = omp_get_wtime() - bounds_start;
+        if (config.morton_build) {
+            ygg.build_morton(bodies, root);
+        } else {
+            ygg.reset(root);
+            for (std::size_t i = 0; i < bodies.size(); i++) {
+                ygg.insert(bodies.pos(i), bodies.mass[i]);
+            }
+        }
+    }
+
+    double built = omp_get_wtime();
+    last_times.bounds += bounding;
+    last_times.build += built - start - bounding;
+    const std::size_t walked = ygg.interactions;
 
+    // the FMM needs the quadrupoles whether or not the tree walk uses them
+    // it does every body at once though, so substeps where only some are due use the partial walk
+    const bool use_fmm = (solver == Solver::Fmm && config.morton_build && everyone);
+    ygg.quadrupole = use_fmm || config.quadrupole;
     ygg.propogate();
+    double propagated = omp_get_wtime();
+    last_times.propagate += propagated - built;
 
-    // TODO: GPU parelelize this
-    #pragma omp parallel for
-    for (Body& body : bodies) {
-        body.accel = ygg.accel(body.pos);
+    // the FMM and grouping both need the body ranges only build_morton keeps track of
+    if (use_fmm) {
+        fmm.accel(ygg, bodies);
+    } else if (!everyone) {
+        ygg.accel_active(bodies, active, config.morton_build ? config.group_size : 0);
+    } else if (config.morton_build && config.group_size > 0) {
+        ygg.accel_grouped(bodies, config.group_size);
+    } else {
+        // TODO: GPU parelelize this
+        ygg.walk_bodies(bodies, nullptr);
     }
+    interactions += ygg.interactions - walked;
+    last_times.force += omp_get_wtime() - propagated;
 }
@@ -7,30 +7,85 @@
 #define SIMULATION_H
 
 #include <vector>
+#include <cstdint>
 #include "quadtree.h"
+#include "fmm.h"
+#include "direct.h"
 #include "utils.h"
+#include "config.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "tuner.h"
 #include "Constants.h"
 
+// Wall clock seconds spent in each part of a step (added up over its substeps)
+struct StepTimes {
+    double iterate = 0;   // kicking and moving the bodies
+    double bounds = 0;    // finding the box around the bodies, for a new tree
+    double build = 0;     // building (or refitting) the tree
+    double propagate = 0; // masses and centers of mass up the tree, plus pack()
+    double force = 0;     // the tree walk
+    double tune = 0;      // picking theta and leaf_capacity again (see ForceTuner), most steps nothing
+};
+
+// Which method attract() works out the forces with
+enum class Solver {
+    BarnesHut = 0,  // one tree walk per body (or per group of bodies)
+    Fmm = 1,        // node-to-node interactions, see fmm.h
+    Direct = 2,     // every pair of bodies, no tree, see direct.h. also used by the others for few enough bodies
+};
+
 // ==============================================
 //  Simulation
 //  Represents one instance of an N-body simulation.
 //  Holds all bodies, the quadtree, and simulation state.
 // ==============================================
 struct Simulation {
+    Config config;               // The settings it was started with
     double delta_t;              // Time step
     std::size_t frame;           // Frame counter
-    std::vector<Body> bodies;    // All bodies in the simulation
+    std::size_t resumed_frame = 0; // the checkpoint's frame, if it was resumed from one
+    Bodies bodies;               // All bodies in the simulation, one array per field (see Bodies)
     Quadtree ygg;                // The Barnes–Hut quadtree ("Yggdrasil")
+    std::size_t refit_wait = 0;    // steps left before trying to refit the tree again
+    std::size_t refit_backoff = 1; // how long to wait next time a refit gives up
+    Solver solver = Solver::BarnesHut; // can be switched between steps
+    Fmm fmm;                       // the FMM's scratch space, kept between steps
+    Direct direct;                 // and direct summation's settings
+    ForceTuner tuner;              // picks theta and leaf_capacity every so often, with tune_error set
+    StepTimes last_times;          // how long each phase took on the latest step
+    StepTimes total_times;         // and added up over every step so far
+
+    // Block timesteps (see step())
+    int step_levels = 0;             // deepest level, a step there is delta_t / 2^step_levels
+    double step_eta = 0;             // accuracy of the step a body picks for itself
+    std::vector<uint8_t> step_level; // per body, it takes steps of delta_t / 2^level
+    std::vector<uint8_t> active;     // per body, whether it's due a new acceleration this substep
+    bool kicked = false;             // whether the bodies have had their first half kick yet
+    std::size_t substeps = 0;        // force calculations so far (one or more per step)
+    std::size_t force_evals = 0;     // and how many body accelerations they worked out between them
+    std::size_t interactions = 0;    // and how many bodies and nodes pulled on those, all told (not counted for the FMM)
+    Checkpointer checkpointer;       // writes checkpoints in the background (see snapshot.h)
+    TrajectoryWriter trajectory;     // and the trajectory, if there is one (see trajectory.h)
 
     // Constructors
     Simulation();
-    Simulation(double delta_t, std::size_t frame, std::vector<Body> bodies, Quadtree ygg);
+    explicit Simulation(const Config& config);
+    Simulation(double delta_t, std::size_t frame, std::vector<Body> bodies, Quadtree ygg,
+               const Config& config = Config());
+    Simulation(const std::string& checkpoint, const Config& config); // Pick up where a checkpoint left off
+    void configure(); // Hand the settings in config out to the tree and the solvers
 
     // Core simulation steps
-    void step();     // Advance one simulation step
-    void iterate();  // Update positions/velocities
-    void collide();  // Handle collisions (currently stub)
-    void attract();  // Compute gravitational acceleration
+    void step();                 // Advance one simulation step
+    void checkpoint();           // Start writing a checkpoint of right now to config.checkpoint_file
+    void record_trajectory();    // Add right now to the trajectory in config.trajectory_file
+    void iterate(double dt);     // Move every body along its velocity for dt
+    void collide();              // Handle collisions (currently stub)
+    void attract(bool everyone); // Compute gravitational acceleration, of every body or just the active ones
+    void attract_tree(bool everyone); // The same, with the tree (Barnes-Hut or FMM)
+    void tune();                 // Pick theta and leaf_capacity again for where the bodies are now
+    int level_for(std::size_t i) const; // How deep a step body i wants for its current acceleration
 };
 
 #endif // SIMULATION_H
@@ -0,0 +1,241 @@
+//
+// snapshot.cpp
+// Writing and reading body snapshots, see snapshot.h
+//
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+// ## IMPLEMENTATION FILE ##
+
+static std::size_t round_up(std::size_t bytes) {
+    return (bytes + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+// bytes per value in a column
+static std::size_t value_size(int column) {
+    return column == SNAP_LEVEL ? sizeof(uint8_t) : sizeof(double);
+}
+
+void SnapshotHeader::lay_out() {
+    std::size_t offset = round_up(sizeof(SnapshotHeader));
+    for (int c = 0; c < SNAP_MAX_COLUMNS; c++) {
+        column_offset[c] = 0;
+        if (c >= static_cast<int>(columns)) { continue; }
+        column_offset[c] = offset;
+        offset = round_up(offset + count * value_size(c));
+    }
+}
+
+std::size_t SnapshotHeader::file_size() const {
+    return column_offset[columns - 1] + count * value_size(columns - 1);
+}
+
+/*  Method to check every column a header points at is really in the file, before any of it gets mapped
+ *      inputs:         the header (columns already checked to be in range), the file's size in bytes
+ *      outputs:        false if any column starts inside the header, isn't aligned for its values,
+ *                      or runs off the end of the file. (written so a huge count or offset can't wrap around)
+ */
+static bool columns_fit(const SnapshotHeader& h, std::size_t size) {
+    for (int c = 0; c < static_cast<int>(h.columns); c++) {
+        const uint64_t offset = h.column_offset[c];
+        if (offset < sizeof(SnapshotHeader) || offset > size || offset % value_size(c) != 0) { return false; }
+        if (h.count > (size - offset) / value_size(c)) { return false; }
+    }
+    return true;
+}
+
+/*  Method to start a snapshot file
+ *      inputs:         where to write it, the header (column_offset gets filled in here)
+ *      outputs:        false if the file couldn't be made
+ *      side effects:   creates the file, full size, with the header written and the columns zero
+ */
+bool SnapshotWriter::open(const std::string& path, const SnapshotHeader& h) {
+    header = h;
+    header.lay_out();
+    file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Error: couldn't create %s\n", path.c_str());
+        return false;
+    }
+    // writing the last byte sizes the file, so the columns can go in in any order
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fseek(file, static_cast<long>(header.file_size() - 1), SEEK_SET) == 0 &&
+              std::fputc(0, file) != EOF;
+    if (!ok) { fprintf(stderr, "Error: couldn't write %s\n", path.c_str()); }
+    return ok;
+}
+
+/*  Method to write a run of bodies into their place in one column
+ *      inputs:         which column, index of the first body, how many, and their values
+ *      outputs:        false if a write failed
+ */
+bool SnapshotWriter::write(int column, std::size_t first, std::size_t count, const void* values) {
+    const std::size_t size = value_size(column);
+    long at = static_cast<long>(header.column_offset[column] + first * size);
+    if (std::fseek(file, at, SEEK_SET) != 0 || std::fwrite(values, size, count, file) != count) {
+        fprintf(stderr, "Error: couldn't write bodies %zu to %zu\n", first, first + count);
+        return false;
+    }
+    return true;
+}
+
+bool SnapshotWriter::sync() {
+    return file != nullptr && std::fflush(file) == 0 && ::fsync(fileno(file)) == 0;
+}
+
+bool SnapshotWriter::close() {
+    if (file == nullptr) { return true; }
+    bool ok = std::fclose(file) == 0;
+    file = nullptr;
+    return ok;
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    close();
+}
+
+/*  Method to write every body at once, for when they're already in memory
+ *      inputs:         the file, the bodies, the header (count, columns and offsets get filled in),
+ *                      and the bodies' timestep levels if this is a checkpoint
+ *      outputs:        false if the file couldn't be written
+ *      side effects:   the file's on the disk, not just in the page cache, by the time it returns
+ */
+bool write_snapshot(const std::string& path, const Bodies& bodies, SnapshotHeader header,
+                    const std::vector<uint8_t>* level) {
+    header.count = bodies.size();
+    header.columns = (level != nullptr) ? SNAPSHOT_CHECKPOINT_COLUMNS : SNAPSHOT_IC_COLUMNS;
+    const void* columns[SNAP_MAX_COLUMNS] = {
+        bodies.x.data(), bodies.y.data(), bodies.vx.data(), bodies.vy.data(), bodies.mass.data(),
+        bodies.ax.data(), bodies.ay.data(), (level != nullptr) ? level->data() : nullptr
+    };
+
+    SnapshotWriter writer;
+    if (!writer.open(path, header)) { return false; }
+    for (int c = 0; c < static_cast<int>(writer.header.columns); c++) {
+        if (!writer.write(c, 0, bodies.size(), columns[c])) { return false; }
+    }
+    if (!writer.sync()) {
+        fprintf(stderr, "Error: couldn't get %s onto the disk\n", path.c_str());
+        return false;
+    }
+    return writer.close();
+}
+
+// What keeps a mapped file mapped, until the last column looking into it lets go
+struct Mapping {
+    void* address;
+    std::size_t length;
+    Mapping(void* address, std::size_t length) : address(address), length(length) {}
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+    ~Mapping() { munmap(address, length); }
+};
+
+/*  Method to load a snapshot back in, by memory mapping it
+ *      inputs:         the file, where to put it
+ *      outputs:        false (with a message on stderr) if the file is missing, isn't a snapshot, or is cut short
+ *      side effects:   the snapshot's body columns become views into the mapping (see Snapshot)
+ */
+bool read_snapshot(const std::string& path, Snapshot& snapshot) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: couldn't open snapshot %s\n", path.c_str());
+        return false;
+    }
+    struct stat info {};
+    SnapshotHeader h;
+    const SnapshotHeader blank;
+    bool ok = fstat(fd, &info) == 0 &&
+              ::pread(fd, &h, sizeof(h), 0) == static_cast<ssize_t>(sizeof(h)) &&
+              std::memcmp(h.magic, blank.magic, sizeof(h.magic)) == 0 &&
+              h.version == SNAPSHOT_VERSION &&
+              h.columns >= SNAPSHOT_IC_COLUMNS && h.columns <= SNAP_MAX_COLUMNS;
+    if (!ok) {
+        fprintf(stderr, "Error: %s isn't a version %u snapshot\n", path.c_str(), SNAPSHOT_VERSION);
+        ::close(fd);
+        return false;
+    }
+    if (!columns_fit(h, static_cast<std::size_t>(info.st_size))) {
+        fprintf(stderr, "Error: snapshot %s is cut short or its column offsets are bad\n", path.c_str());
+        ::close(fd);
+        return false;
+    }
+
+    // private, so the simulation can write to the bodies where they are without changing the file
+    void* address = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        fprintf(stderr, "Error: couldn't map snapshot %s\n", path.c_str());
+        return false;
+    }
+    auto mapping = std::make_shared<Mapping>(address, static_cast<std::size_t>(info.st_size));
+    char* base = static_cast<char*>(address);
+
+    snapshot.header = h;
+    snapshot.bodies = Bodies();
+    Column* columns[SNAP_LEVEL] = {&snapshot.bodies.x, &snapshot.bodies.y, &snapshot.bodies.vx,
+                                   &snapshot.bodies.vy, &snapshot.bodies.mass, &snapshot.bodies.ax,
+                                   &snapshot.bodies.ay};
+    for (int c = 0; c < SNAP_LEVEL; c++) {
+        if (c < static_cast<int>(h.columns)) {
+            columns[c]->view(reinterpret_cast<double*>(base + h.column_offset[c]), h.count, mapping);
+        } else {
+            columns[c]->resize(h.count, 0.0);
+        }
+    }
+    snapshot.level.clear();
+    if (h.columns > SNAP_LEVEL) {
+        const uint8_t* level = reinterpret_cast<const uint8_t*>(base + h.column_offset[SNAP_LEVEL]);
+        snapshot.level.assign(level, level + h.count);
+    }
+    return true;
+}
+
+// fsyncs the directory a file is in, so a rename into it is on the disk too
+static bool sync_directory(const std::string& path) {
+    const std::size_t slash = path.find_last_of('/');
+    const std::string directory = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) { return false; }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+/*  Method to write a checkpoint in the background
+ *      inputs:         where it goes, its header, the bodies and their timestep levels
+ *      outputs:        none
+ *      side effects:   copies the bodies and levels, then starts the writing thread and returns
+ */
+void Checkpointer::save(const std::string& to, const SnapshotHeader& h, const Bodies& from,
+                        const std::vector<uint8_t>& levels) {
+    wait();
+    path = to;
+    header = h;
+    bodies = from;
+    level = levels;
+    writer = std::thread([this]() {
+        // the new file is synced before the rename and the directory after, so after a crash (or the power going)
+        // the name points at one whole checkpoint or the other, never one that's only partly on the disk
+        std::string temp = path + ".tmp";
+        if (!write_snapshot(temp, bodies, header, &level) || std::rename(temp.c_str(), path.c_str()) != 0 ||
+            !sync_directory(path)) {
+            fprintf(stderr, "Error: checkpoint at frame %llu didn't get written to %s\n",
+                    static_cast<unsigned long long>(header.frame), path.c_str());
+            std::remove(temp.c_str());
+        }
+    });
+}
+
+// Blocks until the last save() is on disk
+void Checkpointer::wait() {
+    if (writer.joinable()) { writer.join(); }
+}
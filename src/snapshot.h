@@ -0,0 +1,103 @@
+//
+// snapshot.h
+// Binary files of bodies: initial conditions, and checkpoints a run can be resumed from
+//
+
+#ifndef GPU_NBODY_SNAPSHOT_H
+#define GPU_NBODY_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include "quadtree.h"
+
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+constexpr std::size_t SNAPSHOT_ALIGN = 4096; // every column starts on a page boundary
+
+// The columns a snapshot can hold, in file order. initial conditions stop after mass, checkpoints have all of them
+enum SnapshotColumn {
+    SNAP_X, SNAP_Y, SNAP_VX, SNAP_VY, SNAP_MASS,
+    SNAP_AX, SNAP_AY,   // acceleration
+    SNAP_LEVEL,         // block timestep level, one byte per body (see Simulation::step)
+    SNAP_MAX_COLUMNS
+};
+constexpr int SNAPSHOT_IC_COLUMNS = SNAP_MASS + 1;
+constexpr int SNAPSHOT_CHECKPOINT_COLUMNS = SNAP_MAX_COLUMNS;
+
+// flags
+constexpr uint32_t SNAP_KICKED = 1; // the velocities are already half a step ahead (leapfrog started)
+
+/*  The start of the file. After it, each column is one raw array of count values (doubles, except the
+ *  level bytes, in this machine's byte order), starting column_offset[c] bytes into the file
+ *  Putting every column on a page boundary means it can be memory mapped and used right where it is
+ */
+struct SnapshotHeader {
+    char magic[8] = {'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P'};
+    uint32_t version = SNAPSHOT_VERSION;
+    uint32_t columns = SNAPSHOT_IC_COLUMNS; // how many of the columns are in the file
+    uint64_t count = 0;    // how many bodies
+    uint64_t seed = 0;     // the seed they were generated from, 0 if they weren't
+    uint64_t frame = 0;    // the frame they're at
+    double delta_t = 0;    // and the time per frame they were run with
+    uint32_t flags = 0;
+    uint32_t unused = 0;
+    uint64_t column_offset[SNAP_MAX_COLUMNS] = {};
+
+    void lay_out();        // fills in column_offset for count and columns
+    std::size_t file_size() const;
+};
+
+/*  Writes a snapshot a piece at a time, so the bodies never all have to be in memory at once
+ *  open() writes the header and sizes the file, then write() puts any run of any column in its place
+ */
+struct SnapshotWriter {
+    SnapshotHeader header;
+    std::FILE* file = nullptr;
+
+    bool open(const std::string& path, const SnapshotHeader& header);
+    bool write(int column, std::size_t first, std::size_t count, const void* values);
+    bool sync(); // everything written so far, all the way onto the disk
+    bool close();
+    ~SnapshotWriter();
+};
+
+/*  A snapshot loaded back in. The body columns are views straight into the mapped file (copy on
+ *  write, so changing them never touches the file), so even 1e8 bodies load in about the time it
+ *  takes to open the file. pages only get read in when something touches them
+ */
+struct Snapshot {
+    SnapshotHeader header;
+    Bodies bodies;              // accelerations are zero if the file doesn't have them
+    std::vector<uint8_t> level; // empty if the file doesn't have them
+};
+
+bool write_snapshot(const std::string& path, const Bodies& bodies, SnapshotHeader header,
+                    const std::vector<uint8_t>* level = nullptr);
+bool read_snapshot(const std::string& path, Snapshot& snapshot);
+
+/*  Writes checkpoints on a thread of its own, so the simulation doesn't wait on the disk
+ *  save() copies what it needs (so the simulation can carry on changing it) and hands that to the
+ *  thread. The file is written next to the real one, fsynced, and renamed over it at the end, so a
+ *  crash (even losing power) partway through leaves the last good checkpoint alone. If the last save is still going, save()
+ *  waits for it first
+ */
+struct Checkpointer {
+    std::thread writer;
+    Bodies bodies;
+    std::vector<uint8_t> level;
+    SnapshotHeader header;
+    std::string path;
+
+    Checkpointer() = default;
+    Checkpointer(const Checkpointer&) : Checkpointer() {} // a copy doesn't take over someone else's save
+    Checkpointer& operator=(const Checkpointer&) { return *this; }
+    ~Checkpointer() { wait(); }
+
+    void save(const std::string& path, const SnapshotHeader& header, const Bodies& bodies,
+              const std::vector<uint8_t>& level);
+    void wait();
+};
+
+#endif //GPU_NBODY_SNAPSHOT_H
@@ -0,0 +1,103 @@
+//
+// telemetry.cpp
+// Writing the telemetry lines, see telemetry.h
+//
+#include <cstdlib>
+#include <omp.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+#include "simulation.h"
+#include "render.h"
+
+// ## IMPLEMENTATION FILE ##
+
+#if TELEMETRY
+
+bool Telemetry::open(const std::string& target) {
+    close();
+    if (target.empty()) { return true; }
+    if (target.rfind("fd:", 0) == 0) {
+        // our own copy of it, so closing ours leaves theirs (stdout, say) alone
+        const int fd = dup(std::atoi(target.c_str() + 3));
+        file = (fd >= 0) ? fdopen(fd, "w") : nullptr;
+    } else {
+        file = std::fopen(target.c_str(), "w");
+    }
+    if (!file) {
+        fprintf(stderr, "Error: couldn't open %s for the telemetry\n", target.c_str());
+        return false;
+    }
+    opened = omp_get_wtime();
+    return true;
+}
+
+void Telemetry::close() {
+    if (!file) { return; }
+    char text[64];
+    int length = snprintf(text, sizeof(text), "{\"type\":\"end\",\"t\":%.3f}\n", omp_get_wtime() - opened);
+    line(text, length);
+    std::fclose(file);
+    file = nullptr;
+}
+
+void Telemetry::line(const char* text, int length) {
+    if (length <= 0) { return; }
+    std::lock_guard<std::mutex> hold(lock);
+    std::fwrite(text, 1, static_cast<std::size_t>(length), file);
+    std::fflush(file);
+}
+
+void Telemetry::start(const Simulation& sim) {
+    if (!file) { return; }
+    substeps = sim.substeps;
+    force_evals = sim.force_evals;
+    interactions = sim.interactions;
+    char text[256];
+    int length = snprintf(text, sizeof(text),
+                          "{\"type\":\"start\",\"t\":%.3f,\"frame\":%zu,\"bodies\":%zu,\"threads\":%d,\"solver\":%d,"
+                          "\"width\":%d,\"height\":%d}\n",
+                          omp_get_wtime() - opened, sim.frame, sim.bodies.size(), omp_get_max_threads(),
+                          static_cast<int>(sim.solver), sim.config.width, sim.config.height);
+    line(text, length);
+}
+
+/*  Method to write the line for the step the simulation just took
+ *      inputs:         the simulation, right after step()
+ *      outputs:        none
+ *      side effects:   writes a line, remembers the running totals for the next one
+ *
+ *  depth() goes over every node once, which is nothing next to a step but isn't free either, so it
+ *  only happens with the telemetry on
+ */
+void Telemetry::step(const Simulation& sim) {
+    if (!file) { return; }
+    const StepTimes& ms = sim.last_times;
+    const std::size_t evals = sim.force_evals - force_evals;
+    const double per_body = (evals > 0) ? static_cast<double>(sim.interactions - interactions) / evals : 0;
+    char text[512];
+    int length = snprintf(text, sizeof(text),
+                          "{\"type\":\"step\",\"frame\":%zu,\"t\":%.3f,\"ms\":{\"iterate\":%.3f,\"bounds\":%.3f,"
+                          "\"build\":%.3f,\"propagate\":%.3f,\"force\":%.3f,\"tune\":%.3f},\"substeps\":%zu,\"force_evals\":%zu,"
+                          "\"nodes\":%zu,\"depth\":%zu,\"interactions_per_body\":%.1f,\"theta\":%.3g,\"leaf_capacity\":%zu}\n",
+                          sim.frame, omp_get_wtime() - opened, ms.iterate * 1e3, ms.bounds * 1e3, ms.build * 1e3,
+                          ms.propagate * 1e3, ms.force * 1e3, ms.tune * 1e3, sim.substeps - substeps,
+                          evals, sim.ygg.nodes.size(), sim.ygg.depth(), per_body, sim.ygg.theta, sim.ygg.leaf_capacity);
+    substeps = sim.substeps;
+    force_evals = sim.force_evals;
+    interactions = sim.interactions;
+    line(text, length);
+}
+
+void Telemetry::frame(int step, const FrameTimes& times, std::size_t dots) {
+    if (!file) { return; }
+    char text[256];
+    int length = snprintf(text, sizeof(text),
+                          "{\"type\":\"frame\",\"frame\":%d,\"t\":%.3f,\"ms\":{\"fill\":%.3f,\"clear\":%.3f,"
+                          "\"splat\":%.3f,\"tonemap\":%.3f,\"write\":%.3f},\"dots\":%zu}\n",
+                          step, omp_get_wtime() - opened, times.fill * 1e3, times.clear * 1e3, times.splat * 1e3,
+                          times.tonemap * 1e3, times.write * 1e3, dots);
+    line(text, length);
+}
+
+#endif
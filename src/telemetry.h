@@ -0,0 +1,67 @@
+//
+// telemetry.h
+// A running record of where a run's time goes, for programs to read: one JSON object per line
+//
+
+#ifndef GPU_NBODY_TELEMETRY_H
+#define GPU_NBODY_TELEMETRY_H
+
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include "Constants.h"
+
+struct Simulation;
+struct FrameTimes;
+
+/*  Writes the telemetry. open() takes where to:
+ *      ""          nowhere, and every other call does nothing
+ *      "fd:N"      file descriptor N, already open (a pipe from whatever started us, say)
+ *      anything    else a file, started over
+ *  and then there's a line for each of these (times in ms, t in seconds since open()):
+ *      {"type":"start","t":0,"bodies":100000,"threads":8,"solver":0,"width":2048,"height":2048}
+ *      {"type":"step","frame":1,"t":0.52,"ms":{"iterate":..,"bounds":..,"build":..,"propagate":..,"force":..,"tune":..},
+ *       "substeps":4,"force_evals":..,"nodes":..,"depth":..,"interactions_per_body":..,"theta":1,"leaf_capacity":16}
+ *      {"type":"frame","frame":1,"t":0.61,"ms":{"fill":..,"clear":..,"splat":..,"tonemap":..,"write":..},"dots":..}
+ *      {"type":"end","t":..}
+ *  step lines come from the simulation's thread and frame lines from the drawing thread, so a frame's
+ *  line can come after the next step's. Each line is put together first and written whole under a
+ *  lock, then flushed, so whoever's reading gets it straight away and never half of one
+ *  Built with TELEMETRY 0 (cmake -DTELEMETRY=OFF) all of it is empty, and calls to it compile away
+ */
+struct Telemetry {
+#if TELEMETRY
+    Telemetry() = default;
+    Telemetry(const Telemetry&) = delete;
+    Telemetry& operator=(const Telemetry&) = delete;
+    ~Telemetry() { close(); }
+
+    bool open(const std::string& target);
+    bool enabled() const { return file != nullptr; }
+    void start(const Simulation& sim);
+    void step(const Simulation& sim);
+    void frame(int step, const FrameTimes& times, std::size_t dots);
+    void close();
+
+private:
+    std::FILE* file = nullptr;
+    std::mutex lock;
+    double opened = 0;
+    // the simulation's running totals as of the last step line, so each line can have just its own step's
+    std::size_t substeps = 0;
+    std::size_t force_evals = 0;
+    std::size_t interactions = 0;
+
+    void line(const char* text, int length);
+#else
+    bool open(const std::string&) { return true; }
+    bool enabled() const { return false; }
+    void start(const Simulation&) {}
+    void step(const Simulation&) {}
+    void frame(int, const FrameTimes&, std::size_t) {}
+    void close() {}
+#endif
+};
+
+#endif //GPU_NBODY_TELEMETRY_H
@@ -0,0 +1,517 @@
+//
+// trajectory.cpp
+// Writing and reading compressed trajectories, see trajectory.h
+//
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include <unistd.h>
+
+#include "trajectory.h"
+
+// ## IMPLEMENTATION FILE ##
+
+/*  How a frame gets squeezed: every quantized value (x, y, vx, vy of every body) is stored as how far
+ *  off a guess it is. The guess for the first frame of a block is the middle of the range, for the
+ *  second it's the first (where the body was), and after that it's carrying on in a straight line from
+ *  the two before (2 * last - the one before that). Bodies move smoothly, so that's usually close and
+ *  the differences are small numbers. Those get zigzagged (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) and
+ *  written 7 bits to a byte, so a small difference takes one or two bytes instead of eight.
+ *  Everything's done on the integers, so reading it back gives exactly the same guesses
+ */
+static int64_t guess(std::size_t k, int64_t before, int64_t before_that, int64_t mid) {
+    if (k == 0) { return mid; }
+    if (k == 1) { return before; }
+    return 2 * before - before_that;
+}
+
+static void put_varint(std::vector<uint8_t>& out, int64_t value) {
+    uint64_t zigzag = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    while (zigzag >= 0x80) {
+        out.push_back(static_cast<uint8_t>(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(zigzag));
+}
+
+// false if the bytes run out partway through a number
+static bool get_varint(const uint8_t*& at, const uint8_t* end, int64_t& value) {
+    uint64_t zigzag = 0;
+    for (int shift = 0; at < end && shift < 64; shift += 7) {
+        uint8_t byte = *at++;
+        zigzag |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// One of the four quantities of every body in a frame, k frames into its block
+template <typename T>
+static void encode_channel(std::vector<uint8_t>& out, std::size_t k, int64_t mid, const std::vector<T>& now,
+                           const std::vector<T>& before, const std::vector<T>& before_that) {
+    for (std::size_t i = 0; i < now.size(); i++) {
+        int64_t expected = guess(k, k > 0 ? before[i] : 0, k > 1 ? before_that[i] : 0, mid);
+        put_varint(out, static_cast<int64_t>(now[i]) - expected);
+    }
+}
+
+template <typename T>
+static bool decode_channel(const uint8_t*& at, const uint8_t* end, std::size_t k, int64_t mid, std::vector<T>& now,
+                           const std::vector<T>& before, const std::vector<T>& before_that) {
+    for (std::size_t i = 0; i < now.size(); i++) {
+        int64_t difference;
+        if (!get_varint(at, end, difference)) { return false; }
+        now[i] = static_cast<T>(guess(k, k > 0 ? before[i] : 0, k > 1 ? before_that[i] : 0, mid) + difference);
+    }
+    return true;
+}
+
+// the largest value b bits hold, as a double for scaling with
+static double steps(uint32_t bits) {
+    return static_cast<double>((uint64_t(1) << bits) - 1);
+}
+
+// false (with a message on stderr) if the header asks for more bits than a frame has room for
+static bool bits_fit(const TrajectoryHeader& header) {
+    if (header.position_bits < 1 || header.position_bits > 32 || header.velocity_bits < 1 || header.velocity_bits > 16) {
+        fprintf(stderr, "Error: trajectories take 1 to 32 bits for positions and 1 to 16 for velocities\n");
+        return false;
+    }
+    return true;
+}
+
+/*  Method to start a trajectory file
+ *      inputs:         where to write it, its header (count gets filled in), every body's mass,
+ *                      whether it can replace a file that's already there
+ *      outputs:        false (with a message on stderr) if the file couldn't be made, is already there
+ *                      and overwrite wasn't given, or the header's bits don't fit
+ *      side effects:   writes the header and masses, starts the writing thread
+ */
+bool TrajectoryWriter::open(const std::string& to, const TrajectoryHeader& h, const Column& mass, bool overwrite) {
+    close();
+    header = h;
+    header.count = mass.size();
+    if (!bits_fit(header)) { return false; }
+    // "x" fails if it's there already, instead of quietly starting it over
+    file = std::fopen(to.c_str(), overwrite ? "wb" : "wbx");
+    if (file == nullptr) {
+        std::FILE* there = overwrite ? nullptr : std::fopen(to.c_str(), "rb");
+        if (there != nullptr) {
+            std::fclose(there);
+            fprintf(stderr, "Error: trajectory %s is already there (resume into it, or set trajectory_overwrite)\n",
+                    to.c_str());
+        } else {
+            fprintf(stderr, "Error: couldn't create %s\n", to.c_str());
+        }
+        return false;
+    }
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1 ||
+        std::fwrite(mass.data(), sizeof(double), mass.size(), file) != mass.size()) {
+        fprintf(stderr, "Error: couldn't write %s\n", to.c_str());
+        std::fclose(file);
+        file = nullptr;
+        return false;
+    }
+    grid_frames = 0;
+    block_frame_numbers.clear();
+    block_bytes.clear();
+    index.clear();
+    start(to);
+    return true;
+}
+
+/*  Method to carry on a trajectory from a run that's being resumed from a checkpoint
+ *      inputs:         the file, a header like open() takes, every body's mass, the checkpoint's frame
+ *      outputs:        false (with a message on stderr) if the file's for different bodies or bits, or is damaged
+ *      side effects:   everything after the checkpoint's frame gets cut off the file (those frames are about to be
+ *                      made again), along with the index. the block the last kept frame is in is read back in
+ *                      and left open, so the next frames can carry on in it. no file yet means a new one
+ */
+bool TrajectoryWriter::resume(const std::string& to, const TrajectoryHeader& h, const Column& mass, std::size_t frame) {
+    close();
+    std::FILE* there = std::fopen(to.c_str(), "rb");
+    if (there == nullptr) { return open(to, h, mass); }
+    std::fclose(there);
+
+    header = h;
+    header.count = mass.size();
+    if (!bits_fit(header)) { return false; }
+    uint64_t cut = sizeof(TrajectoryHeader) + header.count * sizeof(double);
+    grid_frames = 0;
+    block_frame_numbers.clear();
+    block_bytes.clear();
+    index.clear();
+    {
+        TrajectoryReader old;
+        if (!old.open(to)) { return false; }
+        if (old.header.count != header.count || old.header.position_bits != header.position_bits ||
+            old.header.velocity_bits != header.velocity_bits) {
+            fprintf(stderr, "Error: trajectory %s is of different bodies or bits, it can't be carried on\n", to.c_str());
+            return false;
+        }
+        header = old.header;
+
+        // the frames the checkpoint had already been through, and the block the last of them is in
+        auto after = std::upper_bound(old.index.begin(), old.index.end(), frame,
+                                      [](std::size_t f, const TrajectoryIndexEntry& e) { return f < e.frame; });
+        if (after != old.index.begin()) {
+            const TrajectoryIndexEntry last = *(after - 1);
+            TrajectoryFrame older;
+            if (!old.decode(last, block, block_bytes, before, before_that, older)) {
+                fprintf(stderr, "Error: frame %llu of trajectory %s is damaged, it can't be carried on\n",
+                        static_cast<unsigned long long>(last.frame), to.c_str());
+                return false;
+            }
+            cut = last.block_offset;
+            for (auto entry = old.index.begin(); entry != after; ++entry) {
+                if (entry->block_offset < cut) {
+                    index.push_back(*entry);
+                } else {
+                    block_frame_numbers.push_back(entry->frame);
+                }
+            }
+            grid = block;
+            grid_frames = block_frame_numbers.size();
+        }
+    }
+
+    file = std::fopen(to.c_str(), "r+b");
+    if (file == nullptr || std::fflush(file) != 0 || ftruncate(fileno(file), static_cast<off_t>(cut)) != 0 ||
+        std::fseek(file, static_cast<long>(cut), SEEK_SET) != 0) {
+        fprintf(stderr, "Error: couldn't cut trajectory %s back to frame %zu\n", to.c_str(), frame);
+        if (file != nullptr) { std::fclose(file); }
+        file = nullptr;
+        return false;
+    }
+    start(to);
+    printf("Carrying on trajectory %s after frame %zu\n", to.c_str(), frame);
+    return true;
+}
+
+// Starts the writing thread on the file that's just been opened
+void TrajectoryWriter::start(const std::string& to) {
+    path = to;
+    closing = false;
+    failed = false;
+    pending.clear();
+    writer = std::thread(&TrajectoryWriter::write_frames, this);
+}
+
+/*  Method to add the bodies as they are now to the trajectory
+ *      inputs:         the bodies, which frame it is
+ *      outputs:        none
+ *      side effects:   quantizes them and queues them for the writing thread. waits if it's max_pending behind
+ *
+ *  the grid is the root Quad (the smallest square around every body) made TRAJECTORY_MARGIN times bigger,
+ *  and kept for the whole block so the guesses line up. once a body gets out of it, or one goes
+ *  faster than the block's vmax, it's time for a new block
+ */
+void TrajectoryWriter::record(const Bodies& bodies, std::size_t frame) {
+    if (file == nullptr) { return; }
+    const std::size_t n = bodies.size();
+    Quad root;
+    root.new_containing(bodies);
+    double vmax = 0;
+    #pragma omp parallel for reduction(max:vmax)
+    for (std::size_t i = 0; i < n; i++) {
+        vmax = std::max(vmax, std::max(std::abs(bodies.vx[i]), std::abs(bodies.vy[i])));
+    }
+
+    const double half = 0.5 * root.length;
+    const bool fits = grid_frames > 0 && grid_frames < block_frames && vmax <= grid.vmax &&
+                      root.center.x - half >= grid.lo_x && root.center.x + half <= grid.lo_x + grid.span &&
+                      root.center.y - half >= grid.lo_y && root.center.y + half <= grid.lo_y + grid.span;
+    TrajectoryFrame out;
+    out.frame = frame;
+    out.starts_block = !fits;
+    if (!fits) {
+        grid = TrajectoryBlock();
+        grid.span = (root.length > 0) ? root.length * TRAJECTORY_MARGIN : 1.0;
+        grid.lo_x = root.center.x - 0.5 * grid.span;
+        grid.lo_y = root.center.y - 0.5 * grid.span;
+        grid.vmax = (vmax > 0) ? vmax * TRAJECTORY_MARGIN : 1.0;
+        grid_frames = 0;
+        out.grid = grid;
+    }
+    grid_frames++;
+
+    const double position_steps = steps(header.position_bits);
+    const double velocity_steps = steps(header.velocity_bits);
+    const double position_scale = position_steps / grid.span;
+    const double velocity_scale = velocity_steps / (2 * grid.vmax);
+    auto on_grid = [](double value, double top) {
+        return std::llround(std::min(std::max(value, 0.0), top));
+    };
+    out.x.resize(n);
+    out.y.resize(n);
+    out.vx.resize(n);
+    out.vy.resize(n);
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        out.x[i] = static_cast<uint32_t>(on_grid((bodies.x[i] - grid.lo_x) * position_scale, position_steps));
+        out.y[i] = static_cast<uint32_t>(on_grid((bodies.y[i] - grid.lo_y) * position_scale, position_steps));
+        out.vx[i] = static_cast<uint16_t>(on_grid((bodies.vx[i] + grid.vmax) * velocity_scale, velocity_steps));
+        out.vy[i] = static_cast<uint16_t>(on_grid((bodies.vy[i] + grid.vmax) * velocity_scale, velocity_steps));
+    }
+
+    {
+        std::unique_lock<std::mutex> hold(lock);
+        changed.wait(hold, [this]() { return pending.size() < max_pending; });
+        pending.push_back(std::move(out));
+    }
+    changed.notify_all();
+}
+
+// What the writing thread runs: takes frames off the queue and encodes them, until close() and the queue's empty
+void TrajectoryWriter::write_frames() {
+    while (true) {
+        TrajectoryFrame frame;
+        {
+            std::unique_lock<std::mutex> hold(lock);
+            changed.wait(hold, [this]() { return !pending.empty() || closing; });
+            if (pending.empty()) { break; }
+            frame = std::move(pending.front());
+            pending.pop_front();
+        }
+        changed.notify_all(); // there's room for record() again
+
+        if (frame.starts_block) {
+            flush_block();
+            block = frame.grid;
+        }
+        encode(frame);
+    }
+    flush_block();
+}
+
+// Adds one frame onto the block being filled, as differences from the guesses
+void TrajectoryWriter::encode(TrajectoryFrame& frame) {
+    const std::size_t k = block_frame_numbers.size();
+    const int64_t position_mid = int64_t(1) << (header.position_bits - 1);
+    const int64_t velocity_mid = int64_t(1) << (header.velocity_bits - 1);
+    encode_channel(block_bytes, k, position_mid, frame.x, before.x, before_that.x);
+    encode_channel(block_bytes, k, position_mid, frame.y, before.y, before_that.y);
+    encode_channel(block_bytes, k, velocity_mid, frame.vx, before.vx, before_that.vx);
+    encode_channel(block_bytes, k, velocity_mid, frame.vy, before.vy, before_that.vy);
+    block_frame_numbers.push_back(frame.frame);
+    std::swap(before_that, before);
+    before = std::move(frame);
+}
+
+/*  Method to write out the block that's been filling up, if there's anything in it
+ *  outputs:        false if the write failed (which also gets remembered for close())
+ *  side effects:   one index entry per frame in it
+ */
+bool TrajectoryWriter::flush_block() {
+    if (block_frame_numbers.empty()) { return true; }
+    block.frames = static_cast<uint32_t>(block_frame_numbers.size());
+    block.bytes = block_bytes.size();
+    const long offset = std::ftell(file);
+    bool ok = offset >= 0 &&
+              std::fwrite(&block, sizeof(block), 1, file) == 1 &&
+              std::fwrite(block_frame_numbers.data(), sizeof(uint64_t), block.frames, file) == block.frames &&
+              std::fwrite(block_bytes.data(), 1, block_bytes.size(), file) == block_bytes.size();
+    if (ok) {
+        for (uint32_t k = 0; k < block.frames; k++) {
+            TrajectoryIndexEntry entry;
+            entry.frame = block_frame_numbers[k];
+            entry.block_offset = static_cast<uint64_t>(offset);
+            entry.in_block = k;
+            index.push_back(entry);
+        }
+    } else if (!failed) {
+        fprintf(stderr, "Error: couldn't write frames %llu to %llu of %s\n",
+                static_cast<unsigned long long>(block_frame_numbers.front()),
+                static_cast<unsigned long long>(block_frame_numbers.back()), path.c_str());
+    }
+    failed = failed || !ok;
+    block_frame_numbers.clear();
+    block_bytes.clear();
+    return ok;
+}
+
+/*  Method to finish the file
+ *      outputs:        false if anything along the way didn't get written
+ *      side effects:   waits for the writing thread to get through the queue, writes the index and the footer
+ */
+bool TrajectoryWriter::close() {
+    if (file == nullptr) { return true; }
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        closing = true;
+    }
+    changed.notify_all();
+    if (writer.joinable()) { writer.join(); }
+
+    TrajectoryFooter footer;
+    const long offset = std::ftell(file);
+    footer.index_offset = static_cast<uint64_t>(offset);
+    footer.entries = index.size();
+    bool ok = !failed && offset >= 0 &&
+              std::fwrite(index.data(), sizeof(TrajectoryIndexEntry), index.size(), file) == index.size() &&
+              std::fwrite(&footer, sizeof(footer), 1, file) == 1;
+    ok = (std::fclose(file) == 0) && ok;
+    file = nullptr;
+    if (!ok) { fprintf(stderr, "Error: trajectory %s didn't get finished\n", path.c_str()); }
+    return ok;
+}
+
+TrajectoryReader::~TrajectoryReader() {
+    if (file != nullptr) { std::fclose(file); }
+}
+
+/*  Method to open a trajectory for reading
+ *      inputs:         the file
+ *      outputs:        false (with a message on stderr) if it's missing or isn't a trajectory
+ *      side effects:   header, mass and index get filled in. the index is read off the end of the file,
+ *                      or if it isn't there (the run was killed) rebuilt from the blocks that made it out whole
+ */
+bool TrajectoryReader::open(const std::string& path) {
+    if (file != nullptr) { std::fclose(file); }
+    file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Error: couldn't open trajectory %s\n", path.c_str());
+        return false;
+    }
+    const TrajectoryHeader blank;
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+              std::memcmp(header.magic, blank.magic, sizeof(header.magic)) == 0 &&
+              header.version == TRAJECTORY_VERSION;
+    if (ok) {
+        mass.resize(header.count);
+        ok = std::fread(mass.data(), sizeof(double), header.count, file) == header.count;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: %s isn't a version %u trajectory\n", path.c_str(), TRAJECTORY_VERSION);
+        return false;
+    }
+    const uint64_t blocks_start = sizeof(TrajectoryHeader) + header.count * sizeof(double);
+
+    std::fseek(file, 0, SEEK_END);
+    const uint64_t size = static_cast<uint64_t>(std::ftell(file));
+    TrajectoryFooter footer;
+    const TrajectoryFooter blank_footer;
+    index.clear();
+    if (size >= blocks_start + sizeof(footer) &&
+        std::fseek(file, static_cast<long>(size - sizeof(footer)), SEEK_SET) == 0 &&
+        std::fread(&footer, sizeof(footer), 1, file) == 1 &&
+        std::memcmp(footer.magic, blank_footer.magic, sizeof(footer.magic)) == 0 &&
+        footer.index_offset + footer.entries * sizeof(TrajectoryIndexEntry) + sizeof(footer) == size) {
+        index.resize(footer.entries);
+        if (std::fseek(file, static_cast<long>(footer.index_offset), SEEK_SET) == 0 &&
+            std::fread(index.data(), sizeof(TrajectoryIndexEntry), index.size(), file) == index.size()) {
+            return true;
+        }
+        index.clear();
+    }
+    scan_blocks(blocks_start, size);
+    return true;
+}
+
+/*  Method to decode a frame, the quantized way it was stored
+ *      inputs:         its index entry, and where to put the results
+ *      outputs:        false if its block is damaged or cut short
+ *      side effects:   block gets the block's header, bytes its encoded frames up to the end of this one, and
+ *                      now, before and before_that this frame and the two before it in the block (as many as there are)
+ */
+bool TrajectoryReader::decode(const TrajectoryIndexEntry& entry, TrajectoryBlock& block, std::vector<uint8_t>& bytes,
+                              TrajectoryFrame& now, TrajectoryFrame& before, TrajectoryFrame& before_that) {
+    bool ok = std::fseek(file, static_cast<long>(entry.block_offset), SEEK_SET) == 0 &&
+              std::fread(&block, sizeof(block), 1, file) == 1 &&
+              entry.in_block < block.frames &&
+              std::fseek(file, static_cast<long>(block.frames * sizeof(uint64_t)), SEEK_CUR) == 0;
+    if (ok) {
+        bytes.resize(block.bytes);
+        ok = std::fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    }
+
+    // every frame from the start of the block up to this one, each guessed from the two before it
+    const std::size_t n = header.count;
+    const int64_t position_mid = int64_t(1) << (header.position_bits - 1);
+    const int64_t velocity_mid = int64_t(1) << (header.velocity_bits - 1);
+    now = before = before_that = TrajectoryFrame();
+    const uint8_t* at = bytes.data();
+    const uint8_t* end = bytes.data() + bytes.size();
+    for (std::size_t k = 0; ok && k <= entry.in_block; k++) {
+        std::swap(before_that, before);
+        std::swap(before, now);
+        now.x.resize(n);
+        now.y.resize(n);
+        now.vx.resize(n);
+        now.vy.resize(n);
+        ok = decode_channel(at, end, k, position_mid, now.x, before.x, before_that.x) &&
+             decode_channel(at, end, k, position_mid, now.y, before.y, before_that.y) &&
+             decode_channel(at, end, k, velocity_mid, now.vx, before.vx, before_that.vx) &&
+             decode_channel(at, end, k, velocity_mid, now.vy, before.vy, before_that.vy);
+    }
+    if (!ok) { return false; }
+    bytes.resize(static_cast<std::size_t>(at - bytes.data()));
+    return true;
+}
+
+// Rebuilds the index by hopping from block to block, stopping at the first one that's cut short
+void TrajectoryReader::scan_blocks(uint64_t offset, uint64_t end) {
+    const TrajectoryBlock blank;
+    std::vector<uint64_t> numbers;
+    while (offset + sizeof(TrajectoryBlock) <= end) {
+        TrajectoryBlock block;
+        if (std::fseek(file, static_cast<long>(offset), SEEK_SET) != 0 ||
+            std::fread(&block, sizeof(block), 1, file) != 1 ||
+            std::memcmp(block.magic, blank.magic, sizeof(block.magic)) != 0) {
+            break;
+        }
+        const uint64_t next = offset + sizeof(block) + block.frames * sizeof(uint64_t) + block.bytes;
+        numbers.resize(block.frames);
+        if (next > end || std::fread(numbers.data(), sizeof(uint64_t), block.frames, file) != block.frames) { break; }
+        for (uint32_t k = 0; k < block.frames; k++) {
+            TrajectoryIndexEntry entry;
+            entry.frame = numbers[k];
+            entry.block_offset = offset;
+            entry.in_block = k;
+            index.push_back(entry);
+        }
+        offset = next;
+    }
+}
+
+/*  Method to get the bodies as they were at some frame
+ *      inputs:         the frame number (one of index[].frame), where to put the bodies
+ *      outputs:        false (with a message on stderr) if that frame isn't in the file or is damaged
+ *      side effects:   bodies gets position, velocity and mass. accelerations aren't stored, they come back zero
+ */
+bool TrajectoryReader::read(std::size_t frame, Bodies& bodies) {
+    auto entry = std::lower_bound(index.begin(), index.end(), frame,
+                                  [](const TrajectoryIndexEntry& e, std::size_t f) { return e.frame < f; });
+    if (entry == index.end() || entry->frame != frame) {
+        fprintf(stderr, "Error: frame %zu isn't in the trajectory\n", frame);
+        return false;
+    }
+    TrajectoryBlock block;
+    std::vector<uint8_t> bytes;
+    TrajectoryFrame now, before, before_that;
+    if (!decode(*entry, block, bytes, now, before, before_that)) {
+        fprintf(stderr, "Error: frame %zu of the trajectory is damaged\n", frame);
+        return false;
+    }
+    const std::size_t n = header.count;
+
+    const double position_step = block.span / steps(header.position_bits);
+    const double velocity_step = 2 * block.vmax / steps(header.velocity_bits);
+    bodies.resize(n);
+    #pragma omp parallel for
+    for (std::size_t i = 0; i < n; i++) {
+        bodies.x[i] = block.lo_x + now.x[i] * position_step;
+        bodies.y[i] = block.lo_y + now.y[i] * position_step;
+        bodies.vx[i] = now.vx[i] * velocity_step - block.vmax;
+        bodies.vy[i] = now.vy[i] * velocity_step - block.vmax;
+        bodies.ax[i] = 0;
+        bodies.ay[i] = 0;
+        bodies.mass[i] = mass[i];
+    }
+    return true;
+}
@@ -0,0 +1,153 @@
+//
+// trajectory.h
+// Compressed streams of body positions and velocities, written every few frames for looking at afterwards
+//
+
+#ifndef GPU_NBODY_TRAJECTORY_H
+#define GPU_NBODY_TRAJECTORY_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "quadtree.h"
+
+constexpr uint32_t TRAJECTORY_VERSION = 1;
+constexpr double TRAJECTORY_MARGIN = 1.25; // how much bigger a block's grid is than the bodies when it starts
+
+/*  The start of the file, followed by every body's mass (count doubles, they don't change) and then
+ *  the blocks. Positions are stored as position_bits fixed point on a square grid over the root Quad,
+ *  velocities as velocity_bits fixed point between -vmax and vmax
+ */
+struct TrajectoryHeader {
+    char magic[8] = {'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J'};
+    uint32_t version = TRAJECTORY_VERSION;
+    uint32_t position_bits = TRAJECTORY_POSITION_BITS; // at most 32
+    uint32_t velocity_bits = TRAJECTORY_VELOCITY_BITS; // at most 16
+    uint32_t unused = 0;
+    uint64_t count = 0;  // how many bodies
+    uint64_t seed = 0;   // the seed they were generated from, 0 if they weren't
+    double delta_t = 0;  // time per frame
+};
+
+/*  A run of frames that share one grid, so each can be stored as how far it is off a guess made from
+ *  the frames before it (those numbers are small, and small numbers take few bytes, see trajectory.cpp)
+ *  The first frame of a block doesn't lean on anything before it, which is what makes seeking work.
+ *  Followed by the frame numbers (frames uint64s), then bytes of encoded frames
+ */
+struct TrajectoryBlock {
+    char magic[4] = {'B', 'L', 'O', 'K'};
+    uint32_t frames = 0;
+    uint64_t bytes = 0;   // size of the encoded frames
+    double lo_x = 0;      // the grid: bottom left corner
+    double lo_y = 0;
+    double span = 0;      // and side length
+    double vmax = 0;      // velocities go from -vmax to vmax
+};
+
+// One line of the index at the end of the file, one per frame: which block it's in and how far into it
+struct TrajectoryIndexEntry {
+    uint64_t frame = 0;
+    uint64_t block_offset = 0; // of its TrajectoryBlock, from the start of the file
+    uint32_t in_block = 0;     // 0 for the block's first frame
+    uint32_t unused = 0;
+};
+
+// The very end of the file, pointing back at the index
+struct TrajectoryFooter {
+    uint64_t index_offset = 0;
+    uint64_t entries = 0;
+    char magic[8] = {'N', 'B', 'O', 'D', 'Y', 'I', 'D', 'X'};
+};
+
+// One frame, quantized onto its block's grid and waiting for the writing thread
+struct TrajectoryFrame {
+    uint64_t frame = 0;
+    bool starts_block = false;
+    TrajectoryBlock grid;             // the block's grid, only looked at when starts_block
+    std::vector<uint32_t> x, y;       // positions on the grid
+    std::vector<uint16_t> vx, vy;     // and velocities
+};
+
+/*  Writes the trajectory of a run, a frame at a time, without holding the simulation up
+ *  record() just works out the grid (a new block whenever a body leaves the current one, or the block's
+ *  full) and quantizes the bodies onto it, in parallel. Guessing each frame from the ones before it,
+ *  packing the result into bytes and writing it all happen on the writing thread. If that falls more
+ *  than a couple of frames behind, record() waits for it, so memory can't run away
+ *  close() (or the destructor) finishes the last block and writes the index
+ *  open() won't replace a file that's already there unless it's told to. A run resumed from a checkpoint
+ *  uses resume() instead, which keeps the frames up to the checkpoint's and carries on after them
+ */
+struct TrajectoryWriter {
+    TrajectoryHeader header;
+    std::size_t block_frames = TRAJECTORY_BLOCK; // most frames in one block
+    std::size_t max_pending = 2;                 // frames record() can get ahead of the writing thread
+
+    TrajectoryWriter() = default;
+    TrajectoryWriter(const TrajectoryWriter&) : TrajectoryWriter() {} // a copy doesn't write into someone else's file
+    TrajectoryWriter& operator=(const TrajectoryWriter&) { return *this; }
+    ~TrajectoryWriter() { close(); }
+
+    bool open(const std::string& path, const TrajectoryHeader& header, const Column& mass, bool overwrite = false);
+    bool resume(const std::string& path, const TrajectoryHeader& header, const Column& mass, std::size_t frame);
+    bool is_open() const { return file != nullptr; }
+    void record(const Bodies& bodies, std::size_t frame);
+    bool close();
+
+private:
+    std::FILE* file = nullptr;
+    std::string path;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<TrajectoryFrame> pending;
+    bool closing = false;
+    bool failed = false;
+
+    // the block record() is filling (the grid side of it)
+    TrajectoryBlock grid;
+    std::size_t grid_frames = 0;
+
+    // the block the writing thread is filling
+    TrajectoryBlock block;
+    std::vector<uint64_t> block_frame_numbers;
+    std::vector<uint8_t> block_bytes;
+    TrajectoryFrame before, before_that; // the last two frames of it, for the guesses
+    std::vector<TrajectoryIndexEntry> index;
+
+    void start(const std::string& to);
+    void write_frames();
+    void encode(TrajectoryFrame& frame);
+    bool flush_block();
+};
+
+/*  Reads a trajectory back. open() reads the header, the masses and the index (or if the run never got
+ *  to write one, finds the blocks itself), then read() can jump straight to any frame: it decodes from
+ *  the start of that frame's block, so never more than a block's worth of frames
+ */
+struct TrajectoryReader {
+    TrajectoryHeader header;
+    std::vector<TrajectoryIndexEntry> index; // every frame in the file, in order
+    Column mass;
+
+    TrajectoryReader() = default;
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+    ~TrajectoryReader();
+
+    bool open(const std::string& path);
+    bool read(std::size_t frame, Bodies& bodies);
+    bool decode(const TrajectoryIndexEntry& entry, TrajectoryBlock& block, std::vector<uint8_t>& bytes,
+                TrajectoryFrame& now, TrajectoryFrame& before, TrajectoryFrame& before_that);
+
+private:
+    std::FILE* file = nullptr;
+    void scan_blocks(uint64_t offset, uint64_t end);
+};
+
+#endif //GPU_NBODY_TRAJECTORY_H
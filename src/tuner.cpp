@@ -0,0 +1,160 @@
+//
+// tuner.cpp
+// Picking theta and leaf_capacity, see tuner.h
+//
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <omp.h>
+
+#include "tuner.h"
+#include "direct.h"
+
+// ## IMPLEMENTATION FILE ##
+
+ForceTuner::ForceTuner(const Config& config)
+    : budget(config.tune_error), every(config.tune_every), samples(config.tune_samples),
+      theta(config.theta), leaf_capacity(config.leaf_capacity) {}
+
+/*  Method to pick theta and leaf_capacity for the bodies as they are now
+ *      inputs:         the bodies, the simulation's tree, its settings
+ *      outputs:        none
+ *      side effects:   sets theta and leaf_capacity on the tree, and leaves it built and propogated with them
+ *                      (so a refit next step carries on from it). The bodies' accelerations and the tree's
+ *                      interaction count and costs are put back how they were
+ */
+void ForceTuner::tune(Bodies& bodies, Quadtree& ygg, const Config& config) {
+    const std::size_t n = bodies.size();
+    if (n == 0 || thetas.empty()) { return; }
+    double start = omp_get_wtime();
+
+    // exact answers for the samples, once. they're the slow part: samples x n interactions
+    const std::size_t m = std::min(std::max<std::size_t>(samples, 1), n);
+    picked.resize(m);
+    exact.resize(m);
+    for (std::size_t k = 0; k < m; k++) { picked[k] = k * n / m; }
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (std::size_t k = 0; k < m; k++) {
+        exact[k] = direct_accel(bodies, bodies.pos(picked[k]), ygg.epsilon);
+    }
+
+    // timing force passes overwrites accelerations the next kick still needs
+    std::vector<double> ax(bodies.ax.begin(), bodies.ax.end());
+    std::vector<double> ay(bodies.ay.begin(), bodies.ay.end());
+    const std::size_t interactions = ygg.interactions;
+    const std::vector<float> cost = ygg.cost;
+
+    Quad root;
+    root.new_containing(bodies);
+    std::vector<double> sorted = thetas;
+    std::sort(sorted.begin(), sorted.end());
+    const std::vector<std::size_t> tried = config.morton_build ? leaves : std::vector<std::size_t>{ygg.leaf_capacity};
+
+    bool found = false;
+    double best_theta = sorted.front();
+    std::size_t best_leaf = ygg.leaf_capacity;
+    double best_error = 0;
+    double best_force = std::numeric_limits<double>::max();
+    for (std::size_t leaf : tried) {
+        ygg.leaf_capacity = leaf;
+        build(bodies, ygg, config, root);
+
+        // largest theta in budget, for this leaf size
+        double largest = -1;
+        double largest_error = 0;
+        for (double t : sorted) {
+            ygg.theta = t;
+            ygg.pack();
+            double e = measure_error(ygg, bodies);
+            if (e > budget) { break; }
+            largest = t;
+            largest_error = e;
+        }
+        if (largest < 0) { continue; }
+
+        ygg.theta = largest;
+        double seconds = force_pass(bodies, ygg, config, root);
+        if (seconds < best_force) {
+            found = true;
+            best_theta = largest;
+            best_leaf = leaf;
+            best_error = largest_error;
+            best_force = seconds;
+        }
+    }
+
+    if (!found) {
+        // the most accurate there is, on the leaf size it already had
+        best_leaf = config.morton_build ? leaf_capacity : ygg.leaf_capacity;
+        ygg.leaf_capacity = best_leaf;
+        ygg.theta = best_theta;
+        best_force = force_pass(bodies, ygg, config, root);
+        best_error = measure_error(ygg, bodies);
+        printf("Tuner: no theta gets the force error under %.3g%% (best %.3g%% at theta %.2f)\n",
+               budget * 100, best_error * 100, best_theta);
+    } else {
+        ygg.leaf_capacity = best_leaf;
+        ygg.theta = best_theta;
+        build(bodies, ygg, config, root);
+    }
+
+    std::copy(ax.begin(), ax.end(), bodies.ax.begin());
+    std::copy(ay.begin(), ay.end(), bodies.ay.begin());
+    ygg.interactions = interactions;
+    ygg.cost = cost;
+
+    theta = best_theta;
+    leaf_capacity = best_leaf;
+    error = best_error;
+    force = best_force;
+    spent += omp_get_wtime() - start;
+}
+
+/*  Method to work out how far off the tree is for the sample bodies
+ *      inputs:         the tree, packed for the theta being checked, and the bodies it was built from
+ *      outputs:        the 99th percentile relative error of their accelerations
+ */
+double ForceTuner::measure_error(Quadtree& ygg, const Bodies& bodies) {
+    const std::size_t m = picked.size();
+    errors.resize(m);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (std::size_t k = 0; k < m; k++) {
+        vec2 walked = ygg.accel(bodies.pos(picked[k]));
+        double off = vec2(walked.x - exact[k].x, walked.y - exact[k].y).mag();
+        double size = exact[k].mag();
+        errors[k] = (size > 0) ? off / size : 0.0;
+    }
+    const std::size_t at = (m - 1) * 99 / 100;
+    std::nth_element(errors.begin(), errors.begin() + at, errors.end());
+    return errors[at];
+}
+
+// Builds the tree from scratch with its leaf_capacity, and propogates it for its theta, like attract_tree()
+void ForceTuner::build(const Bodies& bodies, Quadtree& ygg, const Config& config, const Quad& root) {
+    if (config.morton_build) {
+        ygg.build_morton(bodies, root);
+    } else {
+        ygg.reset(root);
+        for (std::size_t i = 0; i < bodies.size(); i++) {
+            ygg.insert(bodies.pos(i), bodies.mass[i]);
+        }
+    }
+    ygg.quadrupole = config.quadrupole;
+    ygg.propogate();
+}
+
+/*  Method to time a whole force pass, the way attract_tree() would do it (never the FMM)
+ *      inputs:         the bodies, the tree with the theta and leaf_capacity to time, the settings, the root quad
+ *      outputs:        how many seconds the build and the walk took
+ *      side effects:   sets every body's acceleration
+ */
+double ForceTuner::force_pass(Bodies& bodies, Quadtree& ygg, const Config& config, const Quad& root) {
+    double start = omp_get_wtime();
+    build(bodies, ygg, config, root);
+    if (config.morton_build && config.group_size > 0) {
+        ygg.accel_grouped(bodies, config.group_size);
+    } else {
+        ygg.walk_bodies(bodies, nullptr);
+    }
+    return omp_get_wtime() - start;
+}
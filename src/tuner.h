@@ -0,0 +1,56 @@
+//
+// tuner.h
+// Picking theta and leaf_capacity from how much force error a run can live with, instead of by hand
+//
+
+#ifndef GPU_NBODY_TUNER_H
+#define GPU_NBODY_TUNER_H
+
+#include <cstddef>
+#include <vector>
+#include "quadtree.h"
+#include "config.h"
+
+/*  How far off the tree walk's accelerations are depends on theta, and how long it takes on theta and
+ *  leaf_capacity (and on how the bodies are spread out, which changes as the disk winds up). tune()
+ *  measures both on the bodies as they are right now:
+ *      error   tune_samples bodies, spread evenly through the list, get their exact acceleration
+ *              (direct_accel). For each theta their tree walk is checked against that, and the error
+ *              is the 99th percentile of |tree - exact| / |exact| over them
+ *      cost    error only goes up with theta, and so for each leaf_capacity the largest theta that's
+ *              within tune_error is the fastest one worth trying. That gets timed for real: build,
+ *              propogate and a whole force pass, the way attract_tree() does them
+ *  The fastest of those wins. If nothing's within the budget it's the smallest theta there is
+ *  The walk checked is one body at a time, so it's on the safe side for the grouped walk, which is
+ *  never less accurate than that (see accel_grouped())
+ *  Only the Barnes-Hut walk gets tuned. leaf_capacity only means anything with morton_build
+ */
+struct ForceTuner {
+    double budget = TUNE_ERROR;       // tune_error, the most error allowed. 0 = never tune
+    std::size_t every = TUNE_EVERY;   // tune again every this many frames
+    std::size_t samples = TUNE_SAMPLES;
+    std::vector<double> thetas = {0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0, 1.2};
+    std::vector<std::size_t> leaves = {4, 8, 16, 32, 64};
+
+    // what the last tune() picked, and what it measured for it
+    double theta = THETA;
+    std::size_t leaf_capacity = LEAF_CAPACITY;
+    double error = 0;   // its 99th percentile relative force error
+    double force = 0;   // seconds for a force pass with it
+    double spent = 0;   // seconds all the tuning's taken, added up
+
+    explicit ForceTuner(const Config& config = Config());
+    bool due(std::size_t frame) const { return budget > 0 && every > 0 && frame % every == 0; }
+    void tune(Bodies& bodies, Quadtree& ygg, const Config& config);
+
+private:
+    std::vector<std::size_t> picked; // the sample bodies
+    std::vector<vec2> exact;         // and their exact accelerations
+    std::vector<double> errors;
+
+    double measure_error(Quadtree& ygg, const Bodies& bodies);
+    void build(const Bodies& bodies, Quadtree& ygg, const Config& config, const Quad& root);
+    double force_pass(Bodies& bodies, Quadtree& ygg, const Config& config, const Quad& root);
+};
+
+#endif //GPU_NBODY_TUNER_H
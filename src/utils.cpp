@@ -5,126 +5,237 @@
 #include <cstdlib>
 #include <vector>
 #include <random>
+#include <array>
+#include <string>
+#include <algorithm>
 
 #include "Constants.h"
 #include "quadtree.h"
+#include "utils.h"
+#include "philox.h"
+#include "snapshot.h"
 
 
 // setting up the randomizer for body generation later
-// create random device and engine
+// the OS's random device, only used to pick a seed when the config doesn't have one
 std::random_device rd;                   // non-deterministic seed
-std::mt19937 gen(rd());                  // Mersenne Twister engine
-
-// create distribution
-std::uniform_real_distribution<> mass_dist(BODY_MIN_MASS, BODY_MAX_MASS);
-std::uniform_real_distribution<> pos_dist(0,std::min(HEIGHT/2,WIDTH/2));
-// takes the min so we dont generate bodies out-of-bounds
 
 //  builds a quadtree given a list of bodies
 //  gets a reference to the list
-Quadtree build_quadtree(std::vector<Body>& bodies) {
+Quadtree build_quadtree(const Bodies& bodies) {
     Quadtree ygg;
     Quad root;
     root.new_containing(bodies);
     ygg.reset(root); // wipes the tree clean, rebases it with the new root
 
-    // for each body in bodies (getting a reference, read-only)
-    for (const Body& body : bodies) {
-        ygg.insert(body.pos, body.mass);
+    // for each body in bodies
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        ygg.insert(bodies.pos(i), bodies.mass[i]);
     }
     printf("Yggdrasil built!\n");
     return ygg;
 }
 
-/* Helper function to generate a vector (list) of bodies with randomized properties
- *      input: a double n representing the number of bodies to generate
- *      returns: list of bodies
- *      side effects: none
+/*  Method to pick the seed bodies get generated from
+ *  config.seed if there is one, otherwise a fresh one from the OS (which gets printed with the bodies,
+ *  so a run that turns out interesting can be made again with --seed)
+ *  each call with seed 0 gets a different one, so main() calls it once and puts it in config.seed
+ *  before anything else sees the config
  */
-std::vector<Body> gen_bodies(double n) {
-    // creates a list of body objects of length n
-    std::vector<Body> bodies(n);
-    // If we're using random body masses, generates masses as well as positions randomly within set ranges
-    // Otherwise, just generates the positions randomly
-    if (RANDOM_BODY_MASS == 1) {
-        for (Body& body : bodies) {
-            body.mass = mass_dist(gen);
-            body.pos.x = pos_dist(gen);
-            body.pos.y = pos_dist(gen);
-        }
-    } else {
-        for (Body& body : bodies) {
-            body.mass = BODY_FIXED_MASS;
-            body.pos.x = pos_dist(gen);
-            body.pos.y = pos_dist(gen);
-            //printf("Body position (in Kg): %lf , %lf", body.pos.x, body.pos.y);
-            //printf("\n");
+uint64_t pick_seed(const Config& config) {
+    if (config.seed != 0) { return config.seed; }
+    uint64_t seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    return seed != 0 ? seed : 1;
+}
 
-        }
-    }
+/*  One body of the uniform layout
+ *  If we're using random body masses, generates masses as well as positions randomly within set ranges
+ *  Otherwise, just generates the positions randomly
+ */
+static Body uniform_body(std::size_t i, const Philox& rng, const Config& config) {
+    Body body;
+    body.vel = vec2(0, 0);
+    body.accel = vec2(0, 0);
 
     // Makes one body absolutely fuckoff huge
     // this is to mimic a central "star" or black hole
-    // leaving the position random for now just to see what happens
-    bodies[0].mass = BODY_FIXED_MASS * 1024;
-    bodies[0].pos.x = WIDTH/2;
-    bodies[0].pos.y = HEIGHT/2;
+    if (i == 0) {
+        body.mass = config.body_fixed_mass * 1024;
+        body.pos = vec2(config.width/2, config.height/2);
+        return body;
+    }
 
-    printf("Done generating bodies\n");
-    return bodies;
+    // takes the min so we dont generate bodies out-of-bounds
+    const double pos_max = std::min(config.height/2, config.width/2);
+    std::array<double, 2> pos = rng.uniform2(i, 0);
+    body.pos = vec2(pos[0] * pos_max, pos[1] * pos_max);
+    if (config.random_body_mass) {
+        double u = rng.uniform2(i, 1)[0];
+        body.mass = config.body_min_mass + u * (config.body_max_mass - config.body_min_mass);
+    } else {
+        body.mass = config.body_fixed_mass;
+    }
+    return body;
 }
 
-
-std::vector<Body> gen_bodies_disk(double n) {
-    std::vector<Body> bodies(n);
+// One body of the disk layout (body 0 is the central mass)
+static Body disk_body(std::size_t i, const Philox& rng, const Config& config) {
+    Body body;
+    body.accel = vec2(0, 0);
 
     // Central massive body (star/black hole)
-    bodies[0].mass = 100;
-    bodies[0].pos = vec2(HEIGHT/2, WIDTH/2);  // Center of screen
-    bodies[0].vel = vec2(0, 0);
-    bodies[0].accel = vec2(0, 0);
+    const double centralMass = 100;
+    if (i == 0) {
+        body.mass = centralMass;
+        body.pos = vec2(0, 0);  // Center of screen (toPixelSpace puts the origin in the middle)
+        body.vel = vec2(0, 0);
+        return body;
+    }
 
     // Disk parameters
-    const double centerX = HEIGHT/2;
-    const double centerY = WIDTH/2;
-    const double innerRadius = INNER_RADIUS; // was 50   // Minimum distance from center
-    const double outerRadius = OUTER_RADIUS;  // was 400 //Maximum distance from center
+    const double innerRadius = config.inner_radius; // was 50   // Minimum distance from center
+    const double outerRadius = config.outer_radius;  // was 400 //Maximum distance from center
     const double diskThickness = 0.08; // How "flat" the disk is
 
-    // Random distributions
-    std::uniform_real_distribution<> angle_dist(0, 2 * 3.14159265);
-    std::uniform_real_distribution<> radius_dist(innerRadius, outerRadius);
-    std::uniform_real_distribution<> thickness_dist(-diskThickness, diskThickness);
-    std::uniform_real_distribution<> mass_variation(0.8, 1.2);
+    // every number this body needs, uniform in [0, 1)
+    std::array<double, 2> a = rng.uniform2(i, 0);
+    std::array<double, 2> b = rng.uniform2(i, 1);
+    std::array<double, 2> c = rng.uniform2(i, 2);
 
-    for (size_t i = 1; i < n; i++) {
-        // Mass in your mass units
-        bodies[i].mass = 0.001 * mass_variation(gen);  // Small bodies
+    // Mass in your mass units
+    body.mass = 0.001 * (0.8 + 0.4 * a[0]);  // Small bodies
 
-        // Position - centered at origin
-        double angle = angle_dist(gen);
-        double radius = radius_dist(gen);  // in your length units
+    // Position - centered at origin
+    double angle = 2 * 3.14159265 * a[1];
+    double radius = innerRadius + (outerRadius - innerRadius) * b[0];  // in your length units
 
-        bodies[i].pos.x = radius * cos(angle);
-        bodies[i].pos.y = radius * sin(angle) + thickness_dist(gen);
+    body.pos.x = radius * cos(angle);
+    body.pos.y = radius * sin(angle) + diskThickness * (2 * b[1] - 1);
 
-        // Orbital velocity using your scaled G
-        // v = sqrt(G * M / r) where everything is in your units
-        const double G_scaled = G;  // Your calculated G
-        double centralMass = bodies[0].mass;
-        double orbitalSpeed = sqrt(G_scaled * centralMass / radius)/2;
+    // Orbital velocity using your scaled G
+    // v = sqrt(G * M / r) where everything is in your units
+    const double G_scaled = G;  // Your calculated G
+    double orbitalSpeed = sqrt(G_scaled * centralMass / radius)/2;
 
-        // Add some eccentricity
-        std::uniform_real_distribution<> velocity_variation(0.9, 1.1);
-        orbitalSpeed *= velocity_variation(gen);
+    // Add some eccentricity
+    orbitalSpeed *= 0.9 + 0.2 * c[0];
 
-        // Velocity perpendicular to radius (tangent for circular orbit)
-        bodies[i].vel.x = -orbitalSpeed * sin(angle);
-        bodies[i].vel.y = orbitalSpeed * cos(angle);
+    // Velocity perpendicular to radius (tangent for circular orbit)
+    body.vel.x = -orbitalSpeed * sin(angle);
+    body.vel.y = orbitalSpeed * cos(angle);
+    return body;
+}
 
-        bodies[i].accel = vec2(0, 0);
+/*  Method to make body i of config.layout
+ *      inputs:         which body, the seed, the settings
+ *      outputs:        the body
+ *      side effects:   none
+ *
+ *  everything random about body i comes from Philox keyed with the seed and counting with i, so it
+ *  depends on nothing but (seed, i). bodies can be made in any order, on any number of threads,
+ *  and the same seed always gives the same bodies, bit for bit
+ */
+Body gen_body(std::size_t i, uint64_t seed, const Config& config) {
+    Philox rng(seed);
+    if (config.layout == "uniform") {
+        return uniform_body(i, rng, config);
     }
+    return disk_body(i, rng, config);
+}
 
-    printf("Done generating %zu bodies in disk configuration\n", n);
+/* Helper function to generate a vector (list) of bodies with randomized properties
+ *      input: a double n representing the number of bodies to generate
+ *      returns: list of bodies
+ *      side effects: none
+ */
+std::vector<Body> gen_bodies(double n, const Config& config) {
+    // creates a list of body objects of length n
+    std::vector<Body> bodies(n);
+    const Philox rng(pick_seed(config));
+    #pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        bodies[i] = uniform_body(i, rng, config);
+    }
+
+    printf("Done generating bodies (seed %llu)\n", static_cast<unsigned long long>(rng.seed));
+    return bodies;
+}
+
+std::vector<Body> gen_bodies_disk(double n, const Config& config) {
+    std::vector<Body> bodies(n);
+    const Philox rng(pick_seed(config));
+    #pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        bodies[i] = disk_body(i, rng, config);
+    }
+
+    printf("Done generating %zu bodies in disk configuration (seed %llu)\n", bodies.size(),
+           static_cast<unsigned long long>(rng.seed));
+    return bodies;
+}
+
+/*  Method to make the bodies a simulation starts from: config.num_bodies of config.layout, made straight
+ *  into the arrays (no vector of Body in between), or read from config.ic_file if that's set
+ */
+Bodies gen_bodies_for(const Config& config) {
+    Bodies bodies;
+    if (!config.ic_file.empty()) {
+        Snapshot snapshot;
+        if (!read_snapshot(config.ic_file, snapshot)) {
+            exit(1);
+        }
+        printf("Loaded %zu bodies from %s\n", snapshot.bodies.size(), config.ic_file.c_str());
+        return std::move(snapshot.bodies);
+    }
+
+    const uint64_t seed = pick_seed(config);
+    bodies.resize(config.num_bodies);
+    #pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        bodies.set(i, gen_body(i, seed, config));
+    }
+    printf("Done generating %zu bodies in %s configuration (seed %llu)\n", bodies.size(),
+           config.layout.c_str(), static_cast<unsigned long long>(seed));
     return bodies;
 }
+
+/*  Method to generate config.num_bodies bodies straight into a snapshot file, a chunk at a time
+ *      inputs:         where to write them, the settings
+ *      outputs:        false if the file couldn't be written
+ *      side effects:   writes the file. only one chunk (a million bodies, 40 MB) is ever in memory, so
+ *                      this works for more bodies than fit in RAM
+ */
+bool stream_bodies(const std::string& path, const Config& config) {
+    const std::size_t chunk = 1 << 20;
+    SnapshotHeader header;
+    header.count = config.num_bodies;
+    header.seed = pick_seed(config);
+    header.delta_t = config.delta_t;
+
+    SnapshotWriter writer;
+    if (!writer.open(path, header)) { return false; }
+
+    std::vector<double> x(chunk), y(chunk), vx(chunk), vy(chunk), mass(chunk);
+    const double* const columns[SNAPSHOT_IC_COLUMNS] = {x.data(), y.data(), vx.data(), vy.data(), mass.data()};
+    for (std::size_t first = 0; first < header.count; first += chunk) {
+        const std::size_t count = std::min(chunk, header.count - first);
+        #pragma omp parallel for schedule(static)
+        for (std::size_t k = 0; k < count; k++) {
+            Body body = gen_body(first + k, header.seed, config);
+            x[k] = body.pos.x;
+            y[k] = body.pos.y;
+            vx[k] = body.vel.x;
+            vy[k] = body.vel.y;
+            mass[k] = body.mass;
+        }
+        for (int c = 0; c < SNAPSHOT_IC_COLUMNS; c++) {
+            if (!writer.write(c, first, count, columns[c])) { return false; }
+        }
+    }
+    if (!writer.close()) { return false; }
+
+    printf("Wrote %llu bodies in %s configuration (seed %llu) to %s\n",
+           static_cast<unsigned long long>(header.count), config.layout.c_str(),
+           static_cast<unsigned long long>(header.seed), path.c_str());
+    return true;
+}
@@ -11,25 +11,38 @@
 
 #include <vector>
 #include <random>
+#include <string>
+#include <cstdint>
 #include "Constants.h"
 #include "quadtree.h"
+#include "config.h"
 
 // === Randomization Globals ===
-// Declare (but don't define) the random engine and distributions
-// These are defined in utils.cpp
+// Declare (but don't define) the random device
+// This is defined in utils.cpp
 extern std::random_device rd;
-extern std::mt19937 gen;
-extern std::uniform_real_distribution<> mass_dist;
-extern std::uniform_real_distribution<> pos_dist;
 
 // === Function Prototypes ===
 
 // Builds a quadtree from a list of bodies
-Quadtree build_quadtree(std::vector<Body>& bodies);
+Quadtree build_quadtree(const Bodies& bodies);
 
 // Generates a list of bodies with random positions/masses
-std::vector<Body> gen_bodies(double n);
-std::vector<Body> gen_bodies_disk(double n);
+// (masses, radii and image size from the config, the Constants.h defaults if there isn't one)
+std::vector<Body> gen_bodies(double n, const Config& config = Config());
+std::vector<Body> gen_bodies_disk(double n, const Config& config = Config());
+
+// The seed to generate from: config.seed, or a random one if that's 0
+uint64_t pick_seed(const Config& config);
+
+// Body i of config.layout, depends only on (seed, i)
+Body gen_body(std::size_t i, uint64_t seed, const Config& config);
+
+// Generates config.num_bodies bodies in config.layout (or loads config.ic_file)
+Bodies gen_bodies_for(const Config& config);
+
+// Generates config.num_bodies bodies in config.layout straight into a snapshot file
+bool stream_bodies(const std::string& path, const Config& config);
 
 
 #endif //GPU_NBODY_UTILS_H
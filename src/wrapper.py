@@ -3,8 +3,8 @@ Barnes-Hut N-Body Simulator GUI
 Author: Cassidy Ureda
 
 This program provides a graphical interface for running the Barnes-Hut gravitational
-simulator. It allows users to modify simulation parameters, recompiles the C++ code
-with those parameters, and runs the simulation while showing progress.
+simulator. It allows users to modify simulation parameters and runs the simulation
+with them (as command line flags, no recompiling) while showing progress.
 
 Requirements:
     - tkinter (usually comes with Python)
@@ -21,6 +21,7 @@ import subprocess
 import threading
 import os
 import re
+import json
 import glob
 
 class SimulatorGUI:
@@ -36,9 +37,11 @@ class SimulatorGUI:
         self.root.geometry("1800x900")
         self.root.resizable(True, True)
 
-        # Path to the constants header file
+        # Path to the constants header file (only read for the default values now,
+        # the settings go to the binary as flags)
         # Adjust this if your directory structure is different
         self.constants_path = "../src/Constants.h"
+        self.build_dir = "../build"
 
         # Store original values from Constants.h
         self.original_values = self.read_constants()
@@ -316,53 +319,54 @@ class SimulatorGUI:
             self.sliders = {}
         self.sliders[key] = slider
 
-    def write_constants(self, num_bodies, width, height):
+    def simulation_args(self, num_bodies, num_frames, width, height):
         """
-        Rewrite the Constants.h file with new values.
-        This reads the original file and replaces specific #define values.
+        Build the command line for one run.
+        Every setting in the simulator can be passed as --key value (./gpu_nbody --help
+        lists them), so changing one doesn't need a recompile.
 
         Args:
-            num_bodies: New value for NUM_BODIES
-            width: New value for WIDTH
-            height: New value for HEIGHT
-        """
-        try:
-            # Read the original file
-            with open(self.constants_path, 'r') as f:
-                content = f.read()
-
-            # Replace the specific values we care about
-            # Using regex to find and replace #define statements
-            content = re.sub(
-                r'#define\s+NUM_BODIES\s+\([^)]+\)',
-                f'#define NUM_BODIES ({num_bodies})',
-                content
-            )
-            content = re.sub(
-                r'#define\s+WIDTH\s+[^\s/]+',
-                f'#define WIDTH\t{width}',
-                content
-            )
-            content = re.sub(
-                r'#define\s+HEIGHT\s+[^\s/]+',
-                f'#define HEIGHT\t{height}',
-                content
-            )
+            num_bodies: Number of bodies to simulate
+            num_frames: Number of frames to generate
+            width: Image width in pixels
+            height: Image height in pixels
 
-            # Write the modified content back
-            with open(self.constants_path, 'w') as f:
-                f.write(content)
+        Returns:
+            list: The command to run, binary first
+        """
+        return [
+            './gpu_nbody', str(num_frames),
+            '--num_bodies', str(num_bodies),
+            '--width', str(width),
+            '--height', str(height),
+        ]
+
+    def ensure_built(self):
+        """
+        Compile the simulator once, if there's no binary yet.
+        After that every run reuses it, whatever the settings.
 
+        Returns:
+            bool: True if the binary is there (or was just built)
+        """
+        if os.path.exists(os.path.join(self.build_dir, 'gpu_nbody')):
             return True
 
-        except Exception as e:
-            print(f"Error writing constants: {e}")
+        compile_result = subprocess.run(
+            ['cmake', '--build', '.'],
+            cwd=self.build_dir,
+            capture_output=True,
+            text=True
+        )
+        if compile_result.returncode != 0:
+            print("Compilation error:", compile_result.stderr)
             return False
+        return True
 
     def run_simulation(self):
         """
         Main function that runs when the "Run" button is clicked.
-        This handles the entire workflow: rewriting constants, compiling, and running.
+        This handles the entire workflow: compiling (if needed) and running.
         """
         # Get values from the sliders
         num_bodies = int(self.sliders['number_of_bodies'].get())
@@ -376,7 +380,7 @@ class SimulatorGUI:
 
         # Show the progress section
         self.progress_frame.grid()
-        self.progress_label.config(text="Writing configuration...")
+        self.progress_label.config(text="Starting...")
         self.progress_bar['value'] = 0
 
         # Run the compilation and simulation in a separate thread
@@ -391,7 +395,7 @@ class SimulatorGUI:
     def run_simulation_thread(self, num_bodies, num_frames, width, height):
         """
         This function runs in a separate thread to avoid freezing the GUI.
-        It performs the compile and run steps.
+        It performs the compile (first run only) and run steps.
 
         Args:
             num_bodies: Number of bodies to simulate
@@ -402,40 +406,29 @@ class SimulatorGUI:
         import time
 
         try:
-            # Step 1: Write new constants
-            if not self.write_constants(num_bodies, width, height):
-                self.update_progress("Error writing configuration!", 0)
-                return
-
-            # Step 2: Compile the C++ code using cmake
+            # Step 1: Make sure there's a binary to run (only compiles the first time)
             self.update_progress("Compiling...", 10)
-
-            # Change to the build directory
-            # CMake projects compile from the build directory
-            compile_result = subprocess.run(
-                ['cmake', '--build', '.'],
-                cwd='../build',
-                capture_output=True,
-                text=True
-            )
-
-            if compile_result.returncode != 0:
+            if not self.ensure_built():
                 self.update_progress("Compilation failed!", 0)
-                print("Compilation error:", compile_result.stderr)
                 return
 
-            # Step 3: Run the simulation
+            # Step 2: Run the simulation, with the settings as flags
             self.update_progress("Running simulation...", 30)
 
-            # Run the compiled binary with the frame count argument
+            # Run the compiled binary with the frame count and settings
             # The binary should be in ../build after compilation
+            # Progress comes back as telemetry (one JSON object per line, see telemetry.h) on a pipe
+            # of its own, so it never gets mixed up with what the simulator prints
+            telemetry_read, telemetry_write = os.pipe()
             process = subprocess.Popen(
-                ['./gpu_nbody', str(num_frames)],
-                cwd='../build',
-                stdout=subprocess.PIPE,
+                self.simulation_args(num_bodies, num_frames, width, height)
+                + ['--telemetry', f'fd:{telemetry_write}'],
+                cwd=self.build_dir,
+                pass_fds=(telemetry_write,),
                 stderr=subprocess.PIPE,
                 text=True
             )
+            os.close(telemetry_write)  # the simulator has its copy, the pipe ends when it exits
 
             # Store the process so it can be stopped
             self.running_process = process
@@ -444,16 +437,19 @@ class SimulatorGUI:
             step_times = []  # Store time taken for each step
             last_step_time = time.time()
 
-            # Monitor the output to track progress
-            # Your C++ code prints "Step N" for each frame
-            for line in process.stdout:
-                print(line.strip())  # Also print to console
+            # Monitor the telemetry to track progress
+            # there's a "step" line for each frame as soon as it's simulated
+            telemetry = os.fdopen(telemetry_read)
+            for line in telemetry:
+                try:
+                    record = json.loads(line)
+                except ValueError:
+                    continue
 
-                # Look for "Step X" in the output
-                if "Step" in line:
+                if record.get("type") == "step":
                     try:
-                        # Extract the step number
-                        step = int(line.split()[1])
+                        # The step number
+                        step = record["frame"]
 
                         # Calculate time for this step
                         current_time = time.time()
@@ -492,11 +488,13 @@ class SimulatorGUI:
                     except:
                         pass
 
+            telemetry.close()
+
             # Wait for the process to complete
             process.wait()
 
             if process.returncode == 0:
-                self.update_progress("Complete! Video saved to images/", 100)
+                self.update_progress("Complete! Frames saved to images/", 100)
                 self.update_prediction_text("Begin simulation for estimate")
             else:
                 # Check if it was terminated by stop button
@@ -563,10 +561,13 @@ class SimulatorGUI:
         """
         try:
             # Construct the filename based on the step number
-            image_path = f"../build/images/Step{step:05d}.ppm"
+            # frames are QOI by default (Pillow reads those since 9.5), PPM with --frame_sink ppm
+            image_path = f"../build/images/Step{step:05d}.qoi"
+            if not os.path.exists(image_path):
+                image_path = f"../build/images/Step{step:05d}.ppm"
 
             if os.path.exists(image_path):
-                # Load the PPM image
+                # Load the frame
                 img = Image.open(image_path)
 
                 # Resize to fit in the preview area (max 800x800, maintain aspect ratio)
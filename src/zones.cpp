@@ -0,0 +1,91 @@
+//
+// zones.cpp
+// Cost zones and thread pinning, see zones.h
+//
+#include <cstdlib>
+#include <vector>
+#include <omp.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "zones.h"
+
+// ## IMPLEMENTATION FILE ##
+
+/*  Method to cut the items into zones of about equal cost
+ *      inputs:         what each item cost (in the order they should be handed out), how many, how many zones
+ *      outputs:        none
+ *      side effects:   resets the zones' cursors to the new cuts, and stolen to 0. each cut goes where it's
+ *                      closest to its share of the total. with nothing costing anything they're cut by count
+ */
+void CostZones::split(const float* cost, std::size_t items, int zones) {
+    zones = std::max(zones, 1);
+    if (zones > allocated) {
+        cursors.reset(new Cursor[zones]);
+        allocated = zones;
+    }
+    count = zones;
+    stolen.store(0, std::memory_order_relaxed);
+
+    double total = 0;
+    for (std::size_t k = 0; k < items; k++) { total += cost[k]; }
+
+    double running = 0;
+    std::size_t k = 0;
+    for (int z = 0; z < zones; z++) {
+        cursors[z].next.store(k, std::memory_order_relaxed);
+        if (z + 1 == zones) {
+            k = items;
+        } else if (total <= 0) {
+            k = items * (z + 1) / zones;
+        } else {
+            const double target = total * (z + 1) / zones;
+            while (k < items && running + 0.5 * cost[k] <= target) {
+                running += cost[k];
+                k++;
+            }
+        }
+        cursors[z].end = k;
+    }
+}
+
+CostZones::Taker CostZones::taker(std::size_t chunk) {
+    Taker take;
+    take.zones = this;
+    take.chunk = std::max<std::size_t>(chunk, 1);
+    take.home = (count > 0) ? omp_get_thread_num() % count : 0;
+    take.visited = (count > 0) ? 0 : 1; // no zones yet, nothing to take
+    return take;
+}
+
+/*  Method to keep each OpenMP thread on one CPU, so the pages it touched first (see first_touch()) stay in
+ *  the memory next to it, and the caches it warmed up stay warm
+ *  the main thread is left alone: threads started from it (the renderer, the frame writers, ...) start off
+ *  on whatever it's allowed on, and they shouldn't all be stuck on the one CPU. with OMP_PROC_BIND set
+ *  the OpenMP runtime does the pinning itself, so this doesn't. only does anything on Linux
+ */
+void pin_threads() {
+#ifdef __linux__
+    if (std::getenv("OMP_PROC_BIND") != nullptr) { return; }
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) { return; }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) { cpus.push_back(cpu); }
+    }
+    if (cpus.empty()) { return; }
+
+    #pragma omp parallel
+    {
+        const int thread = omp_get_thread_num();
+        if (thread != 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpus[thread % cpus.size()], &one);
+            sched_setaffinity(0, sizeof(one), &one);
+        }
+    }
+#endif
+}
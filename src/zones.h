@@ -0,0 +1,77 @@
+//
+// zones.h
+// Cost zones: splitting the force loop between threads by how much work each part is, not how many bodies
+//
+
+#ifndef GPU_NBODY_ZONES_H
+#define GPU_NBODY_ZONES_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/*  A walk out in the sparse edge of the disk touches a handful of nodes, one in the middle thousands.
+ *  Cutting the bodies into equal counts per thread leaves whoever got the middle working long after
+ *  everyone else is done. So the items (groups, or bodies) go in Morton order, where neighbours in the
+ *  list are neighbours in space, with what each cost last step, and split() cuts the list into one zone
+ *  per thread where the running total crosses each 1/zones of the whole
+ *  The costs are from last step, so they're off by a bit. Each thread works through its own zone from
+ *  the front, chunk items at a time, and once it's out takes chunks off the front of the others (next
+ *  zone along first). So nobody sits idle while there's still work, and most of the time a thread only
+ *  ever works on its own stretch of space, which is also what its cache has in it
+ *      zones.split(cost, items, omp_get_max_threads());
+ *      #pragma omp parallel
+ *      for (CostZones::Taker take = zones.taker(chunk); take.next(); ) {
+ *          for (std::size_t k = take.begin; k < take.end; k++) { ... }
+ *      }
+ *  Copying one gives an empty one, the zones are just scratch space for the loop that's running
+ */
+struct CostZones {
+    struct alignas(64) Cursor { // a cache line each, so threads taking from different zones don't fight over one
+        std::atomic<std::size_t> next{0};
+        std::size_t end = 0;
+    };
+
+    // one thread's way through the zones, its own first
+    struct Taker {
+        CostZones* zones = nullptr;
+        std::size_t chunk = 1;
+        int home = 0;    // its own zone
+        int visited = 0; // zones it's emptied so far
+        std::size_t begin = 0, end = 0; // the chunk next() just took
+
+        bool next() {
+            while (visited < zones->count) {
+                Cursor& cursor = zones->cursors[(home + visited) % zones->count];
+                begin = cursor.next.fetch_add(chunk, std::memory_order_relaxed);
+                if (begin < cursor.end) {
+                    end = std::min(begin + chunk, cursor.end);
+                    if (visited > 0) { zones->stolen.fetch_add(1, std::memory_order_relaxed); }
+                    return true;
+                }
+                visited++;
+            }
+            return false;
+        }
+    };
+
+    std::atomic<std::size_t> stolen{0}; // chunks taken out of some other thread's zone, since the last split()
+
+    CostZones() = default;
+    CostZones(const CostZones&) {}
+    CostZones& operator=(const CostZones&) { return *this; }
+
+    void split(const float* cost, std::size_t items, int zones);
+    Taker taker(std::size_t chunk); // for the calling thread, inside the parallel region
+
+private:
+    std::unique_ptr<Cursor[]> cursors;
+    int count = 0;     // zones
+    int allocated = 0; // cursors there's room for
+};
+
+// Pins every OpenMP thread but the main one to a CPU of its own (of the ones we're allowed on), see zones.cpp
+void pin_threads();
+
+#endif //GPU_NBODY_ZONES_H